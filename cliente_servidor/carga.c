@@ -0,0 +1,518 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "protocol.h"
+
+#define MAXLINE 4096
+#define MAXEVENTS 256
+#define OUTPUT_BYTES 1024       /* default size of the output sent for each command */
+#define LOAD_TIMEOUT 60         /* seconds before unfinished agents are counted as failed */
+#define EXIT_KEY_WORD  "EXIT"
+
+#define HIST_SUBBUCKETS 64      /* buckets per power of two, 1/64 or about 1.6% precision */
+#define HIST_BUCKETS (40 * HIST_SUBBUCKETS)
+
+// Load generator: opens many agent connections at once from a single process, answers
+// every command with a synthetic output, and reports latency percentiles per phase.
+//
+// Phases measured for each agent:
+//   connect     connect() until the socket is writable
+//   first_byte  connection established until the first byte from the server
+//   command     a command arrives until the next one (or EXIT) arrives, which covers
+//               sending the whole output and the server storing it
+//   session     connect() until EXIT
+
+/** @brief Log-linear latency histogram, in microseconds.
+ */
+struct histogram {
+    const char *name;
+    long long counts[HIST_BUCKETS];
+    long long total;
+    long long max;
+};
+
+enum agentState {
+    CONNECTING,
+    RUNNING
+};
+
+/** @brief State of one emulated agent.
+ */
+struct agent {
+    int fd;
+    enum agentState state;
+    int gotByte;
+    struct timespec started;
+    struct timespec connected;
+    struct timespec lastCommand;
+    unsigned char in[FRAME_MAXSIZE];
+    size_t inLen;
+    unsigned char *out;
+    size_t outLen;
+    size_t outSent;
+    size_t outCap;
+};
+
+struct histogram connectHist = { .name = "connect" };
+struct histogram firstByteHist = { .name = "first_byte" };
+struct histogram commandHist = { .name = "command" };
+struct histogram sessionHist = { .name = "session" };
+
+char *output;                   /* synthetic command output */
+int outputBytes = OUTPUT_BYTES;
+long long commands;
+
+// WRAPPER FUNCTIONS
+
+/** @brief Wrapper function for socket: creates socket given configurations.
+ *
+ *  @param family address family.
+ *  @param type socket type.
+ *  @param flags extra information for the socket behaviour.
+ *  @return identification of the created socket.
+ */
+int Socket(int family, int type, int flags) {
+    int sockfd;
+
+    if ((sockfd = socket(family, type, flags)) < 0) {
+        perror("socket error");
+        exit(1);
+    }
+
+    return sockfd;
+}
+
+/** @brief Wrapper function for inet_pton: transforms ip from text form to binary form.
+ *
+ *  @param family address family.
+ *  @param ip ip being transformed.
+ *  @param addr where the address is stored.
+ */
+void InetPton(int family, char* ip, void * addr) {
+    if (inet_pton(family, ip, addr) <= 0) {
+        perror("inet_pton error");
+        exit(1);
+    }
+}
+
+/** @brief Wrapper function for epoll_ctl: changes the descriptors watched by an epoll instance.
+ *
+ *  @param epfd epoll identifier.
+ *  @param op operation.
+ *  @param fd socket identifier.
+ *  @param event events to watch and data returned with them.
+ */
+void EpollCtl(int epfd, int op, int fd, struct epoll_event *event) {
+    if (epoll_ctl(epfd, op, fd, event) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+// HELPER FUNCTIONS
+
+/** @brief validates the number of parameters, suggesting the correct usage in case of error.
+ *
+ *  @param argc number of arguments.
+ *  @param argv arguments.
+ */
+void assertValidArgs(int argc, char **argv) {
+    char   error[MAXLINE + 1];
+
+    if ((argc != 4 && argc != 5) || atoi(argv[3]) < 1 || (argc == 5 && atoi(argv[4]) < 0)) {
+        strcpy(error,"uso: ");
+        strcat(error,argv[0]);
+        strcat(error," <IPaddress> <Port> <Agents> [OutputBytes]");
+        perror(error);
+        exit(1);
+    }
+}
+
+/** @brief Microseconds elapsed between two monotonic timestamps.
+ *
+ *  @param from start timestamp.
+ *  @param to end timestamp.
+ *  @return elapsed time in microseconds.
+ */
+long long elapsedUs(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000LL + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/** @brief Adds a sample to a histogram.
+ *
+ *  @param hist histogram.
+ *  @param us sample in microseconds.
+ */
+void histRecord(struct histogram *hist, long long us) {
+    int bucket;
+
+    if (us < 0) {
+        us = 0;
+    }
+
+    // Values are exact up to two sub-bucket ranges, then keep 7 significant bits: the
+    // leading one picks the power of two, the other 6 one of its HIST_SUBBUCKETS buckets
+    if (us < 2 * HIST_SUBBUCKETS) {
+        bucket = us;
+    } else {
+        int exp = 63 - __builtin_clzll(us) - 6;
+        bucket = (exp + 1) * HIST_SUBBUCKETS + (us >> exp) - HIST_SUBBUCKETS;
+    }
+    if (bucket >= HIST_BUCKETS) {
+        bucket = HIST_BUCKETS - 1;
+    }
+
+    hist->counts[bucket]++;
+    hist->total++;
+    if (us > hist->max) {
+        hist->max = us;
+    }
+}
+
+/** @brief Lowest value of a histogram bucket.
+ *
+ *  @param bucket bucket index.
+ *  @return value in microseconds.
+ */
+long long histValue(int bucket) {
+    if (bucket < 2 * HIST_SUBBUCKETS) {
+        return bucket;
+    }
+
+    int exp = bucket / HIST_SUBBUCKETS - 1;
+    return (long long) (bucket % HIST_SUBBUCKETS + HIST_SUBBUCKETS) << exp;
+}
+
+/** @brief Value below which a fraction of the samples fall.
+ *
+ *  @param hist histogram.
+ *  @param fraction between 0 and 1.
+ *  @return value in microseconds.
+ */
+long long histPercentile(struct histogram *hist, double fraction) {
+    long long rank = (long long) (fraction * hist->total + 0.5);
+    long long seen = 0;
+
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if ((seen += hist->counts[i]) >= rank) {
+            return histValue(i) < hist->max ? histValue(i) : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+/** @brief Prints a histogram as a JSON object.
+ *
+ *  @param hist histogram.
+ */
+void histPrint(struct histogram *hist) {
+    printf("\"%s\":{\"count\":%lld,\"p50_us\":%lld,\"p90_us\":%lld,\"p99_us\":%lld,\"p999_us\":%lld,\"max_us\":%lld}",
+        hist->name, hist->total, histPercentile(hist, 0.5), histPercentile(hist, 0.9),
+        histPercentile(hist, 0.99), histPercentile(hist, 0.999), hist->max);
+}
+
+/** @brief Raises the descriptor limit so thousands of agents can be opened.
+ */
+void raiseFileLimit() {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/** @brief Appends a frame to the agent send buffer.
+ *
+ *  @param agent agent.
+ *  @param type frame type.
+ *  @param id command id.
+ *  @param payload frame payload.
+ *  @param length payload length.
+ */
+void queueFrame(struct agent *agent, uint8_t type, uint32_t id, const void *payload, uint32_t length) {
+    if (agent->outLen + FRAME_HEADERSIZE + length > agent->outCap) {
+        agent->outCap = (agent->outLen + FRAME_HEADERSIZE + length) * 2;
+        if ((agent->out = realloc(agent->out, agent->outCap)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    encodeFrameHeader(agent->out + agent->outLen, type, id, length);
+    memcpy(agent->out + agent->outLen + FRAME_HEADERSIZE, payload, length);
+    agent->outLen += FRAME_HEADERSIZE + length;
+}
+
+/** @brief Answers a command with the synthetic output and a zero exit status.
+ *
+ *  @param agent agent.
+ *  @param id command id.
+ */
+void answerCommand(struct agent *agent, uint32_t id) {
+    uint32_t status = htonl(0);
+
+    for (int sent = 0; sent < outputBytes; sent += FRAME_MAXPAYLOAD) {
+        int length = outputBytes - sent < FRAME_MAXPAYLOAD ? outputBytes - sent : FRAME_MAXPAYLOAD;
+        queueFrame(agent, FRAME_OUTPUT, id, output + sent, length);
+    }
+    queueFrame(agent, FRAME_END, id, &status, sizeof(status));
+    commands++;
+}
+
+/** @brief Writes as much of the agent send buffer as the socket accepts.
+ *
+ *  @param agent agent.
+ *  @return 0 if the socket would block or everything was sent, -1 on error.
+ */
+int flushAgent(struct agent *agent) {
+    while (agent->outSent < agent->outLen) {
+        ssize_t n = write(agent->fd, agent->out + agent->outSent, agent->outLen - agent->outSent);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        agent->outSent += n;
+    }
+
+    agent->outLen = agent->outSent = 0;
+    return 0;
+}
+
+/** @brief Reads the commands sent to an agent and queues their answers.
+ *
+ *  @param agent agent.
+ *  @param now current timestamp.
+ *  @return 0 while the session goes on, 1 when EXIT arrived, -1 on error.
+ */
+int readAgent(struct agent *agent, struct timespec *now) {
+    for ( ; ; ) {
+        ssize_t n = read(agent->fd, agent->in + agent->inLen, FRAME_MAXSIZE - agent->inLen);
+
+        if (n == 0) {
+            return -1;
+        } else if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        if (!agent->gotByte) {
+            agent->gotByte = 1;
+            histRecord(&firstByteHist, elapsedUs(&agent->connected, now));
+        }
+        agent->inLen += n;
+
+        size_t offset = 0;
+        uint8_t type;
+        uint32_t id;
+        uint32_t length;
+
+        while (agent->inLen - offset >= FRAME_HEADERSIZE) {
+            decodeFrameHeader(agent->in + offset, &type, &id, &length);
+            if (length > FRAME_MAXPAYLOAD) {
+                return -1;
+            }
+            if (agent->inLen - offset < FRAME_HEADERSIZE + length) {
+                break;
+            }
+
+            char *payload = (char *) agent->in + offset + FRAME_HEADERSIZE;
+            offset += FRAME_HEADERSIZE + length;
+
+            if (type != FRAME_COMMAND) {
+                continue;
+            }
+            if (agent->lastCommand.tv_sec != 0) {
+                histRecord(&commandHist, elapsedUs(&agent->lastCommand, now));
+            }
+            agent->lastCommand = *now;
+
+            if (length == strlen(EXIT_KEY_WORD) && memcmp(payload, EXIT_KEY_WORD, length) == 0) {
+                histRecord(&sessionHist, elapsedUs(&agent->started, now));
+                return 1;
+            }
+            answerCommand(agent, id);
+        }
+
+        memmove(agent->in, agent->in + offset, agent->inLen - offset);
+        agent->inLen -= offset;
+    }
+}
+
+/** @brief Starts a non-blocking connection for an agent.
+ *
+ *  @param epfd epoll identifier.
+ *  @param agent agent.
+ *  @param servaddr server address.
+ */
+void startAgent(int epfd, struct agent *agent, struct sockaddr_in *servaddr) {
+    struct epoll_event event;
+
+    agent->fd = Socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    agent->state = CONNECTING;
+    clock_gettime(CLOCK_MONOTONIC, &agent->started);
+
+    if (connect(agent->fd, (struct sockaddr *) servaddr, sizeof(*servaddr)) < 0 && errno != EINPROGRESS) {
+        perror("connect error");
+        exit(1);
+    }
+
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = agent;
+    EpollCtl(epfd, EPOLL_CTL_ADD, agent->fd, &event);
+}
+
+/** @brief Handles readiness of an agent socket.
+ *
+ *  @param agent agent.
+ *  @return 0 while the session goes on, 1 when it finished, -1 if it failed.
+ */
+int serveAgent(struct agent *agent) {
+    struct timespec now;
+    int n;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (agent->state == CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (getsockopt(agent->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            return -1;
+        }
+        // Edge-triggered: nothing to do until the connection completes
+        struct sockaddr_in peer;
+        len = sizeof(peer);
+        if (getpeername(agent->fd, (struct sockaddr *) &peer, &len) < 0) {
+            return 0;
+        }
+
+        agent->state = RUNNING;
+        agent->connected = now;
+        histRecord(&connectHist, elapsedUs(&agent->started, &now));
+    }
+
+    if ((n = readAgent(agent, &now)) != 0) {
+        return n;
+    }
+    return flushAgent(agent);
+}
+
+/** @brief Prints the results as a single JSON line on stdout and a summary on stderr.
+ *
+ *  @param agents number of agents.
+ *  @param completed agents that got EXIT.
+ *  @param failed agents that failed or timed out.
+ *  @param elapsed total time in microseconds.
+ */
+void printResults(int agents, int completed, int failed, long long elapsed) {
+    struct histogram *hists[] = { &connectHist, &firstByteHist, &commandHist, &sessionHist };
+
+    printf("{\"agents\":%d,\"completed\":%d,\"failed\":%d,\"output_bytes\":%d,\"elapsed_us\":%lld,\"commands\":%lld,\"commands_per_sec\":%.1f,\"phases\":{",
+        agents, completed, failed, outputBytes, elapsed, commands, elapsed > 0 ? commands * 1e6 / elapsed : 0.0);
+    for (int i = 0; i < 4; i++) {
+        if (i > 0) {
+            printf(",");
+        }
+        histPrint(hists[i]);
+    }
+    printf("}}\n");
+
+    fprintf(stderr, "%d/%d agents completed, %d failed, %lld commands in %.3f s (%.1f commands/s)\n",
+        completed, agents, failed, commands, elapsed / 1e6, elapsed > 0 ? commands * 1e6 / elapsed : 0.0);
+    fprintf(stderr, "%-12s %10s %10s %10s %10s %10s %10s\n", "phase", "count", "p50 ms", "p90 ms", "p99 ms", "p999 ms", "max ms");
+    for (int i = 0; i < 4; i++) {
+        fprintf(stderr, "%-12s %10lld %10.3f %10.3f %10.3f %10.3f %10.3f\n", hists[i]->name, hists[i]->total,
+            histPercentile(hists[i], 0.5) / 1e3, histPercentile(hists[i], 0.9) / 1e3, histPercentile(hists[i], 0.99) / 1e3,
+            histPercentile(hists[i], 0.999) / 1e3, hists[i]->max / 1e3);
+    }
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_in servaddr;
+    struct epoll_event events[MAXEVENTS];
+    struct timespec started, now;
+    int epfd, nready, agents, completed = 0, failed = 0;
+
+    assertValidArgs(argc, argv);
+    agents = atoi(argv[3]);
+    if (argc == 5) {
+        outputBytes = atoi(argv[4]);
+    }
+
+    output = malloc(outputBytes + 1);
+    for (int i = 0; i < outputBytes; i++) {
+        output[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+    }
+
+    bzero(&servaddr, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port   = htons(strtod(argv[2], NULL));
+    InetPton(AF_INET, argv[1], &servaddr.sin_addr);
+
+    raiseFileLimit();
+    if ((epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    struct agent *table = calloc(agents, sizeof(struct agent));
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (int i = 0; i < agents; i++) {
+        startAgent(epfd, &table[i], &servaddr);
+    }
+
+    while (completed + failed < agents) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long left = LOAD_TIMEOUT * 1000LL - elapsedUs(&started, &now) / 1000;
+
+        if (left <= 0) {
+            break;
+        }
+        if ((nready = epoll_wait(epfd, events, MAXEVENTS, left)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < nready; i++) {
+            struct agent *agent = events[i].data.ptr;
+            int n = serveAgent(agent);
+
+            if (n != 0) {
+                n > 0 ? completed++ : failed++;
+                close(agent->fd);
+                agent->fd = -1;
+                free(agent->out);
+                agent->out = NULL;
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printResults(agents, completed, agents - completed, elapsedUs(&started, &now));
+
+    exit(completed == agents ? 0 : 1);
+}
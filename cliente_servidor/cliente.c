@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
@@ -11,12 +13,34 @@
 #include <unistd.h>
 #include <time.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <zlib.h>
+
+#include "protocol.h"
 
 #define MAXLINE 4096
 #define MAXDATASIZE 100
 #define KGRN  "\x1B[32m"
 #define KNRM  "\x1B[0m"
 #define EXIT_KEY_WORD  "EXIT"
+#define MODE_COPY "copy"
+#define MODE_SPLICE "splice"
+#define MAXWORKERS 16   /* largest number of commands executed at once */
+#define MAXQUEUE 64     /* commands waiting for a free worker */
+#define QUEUEFULL_STATUS 75 /* exit status of commands refused with the queue full, EX_TEMPFAIL */
+#define WORKERS 4       /* default number of commands executed at once */
+#define COMMAND_CAP 2   /* instances of the same program executed at once */
+#define MAXARGS 32
+#define SHELL_CHARS "|&;<>()$`\\\"'*?[]#~={}\n"
+#define COMPRESS_MINSIZE 512 /* outputs are compressed from the first read at least this long */
+
+extern char **environ;
 
 // WRAPPER FUNCTIONS
 
@@ -33,21 +57,83 @@ void GetSockName(int sockfd, struct sockaddr *addr, socklen_t * addrlen) {
     }
 }
 
-/** @brief Wrapper function for popen: executes bash commands.
+/** @brief Wrapper function for posix_spawnp: starts a command with its output connected to a pipe.
+ *
+ *  Plain commands are executed directly; only commands using shell syntax go through sh -c.
+ *  The command gets its own process group and inherits no other descriptor of the agent.
  *
  *  @param command command which is being executed.
- *  @param mode execution mode for command.
- *  @return file pointer to the command's execution output.
+ *  @param outfd where the read end of the output pipe is stored.
+ *  @return process id, -1 if the command could not be started.
  */
-FILE* Popen(char* command, char* mode) {
-    FILE *fp;
-    if ((fp = popen(command, mode)) == NULL) {
-        perror("popen error");
+pid_t Spawn(char* command, int* outfd) {
+    char copy[MAXLINE + 1];
+    char *argv[MAXARGS + 1];
+    int argc = 0;
+    int fds[2];
+    pid_t pid;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+
+    if (strpbrk(command, SHELL_CHARS) != NULL) {
+        argv[argc++] = "sh";
+        argv[argc++] = "-c";
+        argv[argc++] = command;
+    } else {
+        snprintf(copy, sizeof(copy), "%s", command);
+        for (char *arg = strtok(copy, " \t"); arg != NULL && argc < MAXARGS; arg = strtok(NULL, " \t")) {
+            argv[argc++] = arg;
+        }
+    }
+    argv[argc] = NULL;
+
+    if (argc == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe error");
         exit(1);
     }
-    return fp;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+
+    int err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(fds[1]);
+
+    if (err != 0) {
+        close(fds[0]);
+        errno = err;
+        return -1;
+    }
+
+    *outfd = fds[0];
+    return pid;
 }
 
+/** @brief Wrapper function for pidfd_open: gets a descriptor that becomes readable when a
+ *         process exits, so the poll loop can reap it without blocking.
+ *
+ *  @param pid process id.
+ *  @return process descriptor.
+ */
+int PidfdOpen(pid_t pid) {
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+
+    if (pidfd < 0) {
+        perror("pidfd_open");
+        exit(1);
+    }
+    return pidfd;
+}
 
 /** @brief Wrapper function for socket: creates socket given configurations.
  *
@@ -112,6 +198,41 @@ int Read(int sockfd, void *buf, size_t count) {
     return n;
 }
 
+/** @brief Wrapper function for writeFrame: sends a frame to the server.
+ *
+ *  @param sockfd socket identifier.
+ *  @param type frame type.
+ *  @param id command id.
+ *  @param payload frame payload.
+ *  @param length payload length.
+ */
+void WriteFrame(int sockfd, uint8_t type, uint32_t id, const void *payload, uint32_t length) {
+    if (writeFrame(sockfd, type, id, payload, length) < 0) {
+        perror("write error");
+        exit(1);
+    }
+}
+
+/** @brief Wrapper function for readFrame: reads a frame from the server.
+ *
+ *  @param sockfd socket identifier.
+ *  @param type where the frame type is stored.
+ *  @param id where the command id is stored.
+ *  @param payload buffer with at least FRAME_MAXPAYLOAD bytes.
+ *  @param length where the payload length is stored.
+ *  @return 1 if a frame was read, 0 if the server closed the connection.
+ */
+int ReadFrame(int sockfd, uint8_t *type, uint32_t *id, void *payload, uint32_t *length) {
+    int n = readFrame(sockfd, type, id, payload, length);
+
+    if (n < 0) {
+        perror("read error");
+        exit(1);
+    }
+
+    return n;
+}
+
 // HELPER FUNCTIONS
 
 /** @brief validates the number of parameters, suggesting the correct usage in case of error.
@@ -122,30 +243,321 @@ int Read(int sockfd, void *buf, size_t count) {
 void assertValidArgs(int argc, char **argv) {
     char   error[MAXLINE + 1];
 
-    if (argc != 3) {
+    if (argc < 3 || argc > 5 || (argc >= 4 && strcmp(argv[3], MODE_COPY) != 0 && strcmp(argv[3], MODE_SPLICE) != 0)
+        || (argc == 5 && (atoi(argv[4]) < 1 || atoi(argv[4]) > MAXWORKERS))) {
         strcpy(error,"uso: ");
         strcat(error,argv[0]);
-        strcat(error," <IPaddress> <Port>");
+        strcat(error," <IPaddress> <Port> [copy|splice] [Workers]");
         perror(error);
         exit(1);
     }
 }
 
 
-/** @brief function that uses popen to execute a bash command and sends its output back to the server.
+/** @brief A command being executed by one of the agent workers.
+ */
+struct job {
+    int used;
+    uint32_t id;
+    pid_t pid;
+    int pidfd;                      /* readable once the command exited, -1 once reaped */
+    int stat;                       /* wait status, once reaped */
+    int fd;                         /* read end of the command output pipe, -1 once closed */
+    char program[MAXDATASIZE];      /* first word of the command */
+    z_stream *deflater;             /* output compressor, NULL while the output is sent raw */
+};
+
+int compression = CODEC_NONE;       /* codec chosen by the server, none until it answers */
+
+/** @brief Commands received while no worker could take them, in arrival order.
+ */
+struct commandQueue {
+    uint32_t ids[MAXQUEUE];
+    char *commands[MAXQUEUE];
+    int count;
+};
+
+/** @brief Copies the program name, the first word of a command.
+ *
+ *  @param command command line.
+ *  @param program buffer with MAXDATASIZE bytes.
+ */
+void programName(const char* command, char* program) {
+    command += strspn(command, " \t");
+    snprintf(program, MAXDATASIZE, "%.*s", (int) strcspn(command, " \t;|&"), command);
+}
+
+/** @brief Counts the workers running a given program.
+ *
+ *  @param jobs worker table.
+ *  @param program program name.
+ *  @return number of running instances.
+ */
+int runningInstances(struct job *jobs, const char* program) {
+    int count = 0;
+
+    for (int i = 0; i < MAXWORKERS; i++) {
+        if (jobs[i].used && strcmp(jobs[i].program, program) == 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/** @brief Finds the oldest queued command whose program is below COMMAND_CAP running instances.
+ *
+ *  @param queue queued commands.
+ *  @param jobs worker table.
+ *  @return position in the queue, -1 if every queued command must keep waiting.
+ */
+int nextRunnable(struct commandQueue *queue, struct job *jobs) {
+    char program[MAXDATASIZE];
+
+    for (int i = 0; i < queue->count; i++) {
+        programName(queue->commands[i], program);
+        if (runningInstances(jobs, program) < COMMAND_CAP) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/** @brief Starts a command in a free worker. A command that cannot be started is answered
+ *         right away with exit status 127, like the shell does.
  *
+ *  @param jobs worker table.
+ *  @param id command id.
  *  @param command command which is being executed.
  *  @param sockfd socket identifier.
+ *  @return 1 if a worker is now running the command, 0 otherwise.
  */
-void sendCommandOutput(char* command, int sockfd){
-    FILE *fp = Popen(command, "r");
-    char output[MAXDATASIZE] = {0};
-    
-    while(fgets(output, MAXDATASIZE, fp) != NULL) {
-        write(sockfd, output, MAXDATASIZE);
+int startJob(struct job *jobs, uint32_t id, char* command, int sockfd) {
+    for (int i = 0; i < MAXWORKERS; i++) {
+        if (!jobs[i].used) {
+            if ((jobs[i].pid = Spawn(command, &jobs[i].fd)) < 0) {
+                uint32_t status = htonl(127);
+
+                perror("spawn error");
+                WriteFrame(sockfd, FRAME_END, id, &status, sizeof(status));
+                return 0;
+            }
+
+            jobs[i].pidfd = PidfdOpen(jobs[i].pid);
+            jobs[i].used = 1;
+            jobs[i].id = id;
+            programName(command, jobs[i].program);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** @brief Feeds output to the compressor of a command, sending compressed frames as they fill.
+ *
+ *  @param job worker with a compressor.
+ *  @param sockfd socket identifier.
+ *  @param data output bytes.
+ *  @param count number of bytes.
+ *  @param flush Z_NO_FLUSH while more output is waiting in the pipe, Z_SYNC_FLUSH when the
+ *         command paused, so the server sees its output without delay, Z_FINISH at the end.
+ */
+void compressOutput(struct job *job, int sockfd, const void *data, size_t count, int flush) {
+    unsigned char frame[FRAME_MAXPAYLOAD];
+    z_stream *stream = job->deflater;
+    int err;
+
+    stream->next_in = (Bytef *) data;
+    stream->avail_in = count;
+    do {
+        stream->next_out = frame;
+        stream->avail_out = sizeof(frame);
+        err = deflate(stream, flush);
+
+        if (stream->avail_out < sizeof(frame)) {
+            WriteFrame(sockfd, FRAME_COMPRESSED, job->id, frame, sizeof(frame) - stream->avail_out);
+        }
+    } while (stream->avail_out == 0 && err != Z_STREAM_END);
+}
+
+/** @brief Sends the end-of-output frame with the exit status once a command has both closed
+ *         its output and exited, in whichever order, and frees its worker.
+ *
+ *  @param job worker.
+ *  @param sockfd socket identifier.
+ *  @return 1 if the worker is free again, 0 otherwise.
+ */
+int finishJob(struct job *job, int sockfd) {
+    if (job->fd >= 0 || job->pidfd >= 0) {
+        return 0;
+    }
+
+    uint32_t status = htonl(WIFEXITED(job->stat) ? WEXITSTATUS(job->stat) : 128 + WTERMSIG(job->stat));
+    WriteFrame(sockfd, FRAME_END, job->id, &status, sizeof(status));
+    job->used = 0;
+    return 1;
+}
+
+/** @brief Closes the output pipe of a command, flushing what its compressor still holds.
+ *
+ *  @param job worker.
+ *  @param sockfd socket identifier.
+ *  @return 1 if the worker is free again, 0 while the command is still running.
+ */
+int closeOutput(struct job *job, int sockfd) {
+    if (job->deflater != NULL) {
+        compressOutput(job, sockfd, NULL, 0, Z_FINISH);
+        deflateEnd(job->deflater);
+        free(job->deflater);
+        job->deflater = NULL;
+    }
+
+    close(job->fd);
+    job->fd = -1;
+    return finishJob(job, sockfd);
+}
+
+/** @brief Reaps a command whose process descriptor became readable. A command may close its
+ *         output and keep running, so this never waits.
+ *
+ *  @param job worker.
+ *  @param sockfd socket identifier.
+ *  @return 1 if the worker is free again, 0 while the output is still open.
+ */
+int reapJob(struct job *job, int sockfd) {
+    if (waitpid(job->pid, &job->stat, WNOHANG) <= 0) {
+        return 0;
+    }
+
+    close(job->pidfd);
+    job->pidfd = -1;
+    return finishJob(job, sockfd);
+}
+
+/** @brief Kills a command cancelled by the server with its whole process group, dropping the
+ *         output still in the pipe. Its end-of-output frame follows as soon as it is reaped. A
+ *         command still queued is answered without being started.
+ *
+ *  @param jobs worker table.
+ *  @param queue queued commands.
+ *  @param id command id.
+ *  @param sockfd socket identifier.
+ *  @return 1 if a worker is free again, 0 otherwise.
+ */
+int cancelJob(struct job *jobs, struct commandQueue *queue, uint32_t id, int sockfd) {
+    for (int i = 0; i < MAXWORKERS; i++) {
+        if (jobs[i].used && jobs[i].id == id) {
+            kill(-jobs[i].pid, SIGKILL);
+            return jobs[i].fd >= 0 ? closeOutput(&jobs[i], sockfd) : 0;
+        }
+    }
+
+    for (int i = 0; i < queue->count; i++) {
+        if (queue->ids[i] == id) {
+            uint32_t status = htonl(128 + SIGKILL);
+
+            WriteFrame(sockfd, FRAME_END, id, &status, sizeof(status));
+            free(queue->commands[i]);
+            queue->count--;
+            memmove(queue->ids + i, queue->ids + i + 1, (queue->count - i) * sizeof(queue->ids[0]));
+            memmove(queue->commands + i, queue->commands + i + 1, (queue->count - i) * sizeof(queue->commands[0]));
+            break;
+        }
+    }
+    return 0;
+}
+
+/** @brief Sends the output a command has produced so far back to the server, as output frames
+ *         tagged with the command id. Once the server accepted compression, outputs longer
+ *         than COMPRESS_MINSIZE go through a deflate stream of their own.
+ *
+ *  @param job worker whose output pipe is readable.
+ *  @param sockfd socket identifier.
+ *  @return 1 while the command keeps its output open, 0 once it closed it.
+ */
+int sendCommandOutput(struct job *job, int sockfd) {
+    char output[FRAME_MAXPAYLOAD];
+    ssize_t n;
+
+    while ((n = read(job->fd, output, sizeof(output))) < 0 && errno == EINTR) {
+        continue;
+    }
+    if (n <= 0) {
+        return 0;
+    }
+
+    if (job->deflater == NULL && compression == CODEC_DEFLATE && n >= COMPRESS_MINSIZE) {
+        job->deflater = calloc(1, sizeof(z_stream));
+        if (job->deflater == NULL || deflateInit(job->deflater, Z_DEFAULT_COMPRESSION) != Z_OK) {
+            perror("deflateInit error");
+            exit(1);
+        }
+    }
+
+    // A short read means the pipe is empty, the command paused or is about to end
+    if (job->deflater != NULL) {
+        compressOutput(job, sockfd, output, n, n < (ssize_t) sizeof(output) ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+    } else {
+        WriteFrame(sockfd, FRAME_OUTPUT, job->id, output, n);
     }
-    char eof[MAXDATASIZE] = {1};
-    write(sockfd, eof, MAXDATASIZE);
+    return 1;
+}
+
+/** @brief Moves exactly count bytes from the command output pipe to the socket with splice,
+ *         copying through userspace only if the kernel refuses to splice.
+ *
+ *  @param pipefd command output pipe.
+ *  @param sockfd socket identifier.
+ *  @param count number of bytes, already announced in the frame header.
+ */
+void splicePipe(int pipefd, int sockfd, size_t count) {
+    char buf[FRAME_MAXPAYLOAD];
+
+    while (count > 0) {
+        ssize_t n = splice(pipefd, NULL, sockfd, NULL, count, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EINVAL) {
+            // Fallback copy path, the header already promised count bytes
+            if ((n = read(pipefd, buf, count)) <= 0 || writeAll(sockfd, buf, n) < 0) {
+                perror("read error");
+                exit(1);
+            }
+        } else if (n <= 0) {
+            perror("splice error");
+            exit(1);
+        }
+        count -= n;
+    }
+}
+
+/** @brief Streaming version of sendCommandOutput: the output goes from the command pipe to the socket
+ *         with splice, so it never enters userspace. Each frame carries whatever is buffered in the
+ *         pipe when it becomes readable.
+ *
+ *  @param job worker whose output pipe is readable.
+ *  @param sockfd socket identifier.
+ *  @return 1 while the command keeps its output open, 0 once it closed it.
+ */
+int streamCommandOutput(struct job *job, int sockfd) {
+    unsigned char header[FRAME_HEADERSIZE];
+    int avail;
+
+    // Readable with nothing buffered means the command closed its output
+    if (ioctl(job->fd, FIONREAD, &avail) < 0 || avail == 0) {
+        return 0;
+    }
+    if (avail > FRAME_MAXPAYLOAD) {
+        avail = FRAME_MAXPAYLOAD;
+    }
+
+    encodeFrameHeader(header, FRAME_OUTPUT, job->id, avail);
+    if (send(sockfd, header, FRAME_HEADERSIZE, MSG_MORE) != FRAME_HEADERSIZE) {
+        perror("write error");
+        exit(1);
+    }
+    splicePipe(job->fd, sockfd, avail);
+    return 1;
 }
 
 /** @brief function that prints a command received from the server inverted and in uppercase. 
@@ -154,27 +566,35 @@ void sendCommandOutput(char* command, int sockfd){
  *  @param recvline command received from the server
  */
 void printCommand(char* recvline) {
-    char* copy = malloc(strlen(recvline) + 1);
-    char* c = copy;
-    
-    strcpy(copy, recvline);
-    
-    for (int i = strlen(recvline); i > 0; i--) {
-        *c = toupper(recvline[i - 1]);
-        c++;
+    char copy[MAXLINE + 1];
+    size_t len = strnlen(recvline, MAXLINE);
+
+    for (size_t i = 0; i < len; i++) {
+        copy[i] = toupper((unsigned char) recvline[len - 1 - i]);
     }
-    c = "\0";
+    copy[len] = '\0';
 
     printf("Received Command: %s \n", copy);
 }
 
 int main(int argc, char **argv) {
-    int    sockfd, n;
+    int    sockfd;
     char   recvline[MAXLINE + 1];
+    uint8_t type;
+    uint32_t id;
+    uint32_t length;
     struct sockaddr_in servaddr;
+    struct job jobs[MAXWORKERS] = {0};
+    struct commandQueue queue = {0};
+    struct pollfd fds[2 * MAXWORKERS + 1];
+    struct job *polled[2 * MAXWORKERS + 1];
+    int workers = argc == 5 ? atoi(argv[4]) : WORKERS;
+    int running = 0;
+    int streaming;
 
     assertValidArgs(argc, argv);
-    sockfd = Socket(AF_INET, SOCK_STREAM, 0);
+    sockfd = Socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    streaming = argc >= 4 && strcmp(argv[3], MODE_SPLICE) == 0;
 
     bzero(&servaddr, sizeof(servaddr));
     servaddr.sin_family = AF_INET;
@@ -191,21 +611,103 @@ int main(int argc, char **argv) {
     GetSockName(sockfd, (struct sockaddr *) &addr, &len);
     printf("Local IP address: %s\n", inet_ntoa(addr.sin_addr));
     printf("Local port      : %d\n", ntohs(addr.sin_port));
-    
-    while (((n = Read(sockfd, recvline, MAXLINE)) > 0)) {
-        recvline[n] = '\0';
 
-        if (strcmp(recvline, EXIT_KEY_WORD) == 0) {
-            close(sockfd);
-            break;
+    // Splicing keeps the output out of userspace, so it cannot be compressed
+    if (!streaming) {
+        unsigned char codecs[] = { CODEC_DEFLATE };
+        WriteFrame(sockfd, FRAME_HELLO, 0, codecs, sizeof(codecs));
+    }
+
+    for ( ; ; ) {
+        int nfds = 0;
+
+        // Read even with the queue full: a cancel is most needed then
+        fds[nfds].fd = sockfd;
+        fds[nfds].events = POLLIN;
+        polled[nfds++] = NULL;
+        for (int i = 0; i < MAXWORKERS; i++) {
+            if (jobs[i].used && jobs[i].fd >= 0) {
+                fds[nfds].fd = jobs[i].fd;
+                fds[nfds].events = POLLIN;
+                polled[nfds++] = &jobs[i];
+            }
+            if (jobs[i].used && jobs[i].pidfd >= 0) {
+                fds[nfds].fd = jobs[i].pidfd;
+                fds[nfds].events = POLLIN;
+                polled[nfds++] = &jobs[i];
+            }
+        }
+
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll error");
+            exit(1);
         }
 
-        printCommand(recvline);
-        sendCommandOutput(recvline, sockfd);
-        bzero(recvline, MAXDATASIZE);
+        for (int i = 0; i < nfds; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+
+            if (polled[i] == NULL) {
+                if (ReadFrame(sockfd, &type, &id, recvline, &length) == 0) {
+                    exit(0);
+                }
+                recvline[length] = '\0';
+
+                if (type == FRAME_HELLO) {
+                    compression = length == 1 ? (unsigned char) recvline[0] : CODEC_NONE;
+                    continue;
+                }
+                // Commands that ended already are not found, their END frame is on its way
+                if (type == FRAME_CANCEL) {
+                    printf("Cancelled Command #%u \n", id);
+                    running -= cancelJob(jobs, &queue, id, sockfd);
+                    continue;
+                }
+                if (type != FRAME_COMMAND) {
+                    continue;
+                }
+
+                if (strcmp(recvline, EXIT_KEY_WORD) == 0) {
+                    close(sockfd);
+                    exit(0);
+                }
+                if (queue.count == MAXQUEUE) {
+                    uint32_t status = htonl(QUEUEFULL_STATUS);
+
+                    printf("Refused Command #%u, queue full \n", id);
+                    WriteFrame(sockfd, FRAME_END, id, &status, sizeof(status));
+                    continue;
+                }
+
+                printCommand(recvline);
+                queue.ids[queue.count] = id;
+                queue.commands[queue.count++] = strdup(recvline);
+            } else if (!polled[i]->used || (fds[i].fd != polled[i]->fd && fds[i].fd != polled[i]->pidfd)) {
+                // Finished or cancelled earlier in this pass
+                continue;
+            } else if (fds[i].fd == polled[i]->pidfd) {
+                running -= reapJob(polled[i], sockfd);
+            } else if ((streaming ? streamCommandOutput(polled[i], sockfd) : sendCommandOutput(polled[i], sockfd)) == 0) {
+                running -= closeOutput(polled[i], sockfd);
+            }
+        }
+
+        int next;
+        while (running < workers && (next = nextRunnable(&queue, jobs)) >= 0) {
+            running += startJob(jobs, queue.ids[next], queue.commands[next], sockfd);
+            free(queue.commands[next]);
+
+            queue.count--;
+            memmove(queue.ids + next, queue.ids + next + 1, (queue.count - next) * sizeof(queue.ids[0]));
+            memmove(queue.commands + next, queue.commands + next + 1, (queue.count - next) * sizeof(queue.commands[0]));
+        }
 
         // sleep(5);
-    } 
+    }
 
     exit(0);
 }
\ No newline at end of file
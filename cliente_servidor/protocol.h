@@ -0,0 +1,189 @@
+/* Framing protocol shared by cliente.c and servidor.c */
+#ifndef __protocol_h
+#define __protocol_h
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/* Every frame is a 9 byte header (1 byte type, 4 byte command id and 4 byte payload
+ * length, both in network order) followed by exactly length bytes of payload. The id of
+ * a command is repeated in every frame of its output, so outputs of commands running
+ * concurrently may arrive interleaved and out of order. */
+#define FRAME_HEADERSIZE 9
+#define FRAME_MAXPAYLOAD 4096
+#define FRAME_MAXSIZE (FRAME_HEADERSIZE + FRAME_MAXPAYLOAD)
+
+#define FRAME_COMMAND 1 /* server -> agent: command line to execute */
+#define FRAME_OUTPUT  2 /* agent -> server: chunk of the command output */
+#define FRAME_END     3 /* agent -> server: end of output, payload is the 4 byte exit status */
+#define FRAME_CANCEL  4 /* server -> agent: kill the command, its END frame still follows */
+#define FRAME_HELLO   5 /* agent -> server: codecs it can compress with, one byte each;
+                           server -> agent: the one byte codec chosen */
+#define FRAME_COMPRESSED 6 /* agent -> server: chunk of the output stream compressed with the
+                              chosen codec, one stream per command */
+
+/* Outputs are sent raw until the server answers the HELLO of the agent, and short outputs
+ * stay raw, so both raw and compressed frames may carry the output of a command. */
+#define CODEC_NONE    0
+#define CODEC_DEFLATE 1 /* zlib stream, flushed whenever the command output pauses */
+
+/** @brief Writes a frame header into a buffer.
+ *
+ *  @param buf buffer with at least FRAME_HEADERSIZE bytes.
+ *  @param type frame type.
+ *  @param id command id.
+ *  @param length payload length.
+ */
+static inline void encodeFrameHeader(unsigned char *buf, uint8_t type, uint32_t id, uint32_t length) {
+    uint32_t netId = htonl(id);
+    uint32_t netLength = htonl(length);
+
+    buf[0] = type;
+    memcpy(buf + 1, &netId, sizeof(netId));
+    memcpy(buf + 5, &netLength, sizeof(netLength));
+}
+
+/** @brief Reads a frame header from a buffer.
+ *
+ *  @param buf buffer with at least FRAME_HEADERSIZE bytes.
+ *  @param type where the frame type is stored.
+ *  @param id where the command id is stored.
+ *  @param length where the payload length is stored.
+ */
+static inline void decodeFrameHeader(const unsigned char *buf, uint8_t *type, uint32_t *id, uint32_t *length) {
+    uint32_t netId;
+    uint32_t netLength;
+
+    *type = buf[0];
+    memcpy(&netId, buf + 1, sizeof(netId));
+    memcpy(&netLength, buf + 5, sizeof(netLength));
+    *id = ntohl(netId);
+    *length = ntohl(netLength);
+}
+
+/** @brief Writes a whole frame to a blocking socket, retrying partial writes.
+ *
+ *  @param fd socket identifier.
+ *  @param type frame type.
+ *  @param id command id.
+ *  @param payload frame payload.
+ *  @param length payload length, at most FRAME_MAXPAYLOAD.
+ *  @return 0 on success, -1 on error.
+ */
+static inline int writeFrame(int fd, uint8_t type, uint32_t id, const void *payload, uint32_t length) {
+    unsigned char header[FRAME_HEADERSIZE];
+    struct iovec iov[2];
+    int iovcnt = 2;
+    ssize_t n;
+
+    encodeFrameHeader(header, type, id, length);
+    iov[0].iov_base = header;
+    iov[0].iov_len = FRAME_HEADERSIZE;
+    iov[1].iov_base = (void *) payload;
+    iov[1].iov_len = length;
+
+    while (iovcnt > 0) {
+        if ((n = writev(fd, iov + 2 - iovcnt, iovcnt)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        for (int i = 2 - iovcnt; i < 2 && n > 0; i++) {
+            size_t done = (size_t) n < iov[i].iov_len ? (size_t) n : iov[i].iov_len;
+
+            iov[i].iov_base = (char *) iov[i].iov_base + done;
+            iov[i].iov_len -= done;
+            n -= done;
+        }
+        while (iovcnt > 0 && iov[2 - iovcnt].iov_len == 0) {
+            iovcnt--;
+        }
+    }
+    return 0;
+}
+
+/** @brief Writes exactly count bytes to a blocking socket.
+ *
+ *  @param fd socket identifier.
+ *  @param buf source buffer.
+ *  @param count number of bytes.
+ *  @return 0 on success, -1 on error.
+ */
+static inline int writeAll(int fd, const void *buf, size_t count) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < count) {
+        if ((n = write(fd, (const char *) buf + done, count - done)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/** @brief Reads exactly count bytes from a blocking socket.
+ *
+ *  @param fd socket identifier.
+ *  @param buf destination buffer.
+ *  @param count number of bytes.
+ *  @return count on success, 0 if the peer closed the connection, -1 on error.
+ */
+static inline ssize_t readn(int fd, void *buf, size_t count) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < count) {
+        if ((n = read(fd, (char *) buf + done, count - done)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if (n == 0) {
+            return 0;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/** @brief Reads a whole frame from a blocking socket.
+ *
+ *  @param fd socket identifier.
+ *  @param type where the frame type is stored.
+ *  @param id where the command id is stored.
+ *  @param payload buffer with at least FRAME_MAXPAYLOAD bytes.
+ *  @param length where the payload length is stored.
+ *  @return 1 on success, 0 if the peer closed the connection, -1 on error or malformed frame.
+ */
+static inline int readFrame(int fd, uint8_t *type, uint32_t *id, void *payload, uint32_t *length) {
+    unsigned char header[FRAME_HEADERSIZE];
+    ssize_t n;
+
+    if ((n = readn(fd, header, FRAME_HEADERSIZE)) <= 0) {
+        return n;
+    }
+
+    decodeFrameHeader(header, type, id, length);
+    if (*length > FRAME_MAXPAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (*length > 0 && (n = readn(fd, payload, *length)) <= 0) {
+        return n;
+    }
+    return 1;
+}
+
+#endif
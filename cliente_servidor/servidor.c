@@ -1,259 +1,2161 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 
-#include <arpa/inet.h>
-#include <errno.h>
-#include <netdb.h>
-#include <netinet/in.h>
-#include <string.h>
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <time.h>
-#include <unistd.h>
-#include <unistd.h>
-#include <signal.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <unistd.h>
+#include <signal.h>
+#include <ctype.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include "net.h"
+#include "protocol.h"
+
+#define LISTENQ 10
+#define N_COMMANDS 4
+#define MAXDATASIZE 100
+#define MAXLINE 4096
+#define KGRN  "\x1B[32m"
+#define KNRM  "\x1B[0m"
+#define EXIT_KEY_WORD  "EXIT"
+#define FILENAME "output.txt"
+#define LOG_FLUSHSIZE 65536     /* pending bytes that force a flush of the output file */
+#define LOG_FLUSHINTERVAL 1     /* seconds a pending record may wait before being flushed */
+#define RESULTS_DIR "results"
+#define RESULT_INLINEMAX POOL_MAXSIZE /* longer outputs are spilled to a temporary file of the store */
+#define RESULT_CACHESIZE 4096   /* digests of stored outputs remembered, direct-mapped */
+#define RESULT_MAXINFLATED (64 << 20) /* bytes a compressed output may expand to before the command is cancelled */
+#define MODE_FORK "fork"
+#define MODE_EPOLL "epoll"
+#define MODE_BROADCAST "broadcast"
+#define MODE_WORKERS "workers"
+#define ACCEPT_BATCH 64         /* connections accepted per wakeup before other events are served */
+#define ACCEPT_RETRYINTERVAL 100 /* ms before accepting again after the descriptors ran out */
+#define SWEEP_TIMEOUT 10        /* seconds an operator command waits for every agent */
+#define COMMAND_TIMEOUT 30      /* seconds a command may run before the agent is told to cancel it */
+#define CANCEL_GRACE 5          /* seconds the agent has to end a cancelled command */
+#define IDLE_TIMEOUT 30         /* seconds a frame may stay half sent or half received */
+#define WHEEL_RESOLUTION 100    /* ms per slot of the timer wheel */
+#define MAXPIPELINE 16          /* largest number of commands in flight per connection */
+#define WORKER_MINUPTIME 5      /* seconds a worker must run for its restart to be immediate */
+#define WORKER_MAXFAILURES 5    /* early deaths in a row after which a worker is given up */
+#define JOURNAL_FILE "jobs.journal"
+#define JOURNAL_SIZE (1 << 20)  /* initial size of the journal file and mapping */
+#define JOURNAL_CHECKPOINTINTERVAL 30 /* seconds between compactions of the journal */
+#define JOURNAL_MAGIC 0x4a4f4221
+#define JOURNAL_BUCKETS 65536   /* hash buckets of the outstanding agent/job pairs */
+#define JOURNAL_MAXAGE (24 * 60 * 60) /* seconds after which results still owed are given up */
+
+/** @brief Writer of the output file: a single long-lived O_APPEND descriptor fed with
+ *         whole records and flushed in batches, when LOG_FLUSHSIZE bytes are pending or
+ *         LOG_FLUSHINTERVAL seconds have passed.
+ */
+struct logWriter {
+    int fd;
+    char buf[LOG_FLUSHSIZE];
+    size_t len;
+    time_t lastFlush;
+};
+
+/** @brief Text being built before it is handed to the writer. Only whole lines of a record
+ *         are committed, so records of concurrent agents never interleave mid-line.
+ */
+struct logRecord {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct logWriter logger;
+
+/** @brief Opens the output file once for the whole server lifetime.
+ *
+ *  @param filename output file path.
+ */
+void logOpen(const char *filename) {
+    if ((logger.fd = open(filename, O_WRONLY | O_APPEND | O_CREAT, 0644)) == -1) {
+        perror("open");
+        exit(1);
+    }
+    logger.len = 0;
+    logger.lastFlush = time(NULL);
+}
+
+/** @brief Appends bytes to the output file with as few write calls as possible.
+ *
+ *  @param data bytes to write.
+ *  @param count number of bytes.
+ */
+void logWrite(const char *data, size_t count) {
+    size_t done = 0;
+
+    while (done < count) {
+        ssize_t n = write(logger.fd, data + done, count - done);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            return;
+        }
+        done += n;
+    }
+}
+
+/** @brief Writes every pending record to the output file.
+ */
+void logFlush() {
+    logWrite(logger.buf, logger.len);
+    logger.len = 0;
+    logger.lastFlush = time(NULL);
+}
+
+/** @brief Flushes the pending records if one of the flush thresholds was reached.
+ */
+void logFlushIfDue() {
+    if (logger.len >= LOG_FLUSHSIZE || (logger.len > 0 && time(NULL) - logger.lastFlush >= LOG_FLUSHINTERVAL)) {
+        logFlush();
+    }
+}
+
+/** @brief Time until the pending records must be flushed, to be used as a poll timeout.
+ *
+ *  @return timeout in milliseconds, -1 if nothing is pending.
+ */
+int logTimeout() {
+    if (logger.len == 0) {
+        return -1;
+    }
+
+    time_t elapsed = time(NULL) - logger.lastFlush;
+    return elapsed >= LOG_FLUSHINTERVAL ? 0 : (LOG_FLUSHINTERVAL - elapsed) * 1000;
+}
+
+/** @brief Makes room for more bytes at the end of a record, with memory from the pool.
+ *
+ *  @param rec record.
+ *  @param count number of bytes.
+ */
+void recordReserve(struct logRecord *rec, size_t count) {
+    if (rec->len + count <= rec->cap) {
+        return;
+    }
+
+    // Doubling keeps appends to records larger than POOL_MAXSIZE from copying every time
+    size_t cap = rec->len + count > 2 * rec->cap ? rec->len + count : 2 * rec->cap;
+    char *data = poolAlloc(cap, &cap);
+
+    if (rec->len > 0) {
+        memcpy(data, rec->data, rec->len);
+    }
+    poolFree(rec->data, rec->cap);
+    rec->data = data;
+    rec->cap = cap;
+}
+
+/** @brief Gives the memory of a record back to the pool.
+ *
+ *  @param rec record.
+ */
+void recordFree(struct logRecord *rec) {
+    poolFree(rec->data, rec->cap);
+    rec->data = NULL;
+    rec->len = rec->cap = 0;
+}
+
+/** @brief Appends formatted text to a record.
+ *
+ *  @param rec record.
+ *  @param format printf format.
+ */
+void recordPrintf(struct logRecord *rec, const char *format, ...) {
+    va_list args;
+    int n;
+
+    va_start(args, format);
+    n = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    recordReserve(rec, n + 1);
+
+    va_start(args, format);
+    vsnprintf(rec->data + rec->len, n + 1, format, args);
+    va_end(args);
+    rec->len += n;
+}
+
+/** @brief Appends raw bytes to a record.
+ *
+ *  @param rec record.
+ *  @param data bytes to append.
+ *  @param count number of bytes.
+ */
+void recordWrite(struct logRecord *rec, const void *data, size_t count) {
+    recordReserve(rec, count);
+    memcpy(rec->data + rec->len, data, count);
+    rec->len += count;
+}
+
+/** @brief Hands the first bytes of a record to the writer, keeping the rest in the record.
+ *         An emptied record gives its memory back to the pool.
+ *
+ *  @param rec record.
+ *  @param count number of bytes to commit.
+ */
+void logCommit(struct logRecord *rec, size_t count) {
+    if (logger.len + count > LOG_FLUSHSIZE) {
+        logFlush();
+    }
+
+    if (count > LOG_FLUSHSIZE) {
+        logWrite(rec->data, count);
+    } else {
+        memcpy(logger.buf + logger.len, rec->data, count);
+        logger.len += count;
+    }
+
+    memmove(rec->data, rec->data + count, rec->len - count);
+    rec->len -= count;
+    if (rec->len == 0) {
+        recordFree(rec);
+    }
+
+    logFlushIfDue();
+}
+
+/** @brief Output of a command being received. It is hashed as it arrives and kept in memory,
+ *         or in a temporary file of the store once it outgrows the largest pool block.
+ */
+struct result {
+    EVP_MD_CTX *hash;           /* SHA-256 of the output so far, NULL before the first byte */
+    struct logRecord body;      /* output, while it is kept in memory */
+    int spillfd;                /* temporary file holding the output, -1 while it is in memory */
+    char spillPath[64];
+    size_t length;
+    int truncated;              /* output cut at RESULT_MAXINFLATED, the rest is not inflated */
+};
+
+/** @brief Content-addressed store of the command outputs. Each distinct output is saved once,
+ *         as RESULTS_DIR/<2 first hex digits of its SHA-256>/<62 other digits>, and the output
+ *         file only references it. The digests already stored are cached, so the identical
+ *         outputs of a fleet sweep cost no I/O beyond the first copy.
+ */
+struct resultStore {
+    unsigned char known[RESULT_CACHESIZE][SHA256_DIGEST_LENGTH];
+    unsigned spills;            /* temporary files created, for unique names */
+};
+
+struct resultStore results;
+
+/** @brief Creates the store directory.
+ */
+void resultsOpen() {
+    if (mkdir(RESULTS_DIR, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir");
+        exit(1);
+    }
+}
+
+void resultInit(struct result *res) {
+    res->hash = NULL;
+    res->body = (struct logRecord) {0};
+    res->spillfd = -1;
+    res->length = 0;
+    res->truncated = 0;
+}
+
+/** @brief Releases everything a result holds, removing its temporary file.
+ *
+ *  @param res result.
+ */
+void resultDiscard(struct result *res) {
+    if (res->spillfd >= 0) {
+        close(res->spillfd);
+        unlink(res->spillPath);
+        res->spillfd = -1;
+    }
+    recordFree(&res->body);
+    EVP_MD_CTX_free(res->hash);
+    res->hash = NULL;
+    res->length = 0;
+    res->truncated = 0;
+}
+
+/** @brief Moves the output kept in memory to a new temporary file of the store.
+ *
+ *  @param res result.
+ *  @return 0 on success, -1 on error, with the output still in memory.
+ */
+int resultSpill(struct result *res) {
+    snprintf(res->spillPath, sizeof(res->spillPath), "%s/tmp-%d-%u", RESULTS_DIR, getpid(), results.spills++);
+
+    if ((res->spillfd = open(res->spillPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) < 0) {
+        perror("open");
+        return -1;
+    }
+    if (writeAll(res->spillfd, res->body.data, res->body.len) < 0) {
+        perror("write");
+        close(res->spillfd);
+        unlink(res->spillPath);
+        res->spillfd = -1;
+        return -1;
+    }
+    recordFree(&res->body);
+    return 0;
+}
+
+/** @brief Starts the digest of a result on its first byte, or at its end if it is empty.
+ *
+ *  @param res result.
+ */
+void resultHashStart(struct result *res) {
+    if (res->hash == NULL) {
+        if ((res->hash = EVP_MD_CTX_new()) == NULL || !EVP_DigestInit_ex(res->hash, EVP_sha256(), NULL)) {
+            perror("EVP_DigestInit_ex");
+            exit(1);
+        }
+    }
+}
+
+/** @brief Appends a chunk of command output to a result.
+ *
+ *  @param res result.
+ *  @param data output bytes.
+ *  @param count number of bytes.
+ */
+void resultWrite(struct result *res, const void *data, size_t count) {
+    resultHashStart(res);
+    EVP_DigestUpdate(res->hash, data, count);
+    res->length += count;
+
+    if (res->spillfd < 0 && res->body.len + count > RESULT_INLINEMAX) {
+        resultSpill(res);
+    }
+    if (res->spillfd >= 0 && writeAll(res->spillfd, data, count) < 0) {
+        perror("write");
+    } else if (res->spillfd < 0) {
+        recordWrite(&res->body, data, count);
+    }
+}
+
+/** @brief Saves an output in the store under its digest, unless it is already there, and
+ *         references it in a record. The temporary file is linked in place, so the store
+ *         never shows a partial output, even to the other children in fork mode.
+ *
+ *  @param res result, released afterwards.
+ *  @param rec record of the command.
+ *  @param note appended to the reference, like ", cancelled".
+ *  @return 1 if the output was new to the store, 0 otherwise.
+ */
+int resultCommit(struct result *res, struct logRecord *rec, const char *note) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    char hex[2 * SHA256_DIGEST_LENGTH + 1];
+    char dir[sizeof(RESULTS_DIR) + 3];
+    char path[sizeof(dir) + sizeof(hex)];
+    int stored = 0;
+    int failed = 0;
+
+    resultHashStart(res);
+    EVP_DigestFinal_ex(res->hash, digest, NULL);
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    }
+    snprintf(dir, sizeof(dir), "%s/%.2s", RESULTS_DIR, hex);
+    snprintf(path, sizeof(path), "%s/%s", dir, hex + 2);
+
+    unsigned char *known = results.known[(digest[0] | digest[1] << 8) % RESULT_CACHESIZE];
+
+    if (memcmp(known, digest, SHA256_DIGEST_LENGTH) != 0 && access(path, F_OK) < 0) {
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+            perror("mkdir");
+        }
+        if ((res->spillfd >= 0 || resultSpill(res) == 0) && link(res->spillPath, path) == 0) {
+            stored = 1;
+        } else if (errno != EEXIST) {
+            perror("link");
+            failed = 1;
+        }
+    }
+    if (!failed) {
+        memcpy(known, digest, SHA256_DIGEST_LENGTH);
+    }
+
+    recordPrintf(rec, "Output: %s (%zu bytes%s%s%s)\n", path, res->length, note, res->truncated ? ", truncated" : "", failed ? ", not stored" : "");
+    resultDiscard(res);
+    return stored;
+}
+
+/** @brief Decompresses an output frame into a result, starting the inflate stream of the
+ *         command on its first compressed frame. Once the output reaches RESULT_MAXINFLATED
+ *         the result is marked truncated and later frames are dropped uninflated, so a few
+ *         kilobytes on the wire cannot expand into gigabytes in the store.
+ *
+ *  @param res result.
+ *  @param stream inflate stream of the command, NULL before its first compressed frame.
+ *  @param data compressed bytes.
+ *  @param count number of bytes.
+ *  @return number of output bytes stored, -1 if the stream is corrupt.
+ */
+ssize_t storeCompressedOutput(struct result *res, z_stream **stream, const void *data, size_t count) {
+    char output[4 * FRAME_MAXPAYLOAD];
+    ssize_t stored = 0;
+    int err;
+
+    if (res->truncated) {
+        return 0;
+    }
+
+    if (*stream == NULL) {
+        if ((*stream = calloc(1, sizeof(z_stream))) == NULL || inflateInit(*stream) != Z_OK) {
+            perror("inflateInit");
+            exit(1);
+        }
+    }
+
+    (*stream)->next_in = (Bytef *) data;
+    (*stream)->avail_in = count;
+    do {
+        (*stream)->next_out = (Bytef *) output;
+        (*stream)->avail_out = sizeof(output);
+        err = inflate(*stream, Z_SYNC_FLUSH);
+
+        // Z_BUF_ERROR only means the frame ended without completing a block
+        if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR) {
+            return -1;
+        }
+        size_t produced = sizeof(output) - (*stream)->avail_out;
+
+        if (res->length + produced >= RESULT_MAXINFLATED) {
+            produced = RESULT_MAXINFLATED - res->length;
+            res->truncated = 1;
+        }
+        resultWrite(res, output, produced);
+        stored += produced;
+    } while ((*stream)->avail_out == 0 && !res->truncated);
+
+    return stored;
+}
+
+/** @brief Releases the inflate stream of a command.
+ *
+ *  @param stream inflate stream, NULL if the command sent no compressed frame.
+ */
+void inflaterFree(z_stream **stream) {
+    if (*stream != NULL) {
+        inflateEnd(*stream);
+        free(*stream);
+        *stream = NULL;
+    }
+}
+
+/** @brief Picks the codec of an agent from the ones its HELLO offers.
+ *
+ *  @param codecs codecs offered, one byte each.
+ *  @param length number of codecs.
+ *  @return the codec outputs will be compressed with.
+ */
+unsigned char chooseCodec(const void *codecs, uint32_t length) {
+    return memchr(codecs, CODEC_DEFLATE, length) != NULL ? CODEC_DEFLATE : CODEC_NONE;
+}
+
+/** @brief Saves the exit status carried by an end-of-output frame to a record.
+ *
+ *  @param rec record.
+ *  @param payload frame payload.
+ *  @param length payload length.
+ *  @return the exit status, -1 if the frame does not carry one.
+ */
+int storeExitStatus(struct logRecord *rec, const void *payload, uint32_t length) {
+    uint32_t status;
+
+    if (length != sizeof(status)) {
+        return -1;
+    }
+    memcpy(&status, payload, sizeof(status));
+    recordPrintf(rec, "Exit status: %u\n", ntohl(status));
+    return ntohl(status);
+}
+
+/** @brief Reads output frames from a given open socket connection until the end-of-output
+ *         frame, stores the output in the result store and references it in the output file.
+ *
+ *  Related to item 3.
+ *
+ *  A command running for COMMAND_TIMEOUT is cancelled; if the agent does not end it within
+ *  CANCEL_GRACE, the connection is given up. A frame stuck half way fails after the
+ *  IDLE_TIMEOUT receive timeout of the socket.
+ *
+ *  @param connfd socket identifier.
+ *  @param servaddr server address.
+ *  @return 0 once the output ended, -1 if the connection must be closed.
+ */
+int storeCommandOutput(int connfd, struct sockaddr_in addr) {
+    struct logRecord rec = {0};
+    struct result res;
+    char output[FRAME_MAXPAYLOAD];
+    struct pollfd pfd = { .fd = connfd, .events = POLLIN };
+    long long deadline = monotonicMs() + COMMAND_TIMEOUT * 1000;
+    z_stream *inflater = NULL;
+    int cancelled = 0;
+    int result = -1;
+    uint8_t type = 0;
+    uint32_t id;
+    uint32_t length = 0;
+
+    time_t clock = time(NULL);
+    recordPrintf(&rec, "[%s:%d] (%.24s) - Command output\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), ctime(&clock));
+    resultInit(&res);
+
+    for ( ; ; ) {
+        long long left = deadline - monotonicMs();
+        int ready = left > 0 ? poll(&pfd, 1, left) : 0;
+
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        } else if (ready == 0 && !cancelled) {
+            writeFrame(connfd, FRAME_CANCEL, 0, NULL, 0);
+            deadline = monotonicMs() + CANCEL_GRACE * 1000;
+            cancelled = 1;
+            continue;
+        } else if (ready == 0) {
+            resultCommit(&res, &rec, ", incomplete");
+            recordPrintf(&rec, "Agent did not end the cancelled command\n");
+            break;
+        }
+
+        if (ready < 0 || readFrame(connfd, &type, &id, output, &length) <= 0) {
+            resultCommit(&res, &rec, ", incomplete");
+            break;
+        }
+        if (type == FRAME_END) {
+            resultCommit(&res, &rec, cancelled ? ", cancelled" : "");
+            storeExitStatus(&rec, output, length);
+            result = 0;
+            break;
+        } else if (type == FRAME_OUTPUT) {
+            resultWrite(&res, output, length);
+            // printf("%s | %.*s %s", KGRN, length, output, KNRM);
+        } else if (type == FRAME_COMPRESSED && storeCompressedOutput(&res, &inflater, output, length) < 0) {
+            resultCommit(&res, &rec, ", incomplete");
+            recordPrintf(&rec, "Corrupt compressed output\n");
+            break;
+        } else if (type == FRAME_COMPRESSED && res.truncated && !cancelled) {
+            writeFrame(connfd, FRAME_CANCEL, 0, NULL, 0);
+            deadline = monotonicMs() + CANCEL_GRACE * 1000;
+            cancelled = 1;
+        } else if (type == FRAME_HELLO) {
+            unsigned char codec = chooseCodec(output, length);
+            writeFrame(connfd, FRAME_HELLO, 0, &codec, sizeof(codec));
+        }
+    }
+    inflaterFree(&inflater);
+
+    // The child blocks on the agent next, so the record is written right away
+    logCommit(&rec, rec.len);
+    logFlush();
+    recordFree(&rec);
+    return result;
+}
+
+/** @brief Sleeps for given seconds before closing connection
+ *
+ *  Related to item 2.
+ *
+ *  @param time seconds to sleep.
+ */
+void serverSleep(int time) {
+    printf("%sStarting sleep... \n", KNRM);
+    sleep(time);
+    printf("%sFinishing sleep... \n", KNRM);    
+}
+
+/** @brief Accepts a connection and saves client information to the output file.
+ *
+ *  @param listenfd socket identifier.
+ *  @param addr filled with the peer address.
+ *  @return new socket identifier, -1 on error, with errno set.
+ */
+int acceptConnection(int listenfd, struct sockaddr_in *addr) {
+    socklen_t len = sizeof(*addr);
+    int connfd = accept(listenfd, (struct sockaddr *) addr, &len);
+
+    if (connfd < 0) {
+        return -1;
+    }
+
+    time_t clock = time(NULL);
+
+    // Keep for assessment
+    // printf("%s%.24s - Connection accepted \n%s", KGRN, ctime(&clock), KNRM);
+    // printf("Peer IP address: %s\n", inet_ntoa(addr->sin_addr));
+    // printf("Peer port      : %d\n", ntohs(addr->sin_port));
+    struct logRecord rec = {0};
+    recordPrintf(&rec, "%.24s - Connection accepted \n", ctime(&clock));
+    recordPrintf(&rec, "Peer IP address: %s\n", inet_ntoa(addr->sin_addr));
+    recordPrintf(&rec, "Peer port      : %d\n", ntohs(addr->sin_port));
+    logCommit(&rec, rec.len);
+    recordFree(&rec);
+
+    // Nothing may be pending when the child is forked, or it would be written twice
+    logFlush();
+
+    return connfd;
+}
+
+/** @brief Reads a command from stdin.
+ *
+ *  @param command buffer to save input.
+ */
+void readCommand(char* command) {
+    scanf("%s", command);
+}
+
+/** @brief Sends a command to a connected client.
+ *
+ *  @param command buffer to save input.
+ *  @param connfd socket identifier.
+ *  @param servaddr server address.
+ */
+void sendCommand(char* command, int connfd, struct sockaddr_in addr) {
+    time_t clock = time(NULL);
+    printf("%s[%s:%d] (%.24s) Command '%s' sent %s\n", KGRN, inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), ctime(&clock), command, KNRM);
+    
+    writeFrame(connfd, FRAME_COMMAND, 0, command, strlen(command));
+}
+
+/** @brief Validate program arguments.
+ *
+ *  @param argc number of arguments.
+ *  @param argv arguments.
+ */
+void assertValidArgs(int argc, char **argv) {
+    char error[MAXLINE + 1];
+
+    if (argc < 3 || argc > 5 || (argc >= 4 && strcmp(argv[3], MODE_FORK) != 0 && strcmp(argv[3], MODE_EPOLL) != 0 && strcmp(argv[3], MODE_BROADCAST) != 0
+            && strcmp(argv[3], MODE_WORKERS) != 0)
+        || (argc == 5 && (atoi(argv[4]) < 1 || atoi(argv[4]) > MAXPIPELINE))) {
+        strcpy(error,"uso: ");
+        strcat(error,argv[0]);
+        strcat(error,"<Port> <Backlog> [fork|epoll|broadcast|workers] [Depth]\n");
+        perror(error);
+        exit(1);
+    }
+}
+
+/** @brief A command sent to an agent whose output did not fully arrive yet.
+ */
+struct pendingCommand {
+    uint32_t id;
+    char command[MAXDATASIZE];
+    struct logRecord record;    /* output file record being built */
+    struct result output;       /* output received so far */
+    int inSweep;                /* command of the current sweep */
+    uint32_t job;               /* journal job id, 0 if not journaled */
+    struct timespec sent;       /* when the command was queued */
+    struct connection *conn;
+    struct wheelTimer deadline; /* COMMAND_TIMEOUT, then CANCEL_GRACE once cancelled */
+    int cancelled;              /* FRAME_CANCEL queued */
+    z_stream *inflater;         /* decompresses the output, NULL until it arrives compressed */
+};
+
+/** @brief Per-connection state kept by the event loop in place of a forked child.
+ *
+ *  Up to pipelineDepth commands are in flight at once; their outputs are told apart by the
+ *  command id of each frame, so they may arrive in any order.
+ */
+struct connection {
+    struct netConnection net;   /* socket, agent address, command frames being sent and output
+                                   frames being received */
+    int nextCommand;            /* index of the next command to be sent */
+    uint32_t nextId;            /* id of the next command to be sent */
+    int closing;                /* EXIT queued, close once it is sent */
+    struct pendingCommand *pending[MAXPIPELINE]; /* from commandSlab, NULL if free */
+    int inFlight;
+    struct logRecord record;    /* connection events not tied to a command */
+    struct wheelTimer idle;     /* IDLE_TIMEOUT, running while a frame is stuck half way */
+    struct connection *prev;
+    struct connection *next;
+};
+
+/** @brief Operator command being fanned out to every connected agent in broadcast mode.
+ */
+struct sweep {
+    int active;
+    int dispatching;
+    char command[MAXDATASIZE];
+    struct timespec started;
+    int dispatched;
+    int pending;
+    int replied;
+    double totalLatency;
+    double maxLatency;
+    size_t wireBytes;           /* output frames received, compressed or not */
+    size_t outputBytes;         /* output stored */
+    int newOutputs;             /* outputs the result store did not have yet */
+};
+
+/** @brief Lines typed by the operator that were not executed yet.
+ */
+struct operatorInput {
+    struct watcher watcher;     /* stdin, only registered while a new line can be executed */
+    char buf[MAXLINE];
+    size_t len;
+    int closed;
+    int unwatched;              /* stdin is a file epoll refuses, read it whenever a line is wanted */
+    int discarding;             /* the rest of an overlong line is being skipped */
+};
+
+struct reactor reactor;
+struct connection *connections; /* every connection of the event loop */
+struct sweep sweep;
+struct timer sweepTimer;        /* SWEEP_TIMEOUT deadline of the current sweep */
+struct timer logTimer;          /* LOG_FLUSHINTERVAL deadline of the pending records */
+struct watcher listener;        /* listening socket of the event loop */
+struct timer acceptTimer;       /* ACCEPT_RETRYINTERVAL deadline after the descriptors ran out */
+struct timerWheel wheel;        /* command deadlines and idle timeouts of the connections */
+int acceptPaused;               /* accept failed for lack of descriptors */
+struct operatorInput operator;
+char (*commandList)[40];        /* hard-coded list of commands, NULL in broadcast mode */
+struct slab connectionSlab;
+struct slab commandSlab;
+int pipelineDepth = 1;          /* commands in flight per connection */
+
+/** @brief Milliseconds elapsed since a monotonic timestamp.
+ *
+ *  @param since start timestamp.
+ *  @return elapsed time in milliseconds.
+ */
+double elapsedMs(struct timespec *since) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000.0 + (now.tv_nsec - since->tv_nsec) / 1000000.0;
+}
+
+/* Job journal of broadcast mode. Every operator command (a job), every agent it was sent to
+ * and every exit status received is appended to a memory-mapped file, so after a crash the
+ * restarted server knows which agent/command pairs never answered and sends only those again,
+ * as soon as an agent from the same address connects. Agents reconnect from a new port, so
+ * they are identified by their IP address alone. Records are fixed headers followed by the
+ * command text; the magic number is stored last, so a record torn by a crash ends the scan.
+ * Every JOURNAL_CHECKPOINTINTERVAL seconds, or when the mapping is full, the journal is
+ * rewritten with only the outstanding jobs and pairs and renamed over the old one. Results
+ * an address still owes JOURNAL_MAXAGE seconds after the job was submitted are given up at
+ * the next checkpoint, so an agent that never comes back is not carried forever. */
+
+#define JOURNAL_CHECKPOINT 1    /* first record of a compacted journal, job is the last job id */
+#define JOURNAL_SUBMIT     2    /* operator command accepted as a job */
+#define JOURNAL_DISPATCH   3    /* job sent to the agent */
+#define JOURNAL_RESULT     4    /* exit status of the agent received */
+
+struct journalRecord {
+    uint32_t magic;
+    uint8_t type;
+    uint8_t length;             /* bytes of command, JOURNAL_SUBMIT only */
+    uint16_t unused;
+    uint32_t job;
+    uint32_t agent;             /* IPv4 address of the agent, network order */
+    int32_t status;             /* exit status, or submission time of JOURNAL_SUBMIT */
+    char command[];
+};
+
+/** @brief A job with agents that did not answer yet.
+ */
+struct journalJob {
+    uint32_t id;
+    time_t submitted;
+    char command[MAXDATASIZE];
+    int outstanding;            /* pairs of this job still waiting for a result */
+};
+
+/** @brief A job sent to agents of one address whose results were not all received. Pairs
+ *         are chained by hash of (job, agent), and again by hash of the agent alone so a
+ *         connecting agent finds what its address owes. Unused slots are kept in a free list.
+ */
+struct journalPair {
+    int used;
+    uint32_t job;
+    uint32_t agent;
+    int owed;                   /* results still expected from this address */
+    int running;                /* of those, how many live connections are running */
+    int next;
+    int agentNext;
+};
+
+struct journal {
+    int enabled;
+    int fd;
+    char *map;
+    size_t size;
+    size_t tail;                /* end of the last record */
+    size_t checkpointTail;      /* tail right after the last checkpoint */
+    uint32_t lastJob;
+    struct journalJob *jobs;
+    int njobs;
+    int maxJobs;
+    struct journalPair *pairs;
+    int maxPairs;
+    int freePair;
+    int unbound;                /* results owed that no connection is running */
+    int buckets[JOURNAL_BUCKETS];
+    int agentBuckets[JOURNAL_BUCKETS];
+};
+
+struct journal journal;
+struct timer checkpointTimer;
+
+/** @brief Size of a record, rounded so the next one stays aligned.
+ *
+ *  @param length bytes of command.
+ *  @return record size in bytes.
+ */
+size_t journalRecordSize(size_t length) {
+    return (sizeof(struct journalRecord) + length + 3) & ~(size_t) 3;
+}
+
+/** @brief Maps the journal file, growing the file first if it is shorter than size.
+ *
+ *  @param fd journal file descriptor.
+ *  @param size mapping size.
+ *  @return the mapping.
+ */
+char *journalMap(int fd, size_t size) {
+    struct stat st;
+    char *map;
+
+    if (fstat(fd, &st) == -1 || ((size_t) st.st_size < size && ftruncate(fd, size) == -1)) {
+        perror("journal");
+        exit(1);
+    }
+    if ((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return map;
+}
+
+/** @brief Writes a record at the tail, growing the file if it does not fit.
+ */
+void journalWrite(uint8_t type, uint32_t job, uint32_t agent, int32_t status, const char *command) {
+    size_t length = command != NULL ? strnlen(command, MAXDATASIZE - 1) : 0;
+    size_t size = journalRecordSize(length);
+
+    if (journal.tail + size > journal.size) {
+        size_t grown = journal.size * 2;
+
+        if (ftruncate(journal.fd, grown) == -1 || (journal.map = mremap(journal.map, journal.size, grown, MREMAP_MAYMOVE)) == MAP_FAILED) {
+            perror("journal");
+            exit(1);
+        }
+        journal.size = grown;
+    }
+
+    struct journalRecord *rec = (struct journalRecord *) (journal.map + journal.tail);
+    rec->type = type;
+    rec->length = length;
+    rec->unused = 0;
+    rec->job = job;
+    rec->agent = agent;
+    rec->status = status;
+    memcpy(rec->command, command, length);
+    __atomic_store_n(&rec->magic, JOURNAL_MAGIC, __ATOMIC_RELEASE);
+
+    journal.tail += size;
+}
+
+struct journalJob *journalFindJob(uint32_t id) {
+    for (int i = 0; i < journal.njobs; i++) {
+        if (journal.jobs[i].id == id) {
+            return &journal.jobs[i];
+        }
+    }
+    return NULL;
+}
+
+unsigned journalBucket(uint32_t job, uint32_t agent) {
+    return (job * 2654435761u ^ agent * 2246822519u) & (JOURNAL_BUCKETS - 1);
+}
+
+/** @brief Finds the pair of an agent and job.
+ *
+ *  @param job job id.
+ *  @param agent agent address.
+ *  @param link where the link pointing to the pair is stored, may be NULL.
+ *  @return index of the pair, -1 if there is none.
+ */
+int journalFindPair(uint32_t job, uint32_t agent, int **link) {
+    int *prev = &journal.buckets[journalBucket(job, agent)];
+
+    for (int i = *prev; i >= 0; prev = &journal.pairs[i].next, i = *prev) {
+        if (journal.pairs[i].job == job && journal.pairs[i].agent == agent) {
+            if (link != NULL) {
+                *link = prev;
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+unsigned journalAgentBucket(uint32_t agent) {
+    return (agent * 2654435761u) & (JOURNAL_BUCKETS - 1);
+}
+
+/** @brief Returns a pair to the free list, unlinking it from both hash chains.
+ *
+ *  @param i pair index.
+ *  @param link link to the pair in its (job, agent) chain, as found by journalFindPair.
+ */
+void journalFreePair(int i, int *link) {
+    int *prev = &journal.agentBuckets[journalAgentBucket(journal.pairs[i].agent)];
+
+    while (*prev != i) {
+        prev = &journal.pairs[*prev].agentNext;
+    }
+    *prev = journal.pairs[i].agentNext;
+    *link = journal.pairs[i].next;
+    journal.pairs[i].used = 0;
+    journal.pairs[i].next = journal.freePair;
+    journal.freePair = i;
+}
+
+/** @brief Applies a record to the outstanding jobs and pairs, live or while recovering.
+ */
+void journalApply(uint8_t type, uint32_t job, uint32_t agent, int32_t status, const char *command, size_t length, struct connection *conn) {
+    struct journalJob *j;
+    int *link, i;
+
+    if (job > journal.lastJob) {
+        journal.lastJob = job;
+    }
+
+    if (type == JOURNAL_SUBMIT) {
+        if (journal.njobs == journal.maxJobs) {
+            journal.maxJobs = journal.maxJobs > 0 ? journal.maxJobs * 2 : 64;
+            if ((journal.jobs = realloc(journal.jobs, journal.maxJobs * sizeof(struct journalJob))) == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        j = &journal.jobs[journal.njobs++];
+        j->id = job;
+        // Journals written before submission times were recorded start the clock now
+        j->submitted = status != 0 ? (time_t) (uint32_t) status : time(NULL);
+        j->outstanding = 0;
+        snprintf(j->command, sizeof(j->command), "%.*s", (int) length, command);
+    } else if (type == JOURNAL_DISPATCH) {
+        if ((j = journalFindJob(job)) == NULL) {
+            return;
+        }
+        if ((i = journalFindPair(job, agent, NULL)) >= 0) {
+            journal.pairs[i].owed++;
+            journal.pairs[i].running += conn != NULL;
+            journal.unbound += conn == NULL;
+            j->outstanding++;
+            return;
+        }
+        if (journal.freePair < 0) {
+            int old = journal.maxPairs;
+
+            journal.maxPairs = old > 0 ? old * 2 : 1024;
+            if ((journal.pairs = realloc(journal.pairs, journal.maxPairs * sizeof(struct journalPair))) == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            for (i = journal.maxPairs - 1; i >= old; i--) {
+                journal.pairs[i].used = 0;
+                journal.pairs[i].next = journal.freePair;
+                journal.freePair = i;
+            }
+        }
+
+        i = journal.freePair;
+        journal.freePair = journal.pairs[i].next;
+        journal.pairs[i].used = 1;
+        journal.pairs[i].job = job;
+        journal.pairs[i].agent = agent;
+        journal.pairs[i].owed = 1;
+        journal.pairs[i].running = conn != NULL;
+        journal.pairs[i].next = journal.buckets[journalBucket(job, agent)];
+        journal.buckets[journalBucket(job, agent)] = i;
+        journal.pairs[i].agentNext = journal.agentBuckets[journalAgentBucket(agent)];
+        journal.agentBuckets[journalAgentBucket(agent)] = i;
+        journal.unbound += conn == NULL;
+        j->outstanding++;
+    } else if (type == JOURNAL_RESULT) {
+        if ((i = journalFindPair(job, agent, &link)) < 0) {
+            return;
+        }
+
+        // Live results come from a connection running the job, recovered ones from nobody
+        if (conn != NULL && journal.pairs[i].running > 0) {
+            journal.pairs[i].running--;
+        } else {
+            journal.unbound--;
+        }
+        if ((j = journalFindJob(job)) != NULL) {
+            j->outstanding--;
+        }
+        if (--journal.pairs[i].owed == 0) {
+            journalFreePair(i, link);
+        }
+    }
+}
+
+/** @brief Gives up the results owed for jobs submitted JOURNAL_MAXAGE seconds ago or more.
+ *         Pairs a live connection is running are kept until it answers. Jobs are kept in
+ *         submission order, so the expired ones are a prefix of the list.
+ */
+void journalExpire() {
+    time_t now = time(NULL);
+    uint32_t expired = 0;
+    int abandoned = 0;
+
+    for (int i = 0; i < journal.njobs && now - journal.jobs[i].submitted >= JOURNAL_MAXAGE; i++) {
+        expired = journal.jobs[i].id;
+    }
+    if (expired == 0) {
+        return;
+    }
+
+    for (int i = 0; i < journal.maxPairs; i++) {
+        struct journalPair *pair = &journal.pairs[i];
+        int owed = pair->owed - pair->running;
+        int *link;
+
+        if (!pair->used || pair->job > expired || owed == 0) {
+            continue;
+        }
+        journalFindJob(pair->job)->outstanding -= owed;
+        journal.unbound -= owed;
+        abandoned += owed;
+        if ((pair->owed -= owed) == 0) {
+            journalFindPair(pair->job, pair->agent, &link);
+            journalFreePair(i, link);
+        }
+    }
+
+    if (abandoned > 0) {
+        printf("%sJournal: gave up %d results owed for more than %d s%s\n", KGRN, abandoned, JOURNAL_MAXAGE, KNRM);
+    }
+}
+
+/** @brief Rewrites the journal with only the outstanding jobs and pairs, replacing the old
+ *         file atomically with rename once the new one is on disk.
+ */
+void journalCheckpoint() {
+    char *oldMap = journal.map;
+    size_t oldSize = journal.size;
+    int oldFd = journal.fd;
+    int kept = 0;
+
+    journalExpire();
+    for (int i = 0; i < journal.njobs; i++) {
+        if (journal.jobs[i].outstanding > 0) {
+            journal.jobs[kept++] = journal.jobs[i];
+        }
+    }
+    journal.njobs = kept;
+
+    if ((journal.fd = open(JOURNAL_FILE ".tmp", O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+        perror("open");
+        exit(1);
+    }
+    journal.size = JOURNAL_SIZE;
+    while (journal.size < 2 * (journal.njobs * journalRecordSize(MAXDATASIZE) + journal.maxPairs * journalRecordSize(0))) {
+        journal.size *= 2;
+    }
+    journal.map = journalMap(journal.fd, journal.size);
+    journal.tail = 0;
+
+    journalWrite(JOURNAL_CHECKPOINT, journal.lastJob, 0, 0, NULL);
+    for (int i = 0; i < journal.njobs; i++) {
+        journalWrite(JOURNAL_SUBMIT, journal.jobs[i].id, 0, (int32_t) journal.jobs[i].submitted, journal.jobs[i].command);
+    }
+    for (int i = 0; i < journal.maxPairs; i++) {
+        for (int n = journal.pairs[i].used ? journal.pairs[i].owed : 0; n > 0; n--) {
+            journalWrite(JOURNAL_DISPATCH, journal.pairs[i].job, journal.pairs[i].agent, 0, NULL);
+        }
+    }
+
+    if (fdatasync(journal.fd) == -1 || rename(JOURNAL_FILE ".tmp", JOURNAL_FILE) == -1) {
+        perror("journal");
+        exit(1);
+    }
+    if (oldMap != NULL) {
+        munmap(oldMap, oldSize);
+    }
+    close(oldFd);
+    journal.checkpointTail = journal.tail;
+}
+
+/** @brief Opens the journal, rebuilding the outstanding pairs left by the previous run, and
+ *         compacts it right away.
+ */
+void journalOpen() {
+    struct timespec started;
+    struct stat st;
+    size_t offset = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    memset(journal.buckets, -1, sizeof(journal.buckets));
+    memset(journal.agentBuckets, -1, sizeof(journal.agentBuckets));
+    journal.freePair = -1;
+    journal.enabled = 1;
+
+    if ((journal.fd = open(JOURNAL_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1 || fstat(journal.fd, &st) == -1) {
+        perror("open");
+        exit(1);
+    }
+
+    if (st.st_size > 0) {
+        journal.size = st.st_size;
+        journal.map = journalMap(journal.fd, journal.size);
+
+        while (offset + sizeof(struct journalRecord) <= journal.size) {
+            struct journalRecord *rec = (struct journalRecord *) (journal.map + offset);
+
+            if (rec->magic != JOURNAL_MAGIC || offset + journalRecordSize(rec->length) > journal.size) {
+                break;
+            }
+            journalApply(rec->type, rec->job, rec->agent, rec->status, rec->command, rec->length, NULL);
+            offset += journalRecordSize(rec->length);
+        }
+    }
+    journalCheckpoint();
+
+    printf("%sJournal: %d commands of %d jobs outstanding, recovered from %zu bytes in %.3f ms%s\n",
+        KGRN, journal.unbound, journal.njobs, offset, elapsedMs(&started), KNRM);
+}
+
+/** @brief Appends a record, compacting the journal first if the mapping is full.
+ */
+void journalAppend(uint8_t type, uint32_t job, uint32_t agent, int32_t status, const char *command) {
+    if (journal.tail + journalRecordSize(MAXDATASIZE) > journal.size) {
+        journalCheckpoint();
+    }
+    journalWrite(type, job, agent, status, command);
+}
+
+/** @brief Records a new operator command.
+ *
+ *  @param command command typed by the operator.
+ *  @return id of the new job.
+ */
+uint32_t journalSubmit(const char *command) {
+    uint32_t job = journal.lastJob + 1;
+    int32_t submitted = (int32_t) time(NULL);
+
+    journalAppend(JOURNAL_SUBMIT, job, 0, submitted, command);
+    journalApply(JOURNAL_SUBMIT, job, 0, submitted, command, strlen(command), NULL);
+    return job;
+}
+
+/** @brief Records that a job was sent to the agent of a connection.
+ */
+void journalDispatch(uint32_t job, struct connection *conn) {
+    uint32_t agent = conn->net.addr.sin_addr.s_addr;
+
+    journalAppend(JOURNAL_DISPATCH, job, agent, 0, NULL);
+    journalApply(JOURNAL_DISPATCH, job, agent, 0, NULL, 0, conn);
+}
+
+/** @brief Records the exit status of a job on the agent of a connection.
+ */
+void journalResult(uint32_t job, struct connection *conn, int status) {
+    uint32_t agent = conn->net.addr.sin_addr.s_addr;
+
+    journalAppend(JOURNAL_RESULT, job, agent, status, NULL);
+    journalApply(JOURNAL_RESULT, job, agent, status, NULL, 0, conn);
+}
+
+/** @brief Hands a job whose connection was lost to the next agent from the same address. It
+ *         stays owed, no record is needed.
+ */
+void journalRelease(uint32_t job, struct connection *conn) {
+    int i = journalFindPair(job, conn->net.addr.sin_addr.s_addr, NULL);
+
+    if (i >= 0 && journal.pairs[i].running > 0) {
+        journal.pairs[i].running--;
+        journal.unbound++;
+    }
+}
+
+/** @brief Periodic compaction, skipped when nothing was appended since the last one and no
+ *         job is old enough to be given up.
+ *
+ *  @param reactor reactor.
+ *  @param timer checkpoint timer.
+ */
+void journalCheckpointExpired(struct reactor *reactor, struct timer *timer) {
+    if (journal.tail > journal.checkpointTail
+        || (journal.njobs > 0 && time(NULL) - journal.jobs[0].submitted >= JOURNAL_MAXAGE)) {
+        journalCheckpoint();
+    }
+    timerStart(reactor, timer, JOURNAL_CHECKPOINTINTERVAL * 1000);
+}
+
+void commandExpired(struct timerWheel *wheel, struct wheelTimer *timer);
+
+/** @brief Appends a command frame to the connection send buffer and keeps track of it until
+ *         its output arrives.
+ *
+ *  @param conn connection.
+ *  @param command command to be sent.
+ *  @return the pending command, NULL for EXIT, which gets no output.
+ */
+struct pendingCommand* queueCommand(struct connection *conn, const char *command) {
+    struct pendingCommand *cmd = NULL;
+    size_t len = strnlen(command, MAXDATASIZE - 1);
+    time_t clock = time(NULL);
+    unsigned char header[FRAME_HEADERSIZE];
+
+    encodeFrameHeader(header, FRAME_COMMAND, conn->nextId, len);
+    bufferAppend(&conn->net.out, header, FRAME_HEADERSIZE);
+    bufferAppend(&conn->net.out, command, len);
+
+    if (strcmp(command, EXIT_KEY_WORD) == 0) {
+        conn->closing = 1;
+        return NULL;
+    }
+
+    for (int i = 0; i < MAXPIPELINE && cmd == NULL; i++) {
+        if (conn->pending[i] == NULL) {
+            cmd = conn->pending[i] = slabAlloc(&commandSlab);
+        }
+    }
+
+    cmd->id = conn->nextId++;
+    snprintf(cmd->command, sizeof(cmd->command), "%.*s", (int) len, command);
+    cmd->inSweep = 0;
+    cmd->job = 0;
+    cmd->conn = conn;
+    cmd->cancelled = 0;
+    cmd->inflater = NULL;
+    resultInit(&cmd->output);
+    clock_gettime(CLOCK_MONOTONIC, &cmd->sent);
+    wheelTimerInit(&cmd->deadline, commandExpired, cmd);
+    wheelStart(&wheel, &cmd->deadline, COMMAND_TIMEOUT * 1000);
+    recordPrintf(&cmd->record, "[%s:%d] (%.24s) - Command #%u '%s' output\n", inet_ntoa(conn->net.addr.sin_addr), ntohs(conn->net.addr.sin_port), ctime(&clock), cmd->id, cmd->command);
+    conn->inFlight++;
+
+    return cmd;
+}
+
+/** @brief Queues commands of the hard-coded list while the pipeline has room. EXIT is only
+ *         queued once every output arrived.
+ *
+ *  @param conn connection.
+ *  @param commands hard-coded list of commands.
+ */
+void fillPipeline(struct connection *conn, char commands[][40]) {
+    while (!conn->closing && conn->nextCommand < N_COMMANDS) {
+        const char *command = commands[conn->nextCommand];
+        time_t clock = time(NULL);
+
+        if (strcmp(command, EXIT_KEY_WORD) == 0 ? conn->inFlight > 0 : conn->inFlight >= pipelineDepth) {
+            return;
+        }
+        conn->nextCommand++;
+        queueCommand(conn, command);
+
+        printf("%s[%s:%d] (%.24s) Command '%s' sent %s\n", KGRN, inet_ntoa(conn->net.addr.sin_addr), ntohs(conn->net.addr.sin_port), ctime(&clock), command, KNRM);
+    }
+}
+
+/** @brief Writes as much of the pending command frames as the socket accepts.
+ *
+ *  @param conn connection.
+ *  @return 0 if every frame was sent or the socket would block, -1 if the connection must be
+ *          closed (error or EXIT sent).
+ */
+int flushCommands(struct connection *conn) {
+    size_t before = bufferLength(&conn->net.out);
+    int queued = netFlush(&conn->net);
+
+    if (queued < 0) {
+        return -1;
+    }
+    if (bufferLength(&conn->net.out) < before) {
+        wheelStart(&wheel, &conn->idle, IDLE_TIMEOUT * 1000);
+    }
+    return (queued == 0 && conn->closing) ? -1 : 0;
+}
+
+/** @brief Finds the pending command of an output frame.
+ *
+ *  @param conn connection.
+ *  @param id command id of the frame.
+ *  @return the pending command, NULL if no command has this id.
+ */
+struct pendingCommand* findCommand(struct connection *conn, uint32_t id) {
+    for (int i = 0; i < MAXPIPELINE; i++) {
+        if (conn->pending[i] != NULL && conn->pending[i]->id == id) {
+            return conn->pending[i];
+        }
+    }
+    return NULL;
+}
+
+/** @brief Frees the pipeline slot of a command whose output ended.
+ *
+ *  @param conn connection.
+ *  @param cmd the command.
+ */
+void releaseCommand(struct connection *conn, struct pendingCommand *cmd) {
+    for (int i = 0; i < MAXPIPELINE; i++) {
+        if (conn->pending[i] == cmd) {
+            conn->pending[i] = NULL;
+        }
+    }
+    wheelCancel(&wheel, &cmd->deadline);
+    inflaterFree(&cmd->inflater);
+    resultDiscard(&cmd->output);
+    recordFree(&cmd->record);
+    slabFree(&commandSlab, cmd);
+    conn->inFlight--;
+}
+
+void sweepReply(struct connection *conn, struct pendingCommand *cmd, int status);
+void cancelCommand(struct connection *conn, struct pendingCommand *cmd);
+
+/** @brief Stores every complete frame in the connection input buffer, keeping a trailing
+ *         partial frame for the next read.
+ *
+ *  @param conn connection.
+ *  @return number of outputs that ended, -1 on a malformed frame.
+ */
+int consumeFrames(struct connection *conn) {
+    unsigned char *in = (unsigned char *) bufferData(&conn->net.in);
+    size_t inLen = bufferLength(&conn->net.in);
+    size_t offset = 0;
+    int ended = 0;
+    uint8_t type;
+    uint32_t id;
+    uint32_t length;
+
+    while (inLen - offset >= FRAME_HEADERSIZE) {
+        decodeFrameHeader(in + offset, &type, &id, &length);
+        if (length > FRAME_MAXPAYLOAD) {
+            return -1;
+        }
+        if (inLen - offset < FRAME_HEADERSIZE + length) {
+            break;
+        }
+
+        unsigned char *payload = in + offset + FRAME_HEADERSIZE;
+        offset += FRAME_HEADERSIZE + length;
+
+        if (type == FRAME_HELLO) {
+            unsigned char codec = chooseCodec(payload, length);
+            unsigned char header[FRAME_HEADERSIZE];
+
+            encodeFrameHeader(header, FRAME_HELLO, 0, sizeof(codec));
+            bufferAppend(&conn->net.out, header, FRAME_HEADERSIZE);
+            bufferAppend(&conn->net.out, &codec, sizeof(codec));
+            reactorModify(&reactor, &conn->net.watcher, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+            continue;
+        }
+
+        struct pendingCommand *cmd = findCommand(conn, id);
+
+        if (cmd == NULL) {
+            continue;
+        } else if (type == FRAME_OUTPUT || type == FRAME_COMPRESSED) {
+            ssize_t stored = length;
+
+            if (type == FRAME_OUTPUT) {
+                resultWrite(&cmd->output, payload, length);
+            } else if ((stored = storeCompressedOutput(&cmd->output, &cmd->inflater, payload, length)) < 0) {
+                return -1;
+            } else if (cmd->output.truncated) {
+                cancelCommand(conn, cmd);
+            }
+            if (cmd->inSweep) {
+                sweep.wireBytes += length;
+                sweep.outputBytes += stored;
+            }
+        } else if (type == FRAME_END) {
+            if (resultCommit(&cmd->output, &cmd->record, cmd->cancelled ? ", cancelled" : "") && cmd->inSweep) {
+                sweep.newOutputs++;
+            }
+
+            int status = storeExitStatus(&cmd->record, payload, length);
+
+            logCommit(&cmd->record, cmd->record.len);
+            if (cmd->job != 0) {
+                journalResult(cmd->job, conn, status);
+            }
+            sweepReply(conn, cmd, status);
+            releaseCommand(conn, cmd);
+            ended++;
+        }
+    }
+
+    bufferConsume(&conn->net.in, offset);
+    return ended;
+}
+
+/** @brief Reads output frames until the socket would block.
+ *
+ *  Same framing as storeCommandOutput, but partial frames are kept in the connection
+ *  buffer between events. Idle connections also come here, to notice the agent leaving.
+ *
+ *  @param conn connection.
+ *  @return number of outputs that ended, -1 if the connection must be closed.
+ */
+int receiveOutputs(struct connection *conn) {
+    int ended = 0;
+
+    for ( ; ; ) {
+        int n = consumeFrames(conn);
+
+        if (n < 0) {
+            return -1;
+        }
+        ended += n;
+
+        ssize_t count = netFill(&conn->net);
+
+        if (count == 0) {
+            return -1;
+        } else if (count > 0) {
+            wheelStart(&wheel, &conn->idle, IDLE_TIMEOUT * 1000);
+        } else {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? ended : -1;
+        }
+    }
+}
+
+/** @brief Tells the agent to kill a command. The deadline of the command becomes the
+ *         CANCEL_GRACE the agent has to end it; its output keeps being stored until then.
+ *
+ *  @param conn connection.
+ *  @param cmd the command.
+ */
+void cancelCommand(struct connection *conn, struct pendingCommand *cmd) {
+    unsigned char header[FRAME_HEADERSIZE];
+
+    if (cmd->cancelled) {
+        return;
+    }
+    cmd->cancelled = 1;
+
+    encodeFrameHeader(header, FRAME_CANCEL, cmd->id, 0);
+    bufferAppend(&conn->net.out, header, FRAME_HEADERSIZE);
+    wheelStart(&wheel, &cmd->deadline, CANCEL_GRACE * 1000);
+
+    // Sent from the regular event dispatch, like the commands of a sweep
+    reactorModify(&reactor, &conn->net.watcher, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+}
+
+/** @brief Prints the summary of the current sweep and cancels the commands of the agents that
+ *         did not answer.
+ */
+void finishSweep() {
+    int missing = sweep.pending;
+
+    for (struct connection *conn = connections; conn != NULL; conn = conn->next) {
+        for (int i = 0; i < MAXPIPELINE; i++) {
+            if (conn->pending[i] != NULL && conn->pending[i]->inSweep) {
+                printf("[%s:%d] timed out, cancelling\n", inet_ntoa(conn->net.addr.sin_addr), ntohs(conn->net.addr.sin_port));
+                conn->pending[i]->inSweep = 0;
+                cancelCommand(conn, conn->pending[i]);
+            }
+        }
+    }
+
+    printf("%sSweep '%s': %d/%d agents replied, %d timed out, avg %.3f ms, max %.3f ms, total %.3f ms, %zu bytes received for %zu bytes of output, %d new outputs stored%s\n",
+        KGRN, sweep.command, sweep.replied, sweep.dispatched, missing,
+        sweep.replied > 0 ? sweep.totalLatency / sweep.replied : 0.0, sweep.maxLatency, elapsedMs(&sweep.started),
+        sweep.wireBytes, sweep.outputBytes, sweep.newOutputs, KNRM);
+    fflush(stdout);
+
+    sweep.active = 0;
+    timerCancel(&reactor, &sweepTimer);
+}
+
+/** @brief Records the answer of an agent to the current sweep, finishing the sweep on the last one.
+ *
+ *  @param conn connection.
+ *  @param cmd command that ended.
+ *  @param status exit status of the command, -2 if the agent disconnected.
+ */
+void sweepReply(struct connection *conn, struct pendingCommand *cmd, int status) {
+    if (!cmd->inSweep) {
+        return;
+    }
+
+    double latency = elapsedMs(&cmd->sent);
+    cmd->inSweep = 0;
 
-#define LISTENQ 10
-#define N_COMMANDS 4
-#define MAXDATASIZE 100
-#define MAXLINE 4096
-#define KGRN  "\x1B[32m"
-#define KNRM  "\x1B[0m"
-#define EXIT_KEY_WORD  "EXIT"
-#define FILENAME "output.txt"
+    if (status != -2) {
+        printf("[%s:%d] exit status %d in %.3f ms\n", inet_ntoa(conn->net.addr.sin_addr), ntohs(conn->net.addr.sin_port), status, latency);
+        sweep.replied++;
+        sweep.totalLatency += latency;
+        if (latency > sweep.maxLatency) {
+            sweep.maxLatency = latency;
+        }
+    } else {
+        printf("[%s:%d] disconnected after %.3f ms\n", inet_ntoa(conn->net.addr.sin_addr), ntohs(conn->net.addr.sin_port), latency);
+    }
+
+    if (--sweep.pending == 0 && !sweep.dispatching) {
+        finishSweep();
+    }
+}
 
-/** @brief Wrapper function for getpeername: gets socket information.
+/** @brief Whether a connection is already running a journaled job.
  *
- *  @param connfd socket identifier.
- *  @param addrSize size of the returned address.
- *  @return socket address.
- */
-struct sockaddr_in getPeerName(int connfd, int addrSize) {
-    struct sockaddr_in addr;
-    socklen_t len = addrSize;
-    if (getpeername(connfd, (struct sockaddr*)&addr, &len) == -1 ) {
-        perror("getpeername");
-        exit(1);
+ *  @param conn connection.
+ *  @param job job id.
+ */
+int pendingJob(struct connection *conn, uint32_t job) {
+    for (int i = 0; i < MAXPIPELINE; i++) {
+        if (conn->pending[i] != NULL && conn->pending[i]->job == job) {
+            return 1;
+        }
     }
-    return addr;
+    return 0;
 }
 
-/** @brief Reads a message of size MAXLINE from a given open socket connection and
- *         stores it in the output file.
+/** @brief Sends an agent the journaled jobs its address never answered, as far as its
+ *         pipeline has room. Each agent runs a job at most once.
  *
- *  Related to item 3.
+ *  @param conn connection.
+ */
+void journalResume(struct connection *conn) {
+    uint32_t agent = conn->net.addr.sin_addr.s_addr;
+    int next;
+
+    for (int i = journal.agentBuckets[journalAgentBucket(agent)]; i >= 0 && conn->inFlight < pipelineDepth; i = next) {
+        struct journalPair *pair = &journal.pairs[i];
+
+        next = pair->agentNext;
+        if (pair->running == pair->owed || pair->agent != agent || pendingJob(conn, pair->job)) {
+            continue;
+        }
+
+        struct journalJob *job = journalFindJob(pair->job);
+        struct pendingCommand *cmd = queueCommand(conn, job->command);
+        cmd->job = pair->job;
+        pair->running++;
+        journal.unbound--;
+
+        printf("%s[%s:%d] Resuming job #%u '%s'%s\n", KGRN, inet_ntoa(conn->net.addr.sin_addr), ntohs(conn->net.addr.sin_port), job->id, job->command, KNRM);
+    }
+}
+
+/** @brief Runs the command/response state machine of a connection until it would block:
+ *         keeps the pipeline full, sends the queued commands and stores the outputs.
  *
- *  @param connfd socket identifier.
- *  @param servaddr server address.
+ *  @param conn connection.
+ *  @param commands hard-coded list of commands, NULL in broadcast mode.
+ *  @return 0 if the connection is waiting for the socket, -1 if it must be closed.
  */
-void storeCommandOutput(int connfd, struct sockaddr_in addr) {
-    FILE *fp;
-    char output[MAXDATASIZE];
-    char eof[MAXDATASIZE] = {1};
-    
-    fp = fopen(FILENAME, "a");
+int serveConnection(struct connection *conn, char commands[][40]) {
+    int ended;
+
+    do {
+        if (commands != NULL) {
+            fillPipeline(conn, commands);
+        } else if (journal.enabled && journal.unbound > 0 && !conn->closing) {
+            journalResume(conn);
+        }
+        if (flushCommands(conn) < 0 || (ended = receiveOutputs(conn)) < 0) {
+            return -1;
+        }
+    } while (ended > 0);
+
+    // Waiting for an agent to answer is not idle, only a frame stuck half way is
+    if (bufferLength(&conn->net.out) == 0 && bufferLength(&conn->net.in) == 0) {
+        wheelCancel(&wheel, &conn->idle);
+    } else if (!wheelRunning(&conn->idle)) {
+        wheelStart(&wheel, &conn->idle, IDLE_TIMEOUT * 1000);
+    }
+    return 0;
+}
 
+/** @brief Closes a connection handled by the event loop and saves it to the output file.
+ *
+ *  @param conn connection.
+ */
+void closeConnection(struct connection *conn) {
     time_t clock = time(NULL);
-    fprintf(fp, "[%s:%d] (%.24s) - Command output\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), ctime(&clock));
 
-    while ((read(connfd, output, MAXDATASIZE) > 0) && (strcmp(output, eof))) {
+    // Outputs interrupted by the agent are kept, followed by the close
+    for (int i = 0; i < MAXPIPELINE; i++) {
+        struct pendingCommand *cmd = conn->pending[i];
+
+        if (cmd != NULL) {
+            resultCommit(&cmd->output, &cmd->record, ", incomplete");
+            logCommit(&cmd->record, cmd->record.len);
+            sweepReply(conn, cmd, -2);
+            if (cmd->job != 0) {
+                journalRelease(cmd->job, conn);
+            }
+            releaseCommand(conn, cmd);
+        }
+    }
+    recordPrintf(&conn->record, "[%s:%d] (%.24s) Connection closed \n",  inet_ntoa(conn->net.addr.sin_addr), ntohs(conn->net.addr.sin_port), ctime(&clock));
+    logCommit(&conn->record, conn->record.len);
+
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        connections = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+
+    recordFree(&conn->record);
+    wheelCancel(&wheel, &conn->idle);
+    netClose(&reactor, &conn->net);
+    slabFree(&connectionSlab, conn);
 
-        fprintf(fp, "%s", output);
-        // printf("%s | %s %s", KGRN, output, KNRM);
-        bzero(output, MAXDATASIZE);
+    // A descriptor was freed, the agents waiting in the backlog can be accepted
+    if (acceptPaused) {
+        reactorModify(&reactor, &listener, EPOLLIN | EPOLLET);
     }
-    fclose(fp);
-    return;
 }
 
-/** @brief Sleeps for given seconds before closing connection
+/** @brief Reactor handler of a connection: runs its state machine and closes it when done.
  *
- *  Related to item 2.
+ *  @param reactor reactor.
+ *  @param watcher watcher of the connection socket.
+ *  @param events epoll events.
+ */
+void handleConnection(struct reactor *reactor, struct watcher *watcher, uint32_t events) {
+    struct connection *conn = watcher->data;
+
+    if (serveConnection(conn, commandList) < 0) {
+        closeConnection(conn);
+    }
+}
+
+/** @brief Command deadline: a command running for COMMAND_TIMEOUT is cancelled, and an agent
+ *         that does not end it within CANCEL_GRACE is disconnected.
  *
- *  @param time seconds to sleep.
+ *  @param wheel timer wheel.
+ *  @param timer deadline of the command.
  */
-void serverSleep(int time) {
-    printf("%sStarting sleep... \n", KNRM);
-    sleep(time);
-    printf("%sFinishing sleep... \n", KNRM);    
+void commandExpired(struct timerWheel *wheel, struct wheelTimer *timer) {
+    struct pendingCommand *cmd = timer->data;
+    struct connection *conn = cmd->conn;
+
+    if (!cmd->cancelled) {
+        printf("[%s:%d] command #%u '%s' still running after %d s, cancelling\n", inet_ntoa(conn->net.addr.sin_addr), ntohs(conn->net.addr.sin_port), cmd->id, cmd->command, COMMAND_TIMEOUT);
+        cancelCommand(conn, cmd);
+    } else {
+        printf("[%s:%d] command #%u '%s' not cancelled after %d s, closing\n", inet_ntoa(conn->net.addr.sin_addr), ntohs(conn->net.addr.sin_port), cmd->id, cmd->command, CANCEL_GRACE);
+        closeConnection(conn);
+    }
 }
 
-/** @brief Wrapper function for accept: accepts a client connection.
+/** @brief Idle timeout: the agent neither took nor completed a frame for IDLE_TIMEOUT.
  *
- *  @param listenfd socket identifier.
- *  @param servaddr server address.
- *  @param addrlen server address size.
- *  @return new socket identifier.
+ *  @param wheel timer wheel.
+ *  @param timer idle timer of the connection.
+ */
+void connectionIdle(struct timerWheel *wheel, struct wheelTimer *timer) {
+    struct connection *conn = timer->data;
+
+    printf("[%s:%d] stalled for %d s, closing\n", inet_ntoa(conn->net.addr.sin_addr), ntohs(conn->net.addr.sin_port), IDLE_TIMEOUT);
+    closeConnection(conn);
+}
+
+/** @brief Accepts the pending connections and registers them in the event loop.
+ *
+ *  At most ACCEPT_BATCH connections are accepted per call; the listener is then re-armed with
+ *  EPOLL_CTL_MOD, so a reconnect storm is taken in batches between the events of the agents
+ *  already connected. When the descriptors run out, the agents are left waiting in the
+ *  backlog until a connection closes or ACCEPT_RETRYINTERVAL expires.
+ *
+ *  @param reactor reactor.
+ *  @param watcher watcher of the listening socket.
+ *  @param events epoll events.
  */
-int Accept(int listenfd, struct sockaddr* addr, unsigned int* addrlen) {
+void acceptConnections(struct reactor *reactor, struct watcher *watcher, uint32_t events) {
     int connfd;
-    
-    if ((connfd = accept(listenfd, addr, addrlen)) == -1) {
-        perror("accept");
-        exit(1);
-    }
 
-    return connfd;
+    for (int accepted = 0; ; accepted++) {
+        if (accepted == ACCEPT_BATCH) {
+            reactorModify(reactor, watcher, EPOLLIN | EPOLLET);
+            return;
+        }
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+
+        if ((connfd = accept4(watcher->fd, (struct sockaddr *) &addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                if (!acceptPaused) {
+                    perror("accept, waiting for descriptors");
+                }
+                acceptPaused = 1;
+                timerStart(reactor, &acceptTimer, ACCEPT_RETRYINTERVAL);
+                return;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+        acceptPaused = 0;
+
+        struct connection *conn = slabAlloc(&connectionSlab);
+        netInit(&conn->net, connfd, &addr, handleConnection, conn);
+        wheelTimerInit(&conn->idle, connectionIdle, conn);
+
+        time_t clock = time(NULL);
+        recordPrintf(&conn->record, "%.24s - Connection accepted \n", ctime(&clock));
+        recordPrintf(&conn->record, "Peer IP address: %s\n", inet_ntoa(conn->net.addr.sin_addr));
+        recordPrintf(&conn->record, "Peer port      : %d\n", ntohs(conn->net.addr.sin_port));
+        logCommit(&conn->record, conn->record.len);
+
+        conn->next = connections;
+        if (connections != NULL) {
+            connections->prev = conn;
+        }
+        connections = conn;
+
+        // Edge-triggered: the first EPOLLOUT arrives as soon as the socket is writable
+        reactorAdd(reactor, &conn->net.watcher, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    }
 }
 
-/** @brief Accepts a connection and saves client information to the output file.
+/** @brief Sends the operator command to every agent with room in its pipeline at once.
  *
- *  @param listenfd socket identifier.
- *  @param servaddr server address.
- *  @return new socket identifier.
+ *  The commands are only loaded here; re-arming each socket with EPOLL_CTL_MOD makes the
+ *  loop report it writable again, so the sends happen from the regular event dispatch.
+ *
+ *  @param command command typed by the operator.
  */
-int acceptConnection(int listenfd, struct sockaddr_in servaddr) {
-    socklen_t len = sizeof(servaddr);
-    int connfd = Accept(listenfd, (struct sockaddr *) NULL, &len);
+void startSweep(const char *command) {
+    int sent = 0;
+    uint32_t job = 0;
 
-    time_t clock = time(NULL);
-    struct sockaddr_in addr = getPeerName(connfd, sizeof(servaddr));
+    bzero(&sweep, sizeof(sweep));
+    snprintf(sweep.command, sizeof(sweep.command), "%s", command);
+    clock_gettime(CLOCK_MONOTONIC, &sweep.started);
+    sweep.active = 1;
+    sweep.dispatching = 1;
+    timerStart(&reactor, &sweepTimer, SWEEP_TIMEOUT * 1000);
 
-    // Keep for assessment
-    // printf("%s%.24s - Connection accepted \n%s", KGRN, ctime(&clock), KNRM);
-    // printf("Peer IP address: %s\n", inet_ntoa(addr.sin_addr));
-    // printf("Peer port      : %d\n", ntohs(addr.sin_port));
-    FILE *fp;
-    fp = fopen(FILENAME, "a");
-    fprintf(fp, "%.24s - Connection accepted \n", ctime(&clock));
-    fprintf(fp, "Peer IP address: %s\n", inet_ntoa(addr.sin_addr));
-    fprintf(fp, "Peer port      : %d\n", ntohs(addr.sin_port));
-    fclose(fp);
-        
-    return connfd;
+    if (journal.enabled && strcmp(command, EXIT_KEY_WORD) != 0) {
+        job = journalSubmit(command);
+    }
+
+    for (struct connection *conn = connections; conn != NULL; conn = conn->next) {
+        if (conn->closing || conn->inFlight >= pipelineDepth) {
+            printf("[%s:%d] busy, skipped\n", inet_ntoa(conn->net.addr.sin_addr), ntohs(conn->net.addr.sin_port));
+            continue;
+        }
+
+        struct pendingCommand *cmd = queueCommand(conn, command);
+        if (cmd != NULL) {
+            cmd->inSweep = 1;
+            sweep.dispatched++;
+            sweep.pending++;
+            if (job != 0) {
+                cmd->job = job;
+                journalDispatch(job, conn);
+            }
+        }
+        sent++;
+
+        reactorModify(&reactor, &conn->net.watcher, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    }
+
+    printf("%sCommand '%s' sent to %d agents%s\n", KGRN, command, sent, KNRM);
+    sweep.dispatching = 0;
+    if (sweep.pending == 0) {
+        finishSweep();
+    }
 }
 
-/** @brief Reads a command from stdin.
+/** @brief Reads what the operator typed into the line buffer. A last line without a newline
+ *         is completed when stdin ends.
+ */
+void operatorRead() {
+    ssize_t n = read(STDIN_FILENO, operator.buf + operator.len, sizeof(operator.buf) - operator.len);
+
+    if (n == 0 || (n < 0 && errno != EINTR)) {
+        operator.closed = 1;
+        if (operator.len > 0 && operator.len < sizeof(operator.buf) && operator.buf[operator.len - 1] != '\n') {
+            operator.buf[operator.len++] = '\n';
+        }
+    } else if (n > 0) {
+        operator.len += n;
+    }
+}
+
+/** @brief Starts a sweep for the next line typed by the operator, if no sweep is running.
+ *         Stdin is only watched while a new line can be executed; a regular file or
+ *         /dev/null, which epoll refuses, is read directly instead.
+ */
+void nextOperatorCommand() {
+    char *end;
+
+    for ( ; ; ) {
+        if (operator.discarding && (end = memchr(operator.buf, '\n', operator.len)) != NULL) {
+            operator.len -= end + 1 - operator.buf;
+            memmove(operator.buf, end + 1, operator.len);
+            operator.discarding = 0;
+        } else if (operator.discarding) {
+            operator.len = 0;
+        }
+
+        while (!operator.discarding && !sweep.active && (end = memchr(operator.buf, '\n', operator.len)) != NULL) {
+            size_t lineLen = end - operator.buf;
+            char line[MAXDATASIZE];
+
+            snprintf(line, sizeof(line), "%.*s", (int) lineLen, operator.buf);
+            memmove(operator.buf, end + 1, operator.len - lineLen - 1);
+            operator.len -= lineLen + 1;
+
+            for (int i = strlen(line) - 1; i >= 0 && isspace((unsigned char) line[i]); i--) {
+                line[i] = '\0';
+            }
+            if (lineLen >= sizeof(line)) {
+                fprintf(stderr, "Operator command longer than %d bytes ignored: %.20s...\n", MAXDATASIZE - 1, line);
+            } else if (line[0] != '\0') {
+                startSweep(line);
+            }
+        }
+
+        // A line longer than the buffer can never be completed, the rest of it is skipped
+        if (!operator.discarding && operator.len == sizeof(operator.buf)) {
+            fprintf(stderr, "Operator line longer than %d bytes ignored: %.20s...\n", MAXLINE, operator.buf);
+            operator.len = 0;
+            operator.discarding = 1;
+        }
+
+        if (!operator.unwatched || sweep.active || operator.closed) {
+            break;
+        }
+        operatorRead();
+    }
+
+    if (!sweep.active && !operator.closed && !operator.unwatched) {
+        if (operator.watcher.events == 0) {
+            reactorAdd(&reactor, &operator.watcher, EPOLLIN);
+        }
+    } else {
+        reactorRemove(&reactor, &operator.watcher);
+    }
+}
+
+/** @brief Reads what the operator typed and starts the next sweep.
  *
- *  @param command buffer to save input.
+ *  @param reactor reactor.
+ *  @param watcher watcher of stdin.
+ *  @param events epoll events.
  */
-void readCommand(char* command) {
-    scanf("%s", command);
+void readOperator(struct reactor *reactor, struct watcher *watcher, uint32_t events) {
+    operatorRead();
+    nextOperatorCommand();
 }
 
-/** @brief Sends a command to a connected client.
+/** @brief Tells whether epoll can watch stdin. Regular files are always readable and epoll
+ *         refuses them, as it does /dev/null, with EPERM.
  *
- *  @param command buffer to save input.
- *  @param connfd socket identifier.
- *  @param servaddr server address.
+ *  @param reactor reactor.
+ *  @return 1 if stdin can be registered, 0 if it must be read directly.
  */
-void sendCommand(char* command, int connfd, struct sockaddr_in addr) {
-    time_t clock = time(NULL);
-    printf("%s[%s:%d] (%.24s) Command '%s' sent %s\n", KGRN, inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), ctime(&clock), command, KNRM);
-    
-    char buf[MAXDATASIZE];
+int operatorWatchable(struct reactor *reactor) {
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct stat st;
 
-    snprintf(buf, sizeof(buf), "%s", command);
-    write(connfd, buf, strlen(buf));
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == -1) {
+        return errno != EPERM;
+    }
+    epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+    return 1;
 }
 
-/** @brief Validate program arguments.
+/** @brief Sweep deadline: agents that did not answer yet are reported as timed out.
  *
- *  @param argc number of arguments.
- *  @param argv arguments.
+ *  @param reactor reactor.
+ *  @param timer sweep timer.
  */
-void assertValidArgs(int argc, char **argv) {
-    char error[MAXLINE + 1];
-
-    if (argc != 3) {
-        strcpy(error,"uso: ");
-        strcat(error,argv[0]);
-        strcat(error,"<Port> <Backlog>\n");
-        perror(error);
-        exit(1);
+void sweepTimeout(struct reactor *reactor, struct timer *timer) {
+    if (sweep.active) {
+        finishSweep();
     }
 }
 
-/** @brief Wrapper function for socket: Creates a socket.
+/** @brief Flush deadline of the output file records. The timer is armed for the oldest
+ *         pending record, so everything pending is written, including records committed
+ *         after an intermediate flush.
  *
- *  @param family address family.
- *  @param type socket type.
- *  @param flags family flags.
- *  @return new socket identifier.
+ *  @param reactor reactor.
+ *  @param timer log timer.
  */
-int Socket(int family, int type, int flags) {
-    int listenfd;
+void logTimerExpired(struct reactor *reactor, struct timer *timer) {
+    if (logger.len > 0) {
+        logFlush();
+    }
+}
 
-    if ((listenfd = socket(family, type, flags)) == -1) {
-        perror("socket");
-        exit(1);
+/** @brief Retry deadline of a listener that ran out of descriptors.
+ *
+ *  @param reactor reactor.
+ *  @param timer accept timer.
+ */
+void acceptTimerExpired(struct reactor *reactor, struct timer *timer) {
+    if (acceptPaused) {
+        reactorModify(reactor, &listener, EPOLLIN | EPOLLET);
     }
-    
-    return listenfd;
 }
 
-/** @brief Wrapper function for bind: connects a socket to an address.
+/** @brief Serves every connection from a single process with an edge-triggered epoll loop,
+ *         instead of forking a child per connection.
  *
  *  @param listenfd socket identifier.
- *  @param servaddr server address.
- *  @param size server address size.
+ *  @param commands hard-coded list of commands sent to each agent, or NULL for broadcast
+ *         mode, where each line typed on stdin is sent to every connected agent.
  */
-void Bind(int listenfd, struct sockaddr_in servaddr, int size) {
-    if (bind(listenfd, (struct sockaddr *)&servaddr, size) == -1) {
-        perror("socket");
-        exit(1);
+void runEventLoop(int listenfd, char commands[][40]) {
+    int timeout;
+
+    reactorInit(&reactor);
+    timerInit(&sweepTimer, sweepTimeout, NULL);
+    timerInit(&logTimer, logTimerExpired, NULL);
+    timerInit(&acceptTimer, acceptTimerExpired, NULL);
+    wheelInit(&wheel, &reactor, WHEEL_RESOLUTION);
+    slabInit(&connectionSlab, "connection", sizeof(struct connection));
+    slabInit(&commandSlab, "command", sizeof(struct pendingCommand));
+    poolReportOnSignal(SIGUSR1);
+    listener.fd = listenfd;
+    listener.handler = acceptConnections;
+    commandList = commands;
+
+    // Writes to closed agents must fail with EPIPE instead of killing the whole server
+    Signal(SIGPIPE, SIG_IGN);
+
+    SetNonBlocking(listenfd);
+    reactorAdd(&reactor, &listener, EPOLLIN | EPOLLET);
+
+    operator.watcher.fd = STDIN_FILENO;
+    operator.watcher.handler = readOperator;
+    if (commands == NULL) {
+        operator.unwatched = !operatorWatchable(&reactor);
+        journalOpen();
+        timerInit(&checkpointTimer, journalCheckpointExpired, NULL);
+        timerStart(&reactor, &checkpointTimer, JOURNAL_CHECKPOINTINTERVAL * 1000);
+        nextOperatorCommand();
+    }
+
+    for ( ; ; ) {
+        reactorRunOnce(&reactor);
+
+        if (commands == NULL) {
+            nextOperatorCommand();
+        }
+        if (!timerRunning(&logTimer) && (timeout = logTimeout()) >= 0) {
+            timerStart(&reactor, &logTimer, timeout);
+        }
     }
 }
 
-/** @brief Wrapper function for listen: Makes a socket passive.
+/** @brief Creates a listening socket. With SO_REUSEPORT several sockets listen on the same
+ *         port, each with its own backlog, and the kernel spreads new connections among them.
  *
- *  @param listenfd socket identifier.
+ *  @param port port to listen on.
  *  @param backlog connection buffer size.
+ *  @param reusePort whether to set SO_REUSEPORT.
+ *  @return socket identifier.
  */
-void Listen(int listenfd, int backlog) {
-    if (listen(listenfd, backlog) == -1) {
-        perror("listen");
+int openListener(int port, int backlog, int reusePort) {
+    struct sockaddr_in servaddr;
+    int listenfd = Socket(AF_INET, SOCK_STREAM, 0), on = 1;
+
+    if (reusePort && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        perror("setsockopt SO_REUSEPORT");
         exit(1);
     }
-}
 
+    bzero(&servaddr, sizeof(servaddr));
+    servaddr.sin_family      = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port        = htons(port);
 
-/** @brief Section copied from the slides, regarding SIGCHLD handling.
- */
-typedef void Sigfunc(int);
+    Bind(listenfd, servaddr, sizeof(servaddr));
+    Listen(listenfd, backlog);
+    return listenfd;
+}
 
-Sigfunc* Signal (int signo, Sigfunc *func) {
-    struct sigaction act, oact;
+/** @brief Starts a worker pinned to a CPU, with its own SO_REUSEPORT listener and event loop.
+ *
+ *  @param cpu CPU the worker runs on.
+ *  @param port port to listen on.
+ *  @param backlog connection buffer size of the worker listener.
+ *  @param commands hard-coded list of commands sent to each agent.
+ *  @return process id of the worker.
+ */
+pid_t startWorker(int cpu, int port, int backlog, char commands[][40]) {
+    pid_t parent = getpid(), pid = fork();
 
-    act.sa_handler = func;
-    
-    sigemptyset (&act.sa_mask); /* Outros sinais não são bloqueados*/
-    
-    act.sa_flags = 0;
-    
-    if (signo == SIGALRM) { /* Para reiniciar chamadas interrompidas */
-        #ifdef SA_INTERRUPT
-        act.sa_flags |= SA_INTERRUPT; /* SunOS 4.x */
-        #endif
-    } else {
-        #ifdef SA_RESTART
-        act.sa_flags |= SA_RESTART; /* SVR4, 4.4BSD */
-        #endif
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
     }
+    if (pid == 0) {
+        cpu_set_t set;
+        sigset_t signals;
+
+        // The supervisor keeps SIGCHLD blocked to wait for it, the worker must not inherit that
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGCHLD);
+        sigprocmask(SIG_UNBLOCK, &signals, NULL);
+
+        // A worker started just as the parent was killed must not keep serving on its own
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent) {
+            exit(1);
+        }
 
-    if (sigaction (signo, &act, &oact) < 0) {
-        return (SIG_ERR);
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            perror("sched_setaffinity");
+        }
+        runEventLoop(openListener(port, backlog, 1), commands);
     }
-    
-    return (oact.sa_handler);
+    return pid;
 }
 
-void sig_chld(int signo) {
-	pid_t pid;
-	int stat;
+/** @brief Serves the agents with one worker per CPU the process may run on, which under a
+ *         cpuset or taskset is not every CPU online. Each worker accepts from its own
+ *         listener, so a reconnect storm is accepted in parallel instead of queuing behind a
+ *         single accept loop. Workers that die are started again on the same CPU; the
+ *         connections waiting in the backlog of a dead worker are lost and reconnect. A
+ *         worker that dies within WORKER_MINUPTIME seconds is restarted after a growing
+ *         delay, and given up after WORKER_MAXFAILURES such deaths in a row. Each worker has
+ *         its own restart deadline, so one that keeps failing does not hold up the others.
+ *
+ *  @param port port to listen on.
+ *  @param backlog connection buffer size of each listener.
+ *  @param commands hard-coded list of commands sent to each agent.
+ */
+void runWorkers(int port, int backlog, char commands[][40]) {
+    cpu_set_t allowed;
+    sigset_t childSignal;
+    int count = 0, alive;
+    pid_t pid;
+    int status;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity");
+        exit(1);
+    }
+
+    int *cpus = calloc(CPU_COUNT(&allowed), sizeof(int));
+    pid_t *workers = calloc(CPU_COUNT(&allowed), sizeof(pid_t));
+    long long *started = calloc(CPU_COUNT(&allowed), sizeof(long long));
+    long long *restartAt = calloc(CPU_COUNT(&allowed), sizeof(long long)); /* ms, 0 if none */
+    int *failures = calloc(CPU_COUNT(&allowed), sizeof(int));
+    if (cpus == NULL || workers == NULL || started == NULL || restartAt == NULL || failures == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus[count++] = cpu;
+        }
+    }
+
+    // Fails here, before any worker starts, if the port is taken
+    close(openListener(port, backlog, 1));
 
-	while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
-		printf("child %d terminated\n", pid);
+    // Deaths are collected with sigtimedwait, which wakes up for the nearest restart too
+    sigemptyset(&childSignal);
+    sigaddset(&childSignal, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childSignal, NULL);
+
+    for (int i = 0; i < count; i++) {
+        workers[i] = startWorker(cpus[i], port, backlog, commands);
+        started[i] = monotonicMs();
     }
+    alive = count;
+    printf("%s%d workers listening on port %d%s\n", KGRN, count, port, KNRM);
+
+    for ( ; ; ) {
+        long long now = monotonicMs(), next = 0;
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < count; i++) {
+                if (workers[i] != pid) {
+                    continue;
+                }
+                workers[i] = 0;
+
+                failures[i] = now - started[i] < WORKER_MINUPTIME * 1000 ? failures[i] + 1 : 0;
+                if (failures[i] == WORKER_MAXFAILURES) {
+                    fprintf(stderr, "worker %d on CPU %d exited (status %d), giving up after %d failed starts\n", pid, cpus[i], status, failures[i]);
+                    if (--alive == 0) {
+                        exit(1);
+                    }
+                    continue;
+                }
+
+                // A worker that cannot even start would otherwise be forked again in a tight loop
+                fprintf(stderr, "worker %d on CPU %d exited (status %d), restarting in %d s\n", pid, cpus[i], status, failures[i]);
+                restartAt[i] = now + failures[i] * 1000LL;
+            }
+        }
 
-	return;
+        for (int i = 0; i < count; i++) {
+            if (restartAt[i] != 0 && restartAt[i] <= now) {
+                workers[i] = startWorker(cpus[i], port, backlog, commands);
+                started[i] = now;
+                restartAt[i] = 0;
+            } else if (restartAt[i] != 0 && (next == 0 || restartAt[i] < next)) {
+                next = restartAt[i];
+            }
+        }
+
+        if (next == 0) {
+            sigwaitinfo(&childSignal, NULL);
+        } else {
+            struct timespec timeout = { (next - now) / 1000, (next - now) % 1000 * 1000000 };
+            sigtimedwait(&childSignal, NULL, &timeout);
+        }
+    }
 }
 
 int main(int argc, char **argv) {
     int    listenfd, connfd;
-    struct sockaddr_in servaddr;
+    struct sockaddr_in servaddr, addr;
     time_t ticks;
 
     // Hard-coded list of commands to be executed
@@ -264,17 +2166,29 @@ int main(int argc, char **argv) {
     strcpy(commands[3], "EXIT\0");
 
     assertValidArgs(argc, argv);
+    bzero(&servaddr, sizeof(servaddr));
 
-    listenfd = Socket(AF_INET, SOCK_STREAM, 0);
+    if (argc == 5) {
+        pipelineDepth = atoi(argv[4]);
+    }
 
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family      = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port        = htons(strtod(argv[1], NULL));
+    // Broadcast mode stays in one process: the operator and the journal cannot be shared
+    if (argc >= 4 && strcmp(argv[3], MODE_WORKERS) == 0) {
+        logOpen(FILENAME);
+        resultsOpen();
+        runWorkers(strtod(argv[1], NULL), atoi(argv[2]), commands);
+    }
+
+    listenfd = openListener(strtod(argv[1], NULL), atoi(argv[2]), 0);
+    logOpen(FILENAME);
+    resultsOpen();
+
+    if (argc >= 4 && strcmp(argv[3], MODE_EPOLL) == 0) {
+        runEventLoop(listenfd, commands);
+    } else if (argc >= 4 && strcmp(argv[3], MODE_BROADCAST) == 0) {
+        runEventLoop(listenfd, NULL);
+    }
 
-    Bind(listenfd, servaddr, sizeof(servaddr));
-    void sig_chld(int);
-    Listen(listenfd, atoi(argv[2]));
     Signal(SIGCHLD, sig_chld);
 
     // Keep for assessment
@@ -284,12 +2198,16 @@ int main(int argc, char **argv) {
     for ( ; ; ) {
         // serverSleep(30);
 
-        if ((connfd = acceptConnection(listenfd, servaddr)) < 0) {
-            if (errno == EINTR) {
-                continue; /* se for tratar o sinal, quando voltar dá erro em funções lentas */
-            } else {
+        if ((connfd = acceptConnection(listenfd, &addr)) < 0) {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // Out of descriptors: the agents wait in the backlog while children exit
+                perror("accept error");
+                poll(NULL, 0, ACCEPT_RETRYINTERVAL);
+            } else if (errno != EINTR && errno != ECONNABORTED) {
+                /* se for tratar o sinal, quando voltar dá erro em funções lentas */
                 perror("accept error");
             }
+            continue;
         }
     
         // concurrency: related to item 3
@@ -297,7 +2215,11 @@ int main(int argc, char **argv) {
             // serverSleep(30);
             close(listenfd);
             
-            struct sockaddr_in addr = getPeerName(connfd, sizeof(servaddr));
+            struct timeval idle = { .tv_sec = IDLE_TIMEOUT };
+
+            // A stalled agent fails the blocking reads and writes instead of pinning the child
+            setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+            setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
 
             // Keep for assessment
             //pid = getpid();
@@ -321,21 +2243,22 @@ int main(int argc, char **argv) {
                 // Keep for assessment
                 // serverSleep(10);
                 
-                if (strcmp(command, EXIT_KEY_WORD) == 0) {
+                if (strcmp(command, EXIT_KEY_WORD) == 0 || storeCommandOutput(connfd, addr) < 0) {
                     ticks = time(NULL);
                     // Keep for assessment
                     // printf("%s%.24s - Connection closed \n %s", KGRN, ctime(&ticks), KNRM);
-                    FILE *fp;
-                    fp = fopen(FILENAME, "a");
-                    fprintf(fp, "[%s:%d] (%.24s) Connection closed \n",  inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), ctime(&ticks));
-                    fclose(fp);
+                    struct logRecord rec = {0};
+                    recordPrintf(&rec, "[%s:%d] (%.24s) Connection closed \n",  inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), ctime(&ticks));
+                    logCommit(&rec, rec.len);
+                    logFlush();
                     exit(0);
-                } else {
-                    storeCommandOutput(connfd, addr);
                 }
                 bzero(command, MAXDATASIZE);
             }
         }
+
+        // The child has its own copy, the parent would run out of descriptors keeping it
+        close(connfd);
     }
     return(0);
 }
\ No newline at end of file
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
@@ -11,12 +13,15 @@
 #include <unistd.h>
 #include <time.h>
 #include <ctype.h>
-
-#include "unp.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/tcp.h>
 
 #define MAXLINE 4096
 #define MAXDATASIZE 100
-#define SERVER_SETSIZE 2
+#define SERVER_SETSIZE 4096 /* most connections a single client opens */
+#define BUFSIZE 65536       /* per connection, for bytes waiting to be sent and echoes waiting to be printed */
+#define MAXPENDING 65536    /* batches of lines sent and not yet echoed, over all connections */
 #define KGRN  "\x1B[32m"
 #define KNRM  "\x1B[0m"
 #define EXIT_KEY_WORD  "EXIT"
@@ -126,121 +131,291 @@ int Read(int sockfd, void *buf, size_t count) {
 void assertValidArgs(int argc, char **argv) {
     char   error[MAXLINE + 1];
 
-    if (argc != 3) {
+    if ((argc != 3 && argc != 4) || (argc == 4 && (atoi(argv[3]) < 1 || atoi(argv[3]) > SERVER_SETSIZE))) {
         strcpy(error,"uso: ");
         strcat(error,argv[0]);
-        strcat(error," <IPaddress> <Port>");
+        strcat(error," <IPaddress> <Port> [Connections]");
         perror(error);
         exit(1);
     }
 }
 
-int main(int argc, char **argv) {
-    int i, tmp, maxi, maxfd, connfd, sockfd;
-    int nready, server[SERVER_SETSIZE] = {-1};
-    
-    ssize_t n;
-    
-    fd_set rset, allset;
-    
-    char buf[MAXLINE];
+/* Lines read from stdin are handed out round robin over the connections, in batches of up
+ * to MAXLINE bytes, and written as soon as there is room, without waiting for the previous
+ * echo. Every batch sent is queued in pending with the connection it went to, and echoes
+ * are printed in that same order, so the output matches the input no matter which
+ * connection answers first. */
+
+struct server {
+    int fd;
+    char out[BUFSIZE];
+    size_t outLen, outSent;
+    char in[BUFSIZE];
+    size_t inLen, inPrinted;
+};
+
+struct batch {
+    int server;
+    int len;
+};
+
+static struct server *servers;
+static int nservers;
+static struct batch pending[MAXPENDING];
+static unsigned pendingHead, pendingTail;
+
+/** @brief Opens a connection, prints the server hello and makes the socket non-blocking.
+ *
+ *  @param servaddr address of the server.
+ *  @return socket identifier.
+ */
+int openConnection(struct sockaddr_in *servaddr) {
     char recvline[MAXLINE + 1];
-    
-    struct sockaddr_in servaddr;
- 
-    maxfd = connfd = 0; /* initialize */
-    maxi = -1; /* index into server[] array */
-    
-    FD_ZERO(&allset);
-    FD_SET(sockfd, &allset);
-
-    for ( ; ; ) {
-        
-        rset = allset; /* structure assignment */
-        nready = select(maxfd + 1, &rset, NULL, NULL, NULL);
-        
-        if (FD_ISSET(sockfd, &rset)) { /* new server connection */
-            // START OF SERVER CONNECTION CODE
-
-            sockfd = Socket(AF_INET, SOCK_STREAM, 0);
-
-            bzero(&servaddr, sizeof(servaddr));
-            servaddr.sin_family = AF_INET;
-            servaddr.sin_port   = htons(strtod(argv[2], NULL));
-            
-            InetPton(AF_INET, argv[1], &servaddr.sin_addr);
-            Connect(sockfd, (struct sockaddr *) &servaddr, sizeof(servaddr));
-            
-            time_t clock = time(NULL);
-            printf("%s%.24s - Starting \n%s", KGRN, ctime(&clock), KNRM);
-
-            // struct sockaddr_in addr;
-            // socklen_t len = sizeof(servaddr);
-            // GetSockName(sockfd, (struct sockaddr *) &addr, &len);
-            // printf("Local IP address: %s\n", inet_ntoa(addr.sin_addr));
-            // printf("Local port      : %d\n", ntohs(addr.sin_port));
-
-            // Read Hello from server
-            Read(sockfd, recvline, MAXLINE);
-            printf("%s\n", recvline);
-
-            // END OF SERVER CONNECTION CODE
-                        
-            for (i = 0; i < SERVER_SETSIZE; i++)             
-                if (server[i] < 0) {
-                    server[i] = connfd; /* save descriptor */
-                    break;
-                }
-            
-            if (i == SERVER_SETSIZE)
-                perror("too many servers");
-            
-            FD_SET(connfd, &allset); /* add new descriptor to set */
-            
-            if (connfd > maxfd)
-                maxfd = connfd; /* for select */
-            
-            if (i > maxi)
-                maxi = i; /* max index in server[] array */
-            
-            if (--nready <= 0)
-                continue; /* no more readable descriptors */
+    int sockfd, on = 1;
+    size_t got;
+
+    sockfd = Socket(AF_INET, SOCK_STREAM, 0);
+    Connect(sockfd, (struct sockaddr *) servaddr, sizeof(*servaddr));
+
+    time_t clock = time(NULL);
+    printf("%s%.24s - Starting \n%s", KGRN, ctime(&clock), KNRM);
+
+    // Read Hello from server, always MAXLINE bytes
+    for (got = 0; got < MAXLINE; ) {
+        int n = Read(sockfd, recvline + got, MAXLINE - got);
+
+        if (n == 0) {
+            fprintf(stderr, "server closed the connection\n");
+            exit(1);
+        }
+        got += n;
+    }
+    recvline[MAXLINE] = '\0';
+    printf("%s\n", recvline);
+
+    // Lines are pipelined in small writes, Nagle would hold them back waiting for ACKs
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    return sockfd;
+}
+
+/** @brief Moves complete lines from the stdin buffer to the connections' output buffers,
+ *         up to MAXLINE bytes of whole lines per connection in turn, stopping when the
+ *         next connection has no room.
+ *
+ *  @param input bytes read from stdin.
+ *  @param inputLen number of bytes in input, updated.
+ *  @param eof whether stdin reached the end, so a last line without newline can be sent.
+ *  @param next connection the next line goes to, updated.
+ */
+void dispatchLines(char *input, size_t *inputLen, int eof, int *next) {
+    size_t used = 0;
+
+    while (used < *inputLen && pendingTail - pendingHead < MAXPENDING) {
+        struct server *server = &servers[*next];
+        size_t left = *inputLen - used;
+        size_t limit = left < MAXLINE ? left : MAXLINE;
+        char *newline = memrchr(input + used, '\n', limit);
+        size_t len;
+
+        if (eof && left <= MAXLINE) {
+            len = left;
+        } else if (newline != NULL) {
+            len = newline - (input + used) + 1;
+        } else if (limit == MAXLINE) {
+            len = limit;
+        } else {
+            break;
+        }
+
+        if (server->outSent == server->outLen) {
+            server->outLen = server->outSent = 0;
+        } else if (BUFSIZE - server->outLen < len) {
+            memmove(server->out, server->out + server->outSent, server->outLen - server->outSent);
+            server->outLen -= server->outSent;
+            server->outSent = 0;
+        }
+        if (BUFSIZE - server->outLen < len) {
+            break;
         }
 
-        for (i = 0; i <= maxi; i++) { /* check all servers for data */
-            if ((sockfd = server[i]) < 0) {
-                continue;                
+        memcpy(server->out + server->outLen, input + used, len);
+        server->outLen += len;
+        pending[pendingTail % MAXPENDING].server = *next;
+        pending[pendingTail % MAXPENDING].len = len;
+        pendingTail++;
+
+        used += len;
+        *next = (*next + 1) % nservers;
+    }
+
+    memmove(input, input + used, *inputLen - used);
+    *inputLen -= used;
+}
+
+/** @brief Prints echoes in the order their lines were read, as far as they have arrived.
+ *
+ *  @param lines number of lines printed, updated.
+ *  @return number of bytes printed.
+ */
+size_t printEchoes(size_t *lines) {
+    size_t printed = 0;
+
+    while (pendingHead != pendingTail) {
+        struct batch *batch = &pending[pendingHead % MAXPENDING];
+        struct server *server = &servers[batch->server];
+        char *echo = server->in + server->inPrinted;
+
+        if (server->inLen - server->inPrinted < (size_t) batch->len) {
+            break;
+        }
+        fwrite(echo, 1, batch->len, stdout);
+        for (char *c = echo; (c = memchr(c, '\n', echo + batch->len - c)) != NULL; c++) {
+            (*lines)++;
+        }
+        server->inPrinted += batch->len;
+        printed += batch->len;
+        pendingHead++;
+    }
+    return printed;
+}
+
+/** @brief Sends as much of the output buffer as the socket takes.
+ *
+ *  @param server connection.
+ */
+void sendPending(struct server *server) {
+    while (server->outSent < server->outLen) {
+        ssize_t n = write(server->fd, server->out + server->outSent, server->outLen - server->outSent);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
             }
+            perror("write error");
+            exit(1);
+        }
+        server->outSent += n;
+    }
+}
+
+/** @brief Reads echoes into the input buffer, making room by dropping what was printed.
+ *
+ *  @param server connection.
+ */
+void receiveEchoes(struct server *server) {
+    ssize_t n;
+
+    if (server->inPrinted > 0) {
+        memmove(server->in, server->in + server->inPrinted, server->inLen - server->inPrinted);
+        server->inLen -= server->inPrinted;
+        server->inPrinted = 0;
+    }
 
-            if (FD_ISSET(sockfd, &rset)) {
-                if ( (n = Read(sockfd, buf, MAXLINE)) == 0) {
-                    /* connection closed by server */
-                    close(sockfd);
-                    FD_CLR(sockfd, &allset);
-                    server[i] = -1;
-                } else {
-                    write(sockfd, buf, n);
-                    
-                    if (--nready <= 0)
-                        break; /* no more readable descriptors */
-                }
+    while (server->inLen < BUFSIZE) {
+        if ((n = read(server->fd, server->in + server->inLen, BUFSIZE - server->inLen)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
             }
+            perror("read error");
+            exit(1);
+        } else if (n == 0) {
+            fprintf(stderr, "server closed the connection\n");
+            exit(1);
         }
+        server->inLen += n;
     }
+}
 
-    /////////////////////////
-    
-    while(fgets(recvline, MAXDATASIZE, stdin) > 0) {
-        // Send string to server
-        write(sockfd, recvline, MAXDATASIZE);
+int main(int argc, char **argv) {
+    struct sockaddr_in servaddr;
+    struct pollfd *fds;
+    struct timespec start, end;
+    static char input[BUFSIZE];
+    size_t inputLen = 0, lines = 0, echoed = 0;
+    int i, eof = 0, next = 0;
+
+    assertValidArgs(argc, argv);
+    nservers = argc == 4 ? atoi(argv[3]) : 1;
 
-        // Receive echo from server
-        tmp = Read(sockfd, recvline, MAXLINE);
-        recvline[tmp] = '\0';
+    bzero(&servaddr, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port   = htons(strtod(argv[2], NULL));
+    InetPton(AF_INET, argv[1], &servaddr.sin_addr);
 
-        // Print echo received
-        printf("%s", recvline);
+    servers = calloc(nservers, sizeof(struct server));
+    fds = calloc(nservers + 1, sizeof(struct pollfd));
+    if (servers == NULL || fds == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (i = 0; i < nservers; i++) {
+        servers[i].fd = openConnection(&servaddr);
     }
+    fflush(stdout);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!eof || inputLen > 0 || pendingHead != pendingTail) {
+        fds[0].fd = eof || inputLen == sizeof(input) ? -1 : STDIN_FILENO;
+        fds[0].events = POLLIN;
+        for (i = 0; i < nservers; i++) {
+            fds[i + 1].fd = servers[i].fd;
+            fds[i + 1].events = 0;
+            if (servers[i].inLen - servers[i].inPrinted < BUFSIZE) {
+                fds[i + 1].events |= POLLIN;
+            }
+            if (servers[i].outSent < servers[i].outLen) {
+                fds[i + 1].events |= POLLOUT;
+            }
+        }
+
+        if (poll(fds, nservers + 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            exit(1);
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            ssize_t n = read(STDIN_FILENO, input + inputLen, sizeof(input) - inputLen);
+
+            if (n == 0) {
+                eof = 1;
+            } else if (n > 0) {
+                inputLen += n;
+            } else if (errno != EINTR) {
+                perror("read error");
+                exit(1);
+            }
+        }
+
+        for (i = 0; i < nservers; i++) {
+            if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                receiveEchoes(&servers[i]);
+            }
+        }
+        echoed += printEchoes(&lines);
+
+        dispatchLines(input, &inputLen, eof, &next);
+        for (i = 0; i < nservers; i++) {
+            sendPending(&servers[i]);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    fflush(stdout);
+    for (i = 0; i < nservers; i++) {
+        close(servers[i].fd);
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%d connections, %zu lines, %zu bytes echoed in %.3f s (%.1f MB/s)\n",
+            nservers, lines, echoed, seconds, seconds > 0 ? echoed / seconds / 1e6 : 0.0);
 
     exit(0);
-}
\ No newline at end of file
+}
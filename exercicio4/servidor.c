@@ -1,12 +1,20 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -14,6 +22,10 @@
 #include <unistd.h>
 #include <unistd.h>
 #include <signal.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+
+#include "net.h"
 
 #define LISTENQ 10
 #define N_COMMANDS 4
@@ -23,22 +35,20 @@
 #define KNRM  "\x1B[0m"
 #define EXIT_KEY_WORD  "EXIT"
 #define FILENAME "output.txt"
-
-/** @brief Wrapper function for getpeername: gets socket information.
- *
- *  @param connfd socket identifier.
- *  @param addrSize size of the returned address.
- *  @return socket address.
- */
-struct sockaddr_in getPeerName(int connfd, int addrSize) {
-    struct sockaddr_in addr;
-    socklen_t len = addrSize;
-    if (getpeername(connfd, (struct sockaddr*)&addr, &len) == -1 ) {
-        perror("getpeername");
-        exit(1);
-    }
-    return addr;
-}
+#define MODE_COPY "copy"
+#define MODE_SPLICE "splice"
+#define MODE_URING "uring"
+#define MODE_EPOLL "epoll"
+#define PIPESIZE 65536
+#define ECHO_MAXQUEUED (4 * PIPESIZE) /* echo bytes queued for a client before reading it stops */
+#define URING_ENTRIES 4096 /* submission queue size, the completion queue is 4 times larger */
+#define URING_NBUFS 4096   /* buffers in the provided ring, must be a power of two */
+#define URING_BUFSIZE 8192
+#define URING_BGID 0
+#define URING_ACCEPT 1
+#define URING_RECV 2
+#define URING_SEND 3
+#define URING_GREET 4
 
 /** @brief Reads a message of size MAXLINE from a given open socket connection and
  *         stores it in the output file.
@@ -80,34 +90,16 @@ void serverSleep(int time) {
     printf("%sFinishing sleep... \n", KNRM);    
 }
 
-/** @brief Wrapper function for accept: faccepts a client connection.
- *
- *  @param listenfd socket identifier.
- *  @param servaddr server address.
- *  @param addrlen server address size.
- *  @return new socket identifier.
- */
-int Accept(int listenfd, struct sockaddr* addr, unsigned int* addrlen) {
-    int connfd;
-    
-    if ((connfd = accept(listenfd, addr, addrlen)) == -1) {
-        perror("accept");
-        exit(1);
-    }
-
-    return connfd;
-}
-
 /** @brief Accepts a connection and saves client information to the output file.
  *
  *  @param listenfd socket identifier.
- *  @param servaddr server address.
+ *  @param addr filled with the peer address.
  *  @return new socket identifier.
  */
-int acceptConnection(int listenfd, struct sockaddr_in servaddr) {
-    socklen_t len = sizeof(servaddr);
+int acceptConnection(int listenfd, struct sockaddr_in *addr) {
+    socklen_t len = sizeof(*addr);
 
-    int connfd = Accept(listenfd, (struct sockaddr *) NULL, &len);
+    int connfd = Accept(listenfd, (struct sockaddr *) addr, &len);
 
     return connfd;
 }
@@ -129,104 +121,692 @@ void readCommand(char* command) {
 void assertValidArgs(int argc, char **argv) {
     char error[MAXLINE + 1];
 
-    if (argc != 3) {
+    if ((argc != 3 && argc != 4) || (argc == 4 && strcmp(argv[3], MODE_COPY) != 0 && strcmp(argv[3], MODE_SPLICE) != 0
+                                     && strcmp(argv[3], MODE_URING) != 0 && strcmp(argv[3], MODE_EPOLL) != 0)) {
         strcpy(error,"uso: ");
         strcat(error,argv[0]);
-        strcat(error,"<Port> <Backlog>\n");
+        strcat(error,"<Port> <Backlog> [copy|splice|uring|epoll]\n");
         perror(error);
         exit(1);
     }
 }
 
-/** @brief Wrapper function for socket: Creates a socket.
+/** @brief Echoes every byte received back to the client, copying it through userspace.
  *
- *  @param family address family.
- *  @param type socket type.
- *  @param flags family flags.
- *  @return new socket identifier.
+ *  @param connfd socket identifier.
  */
-int Socket(int family, int type, int flags) {
-    int listenfd;
+void echoCopy(int connfd) {
+    char recvline[MAXLINE + 1];
+    ssize_t n;
 
-    if ((listenfd = socket(family, type, flags)) == -1) {
-        perror("socket");
-        exit(1);
+    while ((n = read(connfd, recvline, MAXLINE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            return;
+        }
+
+        // line received from client
+        fwrite(recvline, 1, n, stdout);
+
+        // echo same bytes back to client
+        for (ssize_t sent = 0, m; sent < n; sent += m) {
+            if ((m = write(connfd, recvline + sent, n - sent)) < 0) {
+                perror("write");
+                return;
+            }
+        }
     }
-    
-    return listenfd;
 }
 
-/** @brief Wrapper function for bind: connects a socket to an address.
+/** @brief Echoes every byte received back to the client with splice, moving it socket -> pipe
+ *         -> socket so the payload never enters userspace. Falls back to echoCopy if the
+ *         kernel cannot splice this socket.
  *
- *  @param listenfd socket identifier.
- *  @param servaddr server address.
- *  @param size server address size.
+ *  @param connfd socket identifier.
+ */
+void echoSplice(int connfd) {
+    int pipefd[2];
+    ssize_t n, m;
+
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        perror("pipe");
+        echoCopy(connfd);
+        return;
+    }
+    fcntl(pipefd[1], F_SETPIPE_SZ, PIPESIZE);
+
+    for ( ; ; ) {
+        if ((n = splice(connfd, NULL, pipefd[1], NULL, PIPESIZE, SPLICE_F_MOVE)) == 0) {
+            break;
+        } else if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EINVAL) {
+                // Nothing was moved into the pipe yet, the copy loop can take over
+                close(pipefd[0]);
+                close(pipefd[1]);
+                echoCopy(connfd);
+                return;
+            }
+            perror("splice");
+            break;
+        }
+
+        while (n > 0) {
+            if ((m = splice(pipefd[0], NULL, connfd, NULL, n, SPLICE_F_MOVE)) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("splice");
+                break;
+            }
+            n -= m;
+        }
+        if (n > 0) {
+            break;
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
+
+/** @brief Logs the new connection and writes the MAXLINE hello message the client waits for.
+ *
+ *  @param hello buffer of MAXLINE bytes.
+ *  @param addr peer address.
+ */
+void formatGreeting(char *hello, const struct sockaddr_in *addr) {
+    int    n;
+
+    time_t clock = time(NULL);
+    printf("[%s:%d] (%.24s) - Command output\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), ctime(&clock));
+
+    bzero(hello, MAXLINE);
+    n = sprintf(hello, "Hello from server to client in: \n");
+    n += sprintf(hello + n, "Peer IP address: %s\n", inet_ntoa(addr->sin_addr));
+    n += sprintf(hello + n, "Peer port      : %d\n", ntohs(addr->sin_port));
+    n += sprintf(hello + n, "Time           : %.24s\n", ctime(&clock));
+}
+
+/** @brief Sends the hello message on a blocking socket.
+ *
+ *  @param connfd socket identifier.
+ *  @param addr peer address.
+ */
+void greetClient(int connfd, const struct sockaddr_in *addr) {
+    char   recvline[MAXLINE + 1];
+
+    formatGreeting(recvline, addr);
+    write(connfd, recvline, MAXLINE);
+
+    // Echoes are answered in pieces, Nagle would hold the last one back waiting for an ACK
+    int on = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+/* io_uring echo server. A single thread owns the ring: one multishot accept stays armed on
+ * the listening socket, and every connection has one multishot recv that picks its buffer
+ * from a ring of provided buffers, so idle connections hold no memory. Each received
+ * buffer is sent back as is and only returned to the ring when its send completes. */
+
+struct uring {
+    int fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned sqEntries, sqLocalTail;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *bufRing;
+    unsigned short bufTail;
+    char *buffers;
+};
+
+struct uringConnection {
+    int receiving;   /* the multishot recv is armed */
+    int sending;     /* a send of the hello or of the queue head is in flight */
+    int closing;     /* the peer closed or failed, close once nothing is in flight */
+    int starved;     /* recv stopped because the buffer ring was empty */
+    int queueHead;   /* received buffers waiting to be echoed, -1 if empty */
+    int queueTail;
+    unsigned sendOffset;
+    char *greeting;  /* hello message until it is fully sent, echoes wait behind it */
+};
+
+static struct uring ring;
+static struct uringConnection *uringConnections;
+static int maxConnections;
+static unsigned uringBufferLength[URING_NBUFS];
+static int uringBufferNext[URING_NBUFS];
+static int *starved;
+static int starvedCount;
+
+/** @brief Wrapper function for io_uring_enter: submits the queued entries and waits for
+ *         completions.
+ *
+ *  @param toSubmit number of entries to submit.
+ *  @param minComplete number of completions to wait for.
  */
-void Bind(int listenfd, struct sockaddr_in servaddr, int size) {
-    if (bind(listenfd, (struct sockaddr *)&servaddr, size) == -1) {
-        perror("socket");
+void IoUringEnter(unsigned toSubmit, unsigned minComplete) {
+    while (syscall(__NR_io_uring_enter, ring.fd, toSubmit, minComplete, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        if (errno != EINTR) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+    }
+}
+
+/** @brief Creates the ring and maps its submission and completion queues.
+ */
+void uringSetup() {
+    struct io_uring_params params;
+    size_t sqSize, cqSize;
+    char *sq, *cq;
+
+    bzero(&params, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = URING_ENTRIES * 4;
+    if ((ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) < 0 && errno == EINVAL) {
+        // Kernels older than 6.0 do not know the single issuer hints
+        params.flags = IORING_SETUP_CQSIZE;
+        ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if (ring.fd < 0) {
+        perror("io_uring_setup");
+        exit(1);
+    }
+
+    sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+    }
+
+    sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    cq = sq;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+    }
+    ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        perror("mmap");
         exit(1);
     }
+
+    ring.sqHead = (unsigned *) (sq + params.sq_off.head);
+    ring.sqTail = (unsigned *) (sq + params.sq_off.tail);
+    ring.sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring.sqArray = (unsigned *) (sq + params.sq_off.array);
+    ring.sqEntries = params.sq_entries;
+    ring.sqLocalTail = *ring.sqTail;
+    ring.cqHead = (unsigned *) (cq + params.cq_off.head);
+    ring.cqTail = (unsigned *) (cq + params.cq_off.tail);
+    ring.cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    // Entries are always placed in order, so the indirection array is the identity
+    for (unsigned i = 0; i < ring.sqEntries; i++) {
+        ring.sqArray[i] = i;
+    }
 }
 
-/** @brief Wrapper function for listen: Makes a socket passive.
+/** @brief Hands a buffer to the kernel. It becomes visible on the next uringPublishBuffers.
  *
- *  @param listenfd socket identifier.
- *  @param backlog connection buffer size.
+ *  @param bid buffer id.
+ */
+void uringProvideBuffer(int bid) {
+    struct io_uring_buf *buf = &ring.bufRing->bufs[ring.bufTail & (URING_NBUFS - 1)];
+
+    buf->addr = (unsigned long) (ring.buffers + (size_t) bid * URING_BUFSIZE);
+    buf->len = URING_BUFSIZE;
+    buf->bid = bid;
+    ring.bufTail++;
+}
+
+/** @brief Makes every buffer provided so far available to recv.
  */
-void Listen(int listenfd, int backlog) {
-    if (listen(listenfd, backlog) == -1) {
-        perror("listen");
+void uringPublishBuffers() {
+    __atomic_store_n(&ring.bufRing->tail, ring.bufTail, __ATOMIC_RELEASE);
+}
+
+/** @brief Registers the provided buffer ring recv picks its buffers from.
+ */
+void uringSetupBuffers() {
+    struct io_uring_buf_reg reg;
+
+    ring.bufRing = mmap(NULL, URING_NBUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring.buffers = mmap(NULL, (size_t) URING_NBUFS * URING_BUFSIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.bufRing == MAP_FAILED || ring.buffers == MAP_FAILED) {
+        perror("mmap");
         exit(1);
     }
+
+    bzero(&reg, sizeof(reg));
+    reg.ring_addr = (unsigned long) ring.bufRing;
+    reg.ring_entries = URING_NBUFS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register");
+        exit(1);
+    }
+
+    for (int bid = 0; bid < URING_NBUFS; bid++) {
+        uringProvideBuffer(bid);
+    }
+    uringPublishBuffers();
 }
 
+/** @brief Takes the next free submission entry, submitting the queue first if it is full.
+ *
+ *  @param op operation, stored with fd and bid in the entry user data.
+ *  @param fd file descriptor the operation works on.
+ *  @param bid buffer id, 0 if unused.
+ *  @return cleared submission entry.
+ */
+struct io_uring_sqe *uringGetSqe(int op, int fd, int bid) {
+    struct io_uring_sqe *sqe;
+    unsigned head = __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+
+    if (ring.sqLocalTail - head >= ring.sqEntries) {
+        __atomic_store_n(ring.sqTail, ring.sqLocalTail, __ATOMIC_RELEASE);
+        IoUringEnter(ring.sqLocalTail - head, 0);
+    }
 
-/** @brief Section copied from the slides, regarding SIGCHLD handling.
+    sqe = &ring.sqes[ring.sqLocalTail & *ring.sqMask];
+    ring.sqLocalTail++;
+    bzero(sqe, sizeof(*sqe));
+    sqe->user_data = ((uint64_t) op << 56) | ((uint64_t) bid << 32) | (uint32_t) fd;
+    return sqe;
+}
+
+/** @brief Submits everything queued since the last call with a single io_uring_enter and
+ *         waits for at least one completion.
  */
-typedef void Sigfunc(int);
+void uringSubmitAndWait() {
+    unsigned head = __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
 
-Sigfunc* Signal (int signo, Sigfunc *func) {
-    struct sigaction act, oact;
+    __atomic_store_n(ring.sqTail, ring.sqLocalTail, __ATOMIC_RELEASE);
+    IoUringEnter(ring.sqLocalTail - head, 1);
+}
 
-    act.sa_handler = func;
-    
-    sigemptyset (&act.sa_mask); /* Outros sinais não são bloqueados*/
-    
-    act.sa_flags = 0;
-    
-    if (signo == SIGALRM) { /* Para reiniciar chamadas interrompidas */
-        #ifdef SA_INTERRUPT
-        act.sa_flags |= SA_INTERRUPT; /* SunOS 4.x */
-        #endif
+void uringArmAccept(int listenfd) {
+    struct io_uring_sqe *sqe = uringGetSqe(URING_ACCEPT, listenfd, 0);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+void uringArmRecv(int connfd) {
+    struct io_uring_sqe *sqe = uringGetSqe(URING_RECV, connfd, 0);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connfd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    uringConnections[connfd].receiving = 1;
+}
+
+/** @brief Sends what is left of the buffer at the head of the connection queue.
+ *
+ *  @param connfd socket identifier.
+ */
+void uringSendHead(int connfd) {
+    struct uringConnection *conn = &uringConnections[connfd];
+    int bid = conn->queueHead;
+    struct io_uring_sqe *sqe = uringGetSqe(URING_SEND, connfd, bid);
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = connfd;
+    sqe->addr = (unsigned long) (ring.buffers + (size_t) bid * URING_BUFSIZE + conn->sendOffset);
+    sqe->len = uringBufferLength[bid] - conn->sendOffset;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    conn->sending = 1;
+}
+
+/** @brief Sends what is left of the hello message. Echoes queue up until it completes.
+ *
+ *  @param connfd socket identifier.
+ */
+void uringSendGreeting(int connfd) {
+    struct uringConnection *conn = &uringConnections[connfd];
+    struct io_uring_sqe *sqe = uringGetSqe(URING_GREET, connfd, 0);
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = connfd;
+    sqe->addr = (unsigned long) (conn->greeting + conn->sendOffset);
+    sqe->len = MAXLINE - conn->sendOffset;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    conn->sending = 1;
+}
+
+/** @brief Closes the connection once neither recv nor send can complete on it anymore, so
+ *         no completion is ever delivered for a descriptor number that was reused.
+ *
+ *  @param connfd socket identifier.
+ */
+void uringCloseIfIdle(int connfd) {
+    struct uringConnection *conn = &uringConnections[connfd];
+
+    if (!conn->closing || conn->receiving || conn->sending) {
+        return;
+    }
+
+    while (conn->queueHead >= 0) {
+        uringProvideBuffer(conn->queueHead);
+        conn->queueHead = uringBufferNext[conn->queueHead];
+    }
+    if (conn->starved) {
+        for (int i = 0; i < starvedCount; i++) {
+            if (starved[i] == connfd) {
+                starved[i] = starved[--starvedCount];
+                break;
+            }
+        }
+    }
+    bzero(conn, sizeof(*conn));
+    close(connfd);
+}
+
+void uringHandleAccept(int listenfd, struct io_uring_cqe *cqe) {
+    int connfd = cqe->res;
+
+    if (connfd >= maxConnections) {
+        close(connfd);
+    } else if (connfd >= 0) {
+        struct uringConnection *conn = &uringConnections[connfd];
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        size_t cap;
+        int on = 1;
+
+        bzero(conn, sizeof(*conn));
+        conn->queueHead = conn->queueTail = -1;
+
+        // Multishot accept has no address per connection, and a client that already reset
+        // makes getpeername fail: there is nobody left to greet
+        if (getpeername(connfd, (struct sockaddr *) &addr, &len) < 0) {
+            close(connfd);
+        } else {
+            conn->greeting = poolAlloc(MAXLINE, &cap);
+            formatGreeting(conn->greeting, &addr);
+            setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            uringSendGreeting(connfd);
+            uringArmRecv(connfd);
+        }
+    } else if (cqe->res != -EINTR) {
+        fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+    }
+
+    // Multishot accept stops on errors such as EMFILE and has to be armed again
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uringArmAccept(listenfd);
+    }
+}
+
+void uringHandleRecv(int connfd, struct io_uring_cqe *cqe) {
+    struct uringConnection *conn = &uringConnections[connfd];
+    int more = cqe->flags & IORING_CQE_F_MORE;
+
+    if (cqe->res > 0) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (conn->closing) {
+            uringProvideBuffer(bid);
+        } else {
+            uringBufferLength[bid] = cqe->res;
+            uringBufferNext[bid] = -1;
+            if (conn->queueHead < 0) {
+                conn->queueHead = bid;
+            } else {
+                uringBufferNext[conn->queueTail] = bid;
+            }
+            conn->queueTail = bid;
+            if (!conn->sending) {
+                uringSendHead(connfd);
+            }
+        }
+    }
+
+    if (more) {
+        return;
+    }
+    conn->receiving = 0;
+
+    if (cqe->res == -ENOBUFS) {
+        // Every buffer is waiting on a send, recv is armed again once one comes back
+        conn->starved = 1;
+        starved[starvedCount++] = connfd;
+    } else if (cqe->res > 0 && !conn->closing) {
+        uringArmRecv(connfd);
     } else {
-        #ifdef SA_RESTART
-        act.sa_flags |= SA_RESTART; /* SVR4, 4.4BSD */
-        #endif
+        conn->closing = 1;
+        uringCloseIfIdle(connfd);
     }
+}
 
-    if (sigaction (signo, &act, &oact) < 0) {
-        return (SIG_ERR);
+void uringHandleSend(int connfd, int bid, struct io_uring_cqe *cqe) {
+    struct uringConnection *conn = &uringConnections[connfd];
+
+    conn->sending = 0;
+    if (cqe->res < 0) {
+        // The peer is gone, shutting the socket down makes the armed recv complete too
+        conn->closing = 1;
+        shutdown(connfd, SHUT_RDWR);
+    } else if ((conn->sendOffset += cqe->res) < uringBufferLength[bid]) {
+        uringSendHead(connfd);
+        return;
+    }
+
+    conn->sendOffset = 0;
+    conn->queueHead = uringBufferNext[bid];
+    uringProvideBuffer(bid);
+
+    if (conn->queueHead >= 0 && !conn->closing) {
+        uringSendHead(connfd);
+    } else {
+        uringCloseIfIdle(connfd);
+    }
+}
+
+void uringHandleGreeting(int connfd, struct io_uring_cqe *cqe) {
+    struct uringConnection *conn = &uringConnections[connfd];
+
+    conn->sending = 0;
+    if (cqe->res < 0) {
+        conn->closing = 1;
+        shutdown(connfd, SHUT_RDWR);
+    } else if ((conn->sendOffset += cqe->res) < MAXLINE) {
+        uringSendGreeting(connfd);
+        return;
+    }
+
+    conn->sendOffset = 0;
+    poolFree(conn->greeting, MAXLINE);
+    conn->greeting = NULL;
+
+    if (conn->queueHead >= 0 && !conn->closing) {
+        uringSendHead(connfd);
+    } else {
+        uringCloseIfIdle(connfd);
+    }
+}
+
+/** @brief Serves every client from a single io_uring instance.
+ *
+ *  @param listenfd listening socket identifier.
+ */
+void serveUring(int listenfd) {
+    struct rlimit limit;
+
+    // One connection per descriptor, so allow as many descriptors as the hard limit does
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    maxConnections = limit.rlim_cur < (1 << 20) ? limit.rlim_cur : (1 << 20);
+    uringConnections = calloc(maxConnections, sizeof(struct uringConnection));
+    starved = calloc(maxConnections, sizeof(int));
+    if (uringConnections == NULL || starved == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    uringSetup();
+    uringSetupBuffers();
+    uringArmAccept(listenfd);
+
+    for ( ; ; ) {
+        unsigned head, tail;
+        unsigned short returned = ring.bufTail;
+
+        uringSubmitAndWait();
+
+        head = *ring.cqHead;
+        tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for ( ; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+            int op = cqe->user_data >> 56;
+            int bid = (cqe->user_data >> 32) & 0xffff;
+            int fd = (uint32_t) cqe->user_data;
+
+            if (op == URING_ACCEPT) {
+                uringHandleAccept(fd, cqe);
+            } else if (op == URING_RECV) {
+                uringHandleRecv(fd, cqe);
+            } else if (op == URING_SEND) {
+                uringHandleSend(fd, bid, cqe);
+            } else if (op == URING_GREET) {
+                uringHandleGreeting(fd, cqe);
+            }
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+
+        if (ring.bufTail != returned) {
+            uringPublishBuffers();
+            while (starvedCount > 0) {
+                int connfd = starved[--starvedCount];
+
+                uringConnections[connfd].starved = 0;
+                uringArmRecv(connfd);
+            }
+        }
+    }
+}
+
+static struct slab echoSlab;     /* connections of the epoll mode */
+
+/** @brief Echoes what a client sent since the last event, straight from the input buffer
+ *         when the socket takes it. Reading stops while ECHO_MAXQUEUED bytes are waiting to be
+ *         sent, and resumes when EPOLLOUT reports room again.
+ *
+ *  @param reactor reactor.
+ *  @param watcher watcher of the client connection.
+ *  @param events epoll events.
+ */
+void serveEcho(struct reactor *reactor, struct watcher *watcher, uint32_t events) {
+    struct netConnection *conn = watcher->data;
+    int failed = netFlush(conn) < 0;
+
+    while (!failed && !conn->eof && bufferLength(&conn->out) < ECHO_MAXQUEUED) {
+        ssize_t n = netFill(conn);
+
+        if (n < 0) {
+            failed = errno != EAGAIN && errno != EWOULDBLOCK;
+            break;
+        } else if (n > 0) {
+            struct iovec iov = { bufferData(&conn->in), bufferLength(&conn->in) };
+
+            failed = netWritev(conn, &iov, 1) < 0;
+            bufferConsume(&conn->in, iov.iov_len);
+        }
+    }
+
+    if (failed || (conn->eof && bufferLength(&conn->out) == 0)) {
+        netClose(reactor, conn);
+        slabFree(&echoSlab, conn);
     }
-    
-    return (oact.sa_handler);
 }
 
-void sig_chld(int signo) {
-	pid_t pid;
-	int stat;
+/** @brief Accepts every pending client and hands it to the reactor.
+ *
+ *  @param reactor reactor.
+ *  @param watcher watcher of the listening socket.
+ *  @param events epoll events.
+ */
+void acceptEchoClients(struct reactor *reactor, struct watcher *watcher, uint32_t events) {
+    int connfd;
+
+    for ( ; ; ) {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+
+        if ((connfd = accept4(watcher->fd, (struct sockaddr *) &addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+
+        struct netConnection *conn = slabAlloc(&echoSlab);
+        char hello[MAXLINE];
+        struct iovec iov = { hello, MAXLINE };
+        int on = 1;
 
-	while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
-		printf("child %d terminated\n", pid);
+        netInit(conn, connfd, &addr, serveEcho, conn);
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        // Whatever of the hello the socket does not take is flushed by serveEcho first
+        formatGreeting(hello, &addr);
+        if (netWritev(conn, &iov, 1) < 0) {
+            close(connfd);
+            slabFree(&echoSlab, conn);
+            continue;
+        }
+        reactorAdd(reactor, &conn->watcher, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
     }
+}
 
-	return;
+/** @brief Serves every client from a single process with the shared epoll reactor.
+ *
+ *  @param listenfd listening socket identifier.
+ */
+void serveEpoll(int listenfd) {
+    struct reactor reactor;
+    struct watcher listener = { listenfd, 0, acceptEchoClients, NULL };
+
+    // Writes to clients that left must fail with EPIPE instead of killing the whole server
+    Signal(SIGPIPE, SIG_IGN);
+
+    reactorInit(&reactor);
+    slabInit(&echoSlab, "echo connection", sizeof(struct netConnection));
+    poolReportOnSignal(SIGUSR1);
+    SetNonBlocking(listenfd);
+    reactorAdd(&reactor, &listener, EPOLLIN | EPOLLET);
+    reactorRun(&reactor);
 }
 
 int main(int argc, char **argv) {
-    int    listenfd, connfd, n;
-    struct sockaddr_in servaddr;
-    char   recvline[MAXLINE + 1];
+    int    listenfd, connfd;
+    struct sockaddr_in servaddr, addr;
 
     assertValidArgs(argc, argv);
 
@@ -238,14 +818,19 @@ int main(int argc, char **argv) {
     servaddr.sin_port        = htons(strtod(argv[1], NULL));
 
     Bind(listenfd, servaddr, sizeof(servaddr));
-    void sig_chld(int);
     Listen(listenfd, atoi(argv[2]));
+
+    if (argc == 4 && strcmp(argv[3], MODE_URING) == 0) {
+        serveUring(listenfd);
+    } else if (argc == 4 && strcmp(argv[3], MODE_EPOLL) == 0) {
+        serveEpoll(listenfd);
+    }
     Signal(SIGCHLD, sig_chld);
 
     for ( ; ; ) {
         // serverSleep(30);
 
-        if ((connfd = acceptConnection(listenfd, servaddr)) < 0) {
+        if ((connfd = acceptConnection(listenfd, &addr)) < 0) {
             if (errno == EINTR) {
                 continue; /* se for tratar o sinal, quando voltar dá erro em funções lentas */
             } else {
@@ -256,29 +841,16 @@ int main(int argc, char **argv) {
         if (fork() == 0) {
             // serverSleep(30);
             close(listenfd);
-            
-            time_t clock = time(NULL);
-            struct sockaddr_in addr = getPeerName(connfd, sizeof(servaddr));
-            printf("[%s:%d] (%.24s) - Command output\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), ctime(&clock));
-
-            n = sprintf(recvline, "Hello from server to client in: \n");
-            n += sprintf(recvline + n, "Peer IP address: %s\n", inet_ntoa(addr.sin_addr));
-            n += sprintf(recvline + n, "Peer port      : %d\n", ntohs(addr.sin_port));
-            n += sprintf(recvline + n, "Time           : %.24s\n", ctime(&clock));
-            write(connfd, recvline, MAXLINE);                
-
-            while (((n = read(connfd, recvline, MAXLINE)) > 0)) {
+            greetClient(connfd, &addr);
 
-                // line received from client
-                printf("%s", recvline);
-
-                // echo same line back to client
-                write(connfd, recvline, MAXDATASIZE);
-
-                //clean buffer for reading
-                bzero(recvline, MAXDATASIZE);
+            if (argc == 4 && strcmp(argv[3], MODE_SPLICE) == 0) {
+                echoSplice(connfd);
+            } else {
+                echoCopy(connfd);
             }
+            exit(0);
         }
+        close(connfd);
     }
     return(0);
 }
\ No newline at end of file
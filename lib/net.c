@@ -0,0 +1,688 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "net.h"
+
+// WRAPPER FUNCTIONS
+
+int Socket(int family, int type, int flags) {
+    int listenfd;
+
+    if ((listenfd = socket(family, type, flags)) == -1) {
+        perror("socket");
+        exit(1);
+    }
+
+    return listenfd;
+}
+
+void Bind(int listenfd, struct sockaddr_in servaddr, int size) {
+    if (bind(listenfd, (struct sockaddr *)&servaddr, size) == -1) {
+        perror("bind");
+        exit(1);
+    }
+}
+
+void Listen(int listenfd, int backlog) {
+    if (listen(listenfd, backlog) == -1) {
+        perror("listen");
+        exit(1);
+    }
+}
+
+int Accept(int listenfd, struct sockaddr* addr, unsigned int* addrlen) {
+    int connfd;
+
+    if ((connfd = accept(listenfd, addr, addrlen)) == -1) {
+        perror("accept");
+        exit(1);
+    }
+
+    return connfd;
+}
+
+int Read(int sockfd, void *buf, size_t count) {
+    int n = read(sockfd, buf, count);
+
+    if (n < 0) {
+        perror("read error");
+        exit(1);
+    }
+
+    return n;
+}
+
+struct sockaddr_in GetPeerName(int connfd, int addrSize) {
+    struct sockaddr_in addr;
+    socklen_t len = addrSize;
+    if (getpeername(connfd, (struct sockaddr*)&addr, &len) == -1 ) {
+        perror("getpeername");
+        exit(1);
+    }
+    return addr;
+}
+
+void SetNonBlocking(int fd) {
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        exit(1);
+    }
+}
+
+Sigfunc* Signal (int signo, Sigfunc *func) {
+    struct sigaction act, oact;
+
+    act.sa_handler = func;
+
+    sigemptyset (&act.sa_mask); /* Outros sinais não são bloqueados*/
+
+    act.sa_flags = 0;
+
+    if (signo == SIGALRM) { /* Para reiniciar chamadas interrompidas */
+        #ifdef SA_INTERRUPT
+        act.sa_flags |= SA_INTERRUPT; /* SunOS 4.x */
+        #endif
+    } else {
+        #ifdef SA_RESTART
+        act.sa_flags |= SA_RESTART; /* SVR4, 4.4BSD */
+        #endif
+    }
+
+    if (sigaction (signo, &act, &oact) < 0) {
+        return (SIG_ERR);
+    }
+
+    return (oact.sa_handler);
+}
+
+void sig_chld(int signo) {
+    pid_t pid;
+    int stat;
+
+    while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
+        printf("child %d terminated\n", pid);
+    }
+
+    return;
+}
+
+// POOLS
+
+static struct poolClass poolClasses[POOL_CLASSES];
+static struct slab *slabs;
+static volatile sig_atomic_t poolReportPending;
+
+/** @brief Size class of a block size, POOL_CLASSES if it is larger than POOL_MAXSIZE.
+ */
+static int poolClass(size_t size) {
+    int class = 0;
+
+    while (class < POOL_CLASSES && (size_t) POOL_MINSIZE << class < size) {
+        class++;
+    }
+    return class;
+}
+
+void *poolAlloc(size_t size, size_t *cap) {
+    int class = poolClass(size);
+    void *data;
+
+    if (class == POOL_CLASSES) {
+        *cap = size;
+    } else if (poolClasses[class].free != NULL) {
+        data = poolClasses[class].free;
+        poolClasses[class].free = *(void **) data;
+        poolClasses[class].nfree--;
+        poolClasses[class].hits++;
+        *cap = (size_t) POOL_MINSIZE << class;
+        return data;
+    } else {
+        poolClasses[class].misses++;
+        *cap = (size_t) POOL_MINSIZE << class;
+    }
+
+    if ((data = malloc(*cap)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    return data;
+}
+
+void poolFree(void *data, size_t cap) {
+    int class = poolClass(cap);
+
+    if (data == NULL) {
+        return;
+    }
+    // After a burst the free lists shrink back to POOL_MAXFREE bytes per class
+    if (class == POOL_CLASSES || (poolClasses[class].nfree + 1) * cap > POOL_MAXFREE) {
+        if (class < POOL_CLASSES) {
+            poolClasses[class].drops++;
+        }
+        free(data);
+        return;
+    }
+    *(void **) data = poolClasses[class].free;
+    poolClasses[class].free = data;
+    poolClasses[class].nfree++;
+}
+
+void slabInit(struct slab *slab, const char *name, size_t size) {
+    memset(slab, 0, sizeof(*slab));
+    slab->name = name;
+    slab->size = (size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+    slab->nextSlab = slabs;
+    slabs = slab;
+}
+
+void *slabAlloc(struct slab *slab) {
+    void *object;
+
+    if (slab->free == NULL) {
+        size_t count = SLAB_CHUNKSIZE / slab->size > 0 ? SLAB_CHUNKSIZE / slab->size : 1;
+        char *chunk = malloc(count * slab->size);
+
+        if (chunk == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (size_t i = count; i > 0; i--) {
+            *(void **) (chunk + (i - 1) * slab->size) = slab->free;
+            slab->free = chunk + (i - 1) * slab->size;
+        }
+        slab->chunks++;
+    }
+
+    object = slab->free;
+    slab->free = *(void **) object;
+    slab->live++;
+    slab->allocs++;
+    memset(object, 0, slab->size);
+    return object;
+}
+
+void slabFree(struct slab *slab, void *object) {
+    *(void **) object = slab->free;
+    slab->free = object;
+    slab->live--;
+}
+
+void poolReport() {
+    fprintf(stderr, "pool class     hits   misses    drops  free  hit rate\n");
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        struct poolClass *class = &poolClasses[i];
+        unsigned long long total = class->hits + class->misses;
+
+        if (total > 0) {
+            fprintf(stderr, "%10zu %8llu %8llu %8llu %5zu  %7.2f%%\n", (size_t) POOL_MINSIZE << i,
+                class->hits, class->misses, class->drops, class->nfree, 100.0 * class->hits / total);
+        }
+    }
+    for (struct slab *slab = slabs; slab != NULL; slab = slab->nextSlab) {
+        fprintf(stderr, "slab %s: %zu bytes, %zu live, %llu allocs, %llu chunks, %.2f%% without malloc\n", slab->name, slab->size,
+            slab->live, slab->allocs, slab->chunks, slab->allocs > 0 ? 100.0 * (slab->allocs - slab->chunks) / slab->allocs : 100.0);
+    }
+}
+
+static void poolReportHandler(int signo) {
+    poolReportPending = 1;
+}
+
+void poolReportOnSignal(int signo) {
+    Signal(signo, poolReportHandler);
+}
+
+// BUFFERS
+
+void bufferFree(struct buffer *buf) {
+    poolFree(buf->data, buf->cap);
+    buf->data = NULL;
+    buf->start = buf->end = buf->cap = 0;
+}
+
+char *bufferReserve(struct buffer *buf, size_t count) {
+    if (buf->cap - buf->end >= count) {
+        return buf->data + buf->end;
+    }
+
+    // Reuse the consumed space first, grow only if that is not enough
+    if (buf->start > 0) {
+        memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+        buf->end -= buf->start;
+        buf->start = 0;
+    }
+    if (buf->cap - buf->end < count) {
+        // At least double: past POOL_MAXSIZE the pool hands out exactly what is asked for,
+        // and growing by the appended count alone would copy the buffer on every append
+        size_t cap = buf->end + count > 2 * buf->cap ? buf->end + count : 2 * buf->cap;
+        char *data = poolAlloc(cap, &cap);
+
+        if (buf->end > 0) {
+            memcpy(data, buf->data, buf->end);
+        }
+        poolFree(buf->data, buf->cap);
+        buf->data = data;
+        buf->cap = cap;
+    }
+    return buf->data + buf->end;
+}
+
+void bufferAppend(struct buffer *buf, const void *data, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    memcpy(bufferReserve(buf, count), data, count);
+    buf->end += count;
+}
+
+void bufferConsume(struct buffer *buf, size_t count) {
+    buf->start += count;
+    if (buf->start == buf->end) {
+        bufferFree(buf);
+    }
+}
+
+// REACTOR
+
+/** @brief Wrapper function for epoll_ctl: changes the descriptors watched by an epoll instance.
+ *
+ *  @param epfd epoll identifier.
+ *  @param op operation (EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL).
+ *  @param fd socket identifier.
+ *  @param event events to watch and data returned with them.
+ */
+static void EpollCtl(int epfd, int op, int fd, struct epoll_event *event) {
+    if (epoll_ctl(epfd, op, fd, event) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+long long monotonicMs() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+void reactorInit(struct reactor *reactor) {
+    if ((reactor->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    reactor->timers = NULL;
+    reactor->ntimers = 0;
+    reactor->maxTimers = 0;
+}
+
+void reactorAdd(struct reactor *reactor, struct watcher *watcher, uint32_t events) {
+    struct epoll_event event;
+
+    event.events = events;
+    event.data.ptr = watcher;
+    EpollCtl(reactor->epfd, EPOLL_CTL_ADD, watcher->fd, &event);
+    watcher->events = events;
+}
+
+void reactorModify(struct reactor *reactor, struct watcher *watcher, uint32_t events) {
+    struct epoll_event event;
+
+    event.events = events;
+    event.data.ptr = watcher;
+    EpollCtl(reactor->epfd, EPOLL_CTL_MOD, watcher->fd, &event);
+    watcher->events = events;
+}
+
+void reactorRemove(struct reactor *reactor, struct watcher *watcher) {
+    struct epoll_event event;
+
+    if (watcher->events != 0) {
+        EpollCtl(reactor->epfd, EPOLL_CTL_DEL, watcher->fd, &event);
+        watcher->events = 0;
+    }
+}
+
+/** @brief Moves the timer at index towards the root while it expires earlier than its parent.
+ */
+static void timerSiftUp(struct reactor *reactor, int index) {
+    struct timer *timer = reactor->timers[index];
+
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+
+        if (reactor->timers[parent]->deadline <= timer->deadline) {
+            break;
+        }
+        reactor->timers[index] = reactor->timers[parent];
+        reactor->timers[index]->index = index;
+        index = parent;
+    }
+    reactor->timers[index] = timer;
+    timer->index = index;
+}
+
+/** @brief Moves the timer at index towards the leaves while a child expires earlier.
+ */
+static void timerSiftDown(struct reactor *reactor, int index) {
+    struct timer *timer = reactor->timers[index];
+
+    for ( ; ; ) {
+        int child = 2 * index + 1;
+
+        if (child >= reactor->ntimers) {
+            break;
+        }
+        if (child + 1 < reactor->ntimers && reactor->timers[child + 1]->deadline < reactor->timers[child]->deadline) {
+            child++;
+        }
+        if (timer->deadline <= reactor->timers[child]->deadline) {
+            break;
+        }
+        reactor->timers[index] = reactor->timers[child];
+        reactor->timers[index]->index = index;
+        index = child;
+    }
+    reactor->timers[index] = timer;
+    timer->index = index;
+}
+
+void timerInit(struct timer *timer, timerHandler *handler, void *data) {
+    timer->deadline = 0;
+    timer->index = -1;
+    timer->handler = handler;
+    timer->data = data;
+}
+
+void timerCancel(struct reactor *reactor, struct timer *timer) {
+    int index = timer->index;
+
+    if (index < 0) {
+        return;
+    }
+    timer->index = -1;
+
+    // The last timer fills the hole and moves to wherever its deadline belongs
+    if (--reactor->ntimers > index) {
+        struct timer *moved = reactor->timers[reactor->ntimers];
+
+        reactor->timers[index] = moved;
+        timerSiftUp(reactor, index);
+        if (moved->index == index) {
+            timerSiftDown(reactor, index);
+        }
+    }
+}
+
+void timerStart(struct reactor *reactor, struct timer *timer, long long delayMs) {
+    timerCancel(reactor, timer);
+
+    if (reactor->ntimers == reactor->maxTimers) {
+        reactor->maxTimers = reactor->maxTimers > 0 ? reactor->maxTimers * 2 : 16;
+        reactor->timers = realloc(reactor->timers, reactor->maxTimers * sizeof(struct timer *));
+        if (reactor->timers == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    timer->deadline = monotonicMs() + delayMs;
+    reactor->timers[reactor->ntimers] = timer;
+    timerSiftUp(reactor, reactor->ntimers++);
+}
+
+/** @brief Time until the earliest timer expires, to be used as the epoll_wait timeout.
+ *
+ *  @return timeout in milliseconds, -1 if no timer is running.
+ */
+static int reactorTimeout(struct reactor *reactor) {
+    if (reactor->ntimers == 0) {
+        return -1;
+    }
+
+    long long left = reactor->timers[0]->deadline - monotonicMs();
+    return left < 0 ? 0 : left > 1000000 ? 1000000 : (int) left;
+}
+
+int reactorRunOnce(struct reactor *reactor) {
+    struct epoll_event events[REACTOR_MAXEVENTS];
+    int nready;
+
+    if ((nready = epoll_wait(reactor->epfd, events, REACTOR_MAXEVENTS, reactorTimeout(reactor))) == -1) {
+        if (errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+        nready = 0;
+    }
+
+    for (int i = 0; i < nready; i++) {
+        struct watcher *watcher = events[i].data.ptr;
+
+        watcher->handler(reactor, watcher, events[i].events);
+    }
+
+    if (poolReportPending) {
+        poolReportPending = 0;
+        poolReport();
+    }
+
+    long long now = monotonicMs();
+    while (reactor->ntimers > 0 && reactor->timers[0]->deadline <= now) {
+        struct timer *timer = reactor->timers[0];
+
+        timerCancel(reactor, timer);
+        timer->handler(reactor, timer);
+    }
+
+    return nready;
+}
+
+void reactorRun(struct reactor *reactor) {
+    for ( ; ; ) {
+        reactorRunOnce(reactor);
+    }
+}
+
+// TIMER WHEELS
+
+/** @brief Links a timer at the head of a slot.
+ */
+static void wheelLink(struct timerWheel *wheel, struct wheelTimer *timer, int slot) {
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = wheel->slots[slot];
+    if (timer->next != NULL) {
+        timer->next->prev = timer;
+    }
+    wheel->slots[slot] = timer;
+    wheel->count++;
+}
+
+/** @brief Reactor handler of a wheel: expires every tick up to now, then waits for the next
+ *         one if timers are left.
+ *
+ *  @param reactor reactor.
+ *  @param timer reactor timer of the wheel.
+ */
+static void wheelExpire(struct reactor *reactor, struct timer *timer) {
+    struct timerWheel *wheel = timer->data;
+    long long now = monotonicMs() / wheel->resolution;
+
+    while (wheel->tick < now && wheel->count > 0) {
+        struct wheelTimer *expiring;
+        int slot = ++wheel->tick % WHEEL_SLOTS;
+
+        // The slot is moved aside, so handlers may start timers in it for the next round
+        for (expiring = wheel->slots[slot]; expiring != NULL; expiring = expiring->next) {
+            expiring->slot = WHEEL_SLOTS;
+        }
+        wheel->slots[WHEEL_SLOTS] = wheel->slots[slot];
+        wheel->slots[slot] = NULL;
+
+        while ((expiring = wheel->slots[WHEEL_SLOTS]) != NULL) {
+            wheelCancel(wheel, expiring);
+            if (expiring->deadline / wheel->resolution > wheel->tick) {
+                wheelLink(wheel, expiring, slot);
+            } else {
+                expiring->handler(wheel, expiring);
+            }
+        }
+    }
+
+    if (wheel->count > 0) {
+        timerStart(reactor, timer, (wheel->tick + 1) * wheel->resolution - monotonicMs());
+    } else {
+        wheel->tick = now;
+    }
+}
+
+void wheelInit(struct timerWheel *wheel, struct reactor *reactor, long long resolution) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->reactor = reactor;
+    wheel->resolution = resolution;
+    wheel->tick = monotonicMs() / resolution;
+    timerInit(&wheel->timer, wheelExpire, wheel);
+}
+
+void wheelTimerInit(struct wheelTimer *timer, wheelHandler *handler, void *data) {
+    timer->deadline = 0;
+    timer->slot = -1;
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->handler = handler;
+    timer->data = data;
+}
+
+void wheelCancel(struct timerWheel *wheel, struct wheelTimer *timer) {
+    if (timer->slot < 0) {
+        return;
+    }
+
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        wheel->slots[timer->slot] = timer->next;
+    }
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+    timer->slot = -1;
+    wheel->count--;
+}
+
+void wheelStart(struct timerWheel *wheel, struct wheelTimer *timer, long long delayMs) {
+    long long now = monotonicMs();
+    long long tick;
+
+    wheelCancel(wheel, timer);
+    if (wheel->count == 0 && !timerRunning(&wheel->timer)) {
+        wheel->tick = now / wheel->resolution;
+    }
+
+    // A deadline in a tick already expired goes to the next one
+    timer->deadline = now + (delayMs > 0 ? delayMs : 0);
+    tick = timer->deadline / wheel->resolution;
+    if (tick <= wheel->tick) {
+        tick = wheel->tick + 1;
+    }
+    wheelLink(wheel, timer, tick % WHEEL_SLOTS);
+
+    if (!timerRunning(&wheel->timer)) {
+        timerStart(wheel->reactor, &wheel->timer, (wheel->tick + 1) * wheel->resolution - now);
+    }
+}
+
+// CONNECTIONS
+
+void netInit(struct netConnection *conn, int fd, const struct sockaddr_in *addr,
+             watcherHandler *handler, void *data) {
+    memset(conn, 0, sizeof(*conn));
+    SetNonBlocking(fd);
+    conn->watcher.fd = fd;
+    conn->watcher.handler = handler;
+    conn->watcher.data = data;
+    conn->addr = *addr;
+}
+
+ssize_t netFill(struct netConnection *conn) {
+    char extra[NET_EXTRAREAD];
+    struct iovec iov[2];
+    ssize_t n;
+
+    iov[0].iov_base = bufferReserve(&conn->in, NET_MINREAD);
+    iov[0].iov_len = conn->in.cap - conn->in.end;
+    iov[1].iov_base = extra;
+    iov[1].iov_len = sizeof(extra);
+
+    while ((n = readv(conn->watcher.fd, iov, 2)) < 0 && errno == EINTR) {
+    }
+
+    if (n == 0) {
+        conn->eof = 1;
+    } else if (n > 0) {
+        if ((size_t) n <= iov[0].iov_len) {
+            bufferCommit(&conn->in, n);
+        } else {
+            bufferCommit(&conn->in, iov[0].iov_len);
+            bufferAppend(&conn->in, extra, n - iov[0].iov_len);
+        }
+    }
+    return n;
+}
+
+int netWritev(struct netConnection *conn, const struct iovec *iov, int iovcnt) {
+    ssize_t n = 0;
+
+    if (bufferLength(&conn->out) == 0) {
+        while ((n = writev(conn->watcher.fd, iov, iovcnt)) < 0 && errno == EINTR) {
+        }
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            n = 0;
+        }
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        size_t done = (size_t) n < iov[i].iov_len ? (size_t) n : iov[i].iov_len;
+
+        bufferAppend(&conn->out, (char *) iov[i].iov_base + done, iov[i].iov_len - done);
+        n -= done;
+    }
+    return 0;
+}
+
+int netFlush(struct netConnection *conn) {
+    while (bufferLength(&conn->out) > 0) {
+        ssize_t n = write(conn->watcher.fd, bufferData(&conn->out), bufferLength(&conn->out));
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+        }
+        bufferConsume(&conn->out, n);
+    }
+    return 0;
+}
+
+void netClose(struct reactor *reactor, struct netConnection *conn) {
+    reactorRemove(reactor, &conn->watcher);
+    close(conn->watcher.fd);
+    bufferFree(&conn->in);
+    bufferFree(&conn->out);
+}
@@ -0,0 +1,408 @@
+/* Network library shared by the servers: error-checked wrappers, memory pools, growable
+ * buffers, non-blocking connections, timers, timer wheels and an epoll reactor. */
+#ifndef __net_h
+#define __net_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#define REACTOR_MAXEVENTS 64
+#define NET_MINREAD 4096    /* free space made in the input buffer before each read */
+#define NET_EXTRAREAD 65536 /* stack buffer a read spills into when the input buffer is full */
+#define POOL_MINSIZE 256    /* smallest block size class, the others double up to POOL_MAXSIZE */
+#define POOL_CLASSES 9
+#define POOL_MAXSIZE (POOL_MINSIZE << (POOL_CLASSES - 1))
+#define POOL_MAXFREE (4 << 20) /* bytes of free blocks kept per size class */
+#define SLAB_CHUNKSIZE 65536
+#define WHEEL_SLOTS 512     /* slots of a timer wheel, deadlines further out wrap around */
+
+// WRAPPER FUNCTIONS
+
+/** @brief Wrapper function for socket: Creates a socket.
+ *
+ *  @param family address family.
+ *  @param type socket type.
+ *  @param flags family flags.
+ *  @return new socket identifier.
+ */
+int Socket(int family, int type, int flags);
+
+/** @brief Wrapper function for bind: connects a socket to an address.
+ *
+ *  @param listenfd socket identifier.
+ *  @param servaddr server address.
+ *  @param size server address size.
+ */
+void Bind(int listenfd, struct sockaddr_in servaddr, int size);
+
+/** @brief Wrapper function for listen: Makes a socket passive.
+ *
+ *  @param listenfd socket identifier.
+ *  @param backlog connection buffer size.
+ */
+void Listen(int listenfd, int backlog);
+
+/** @brief Wrapper function for accept: accepts a client connection.
+ *
+ *  @param listenfd socket identifier.
+ *  @param addr where the client address is stored, may be NULL.
+ *  @param addrlen client address size.
+ *  @return new socket identifier.
+ */
+int Accept(int listenfd, struct sockaddr* addr, unsigned int* addrlen);
+
+/** @brief Wrapper function for read: reads information from socket.
+ *
+ *  @param sockfd socket identifier.
+ *  @param buf buffer where the information read from the socket will be written.
+ *  @param count how many bytes will be read at most.
+ *  @return size of read information.
+ */
+int Read(int sockfd, void *buf, size_t count);
+
+/** @brief Wrapper function for getpeername: gets socket information.
+ *
+ *  @param connfd socket identifier.
+ *  @param addrSize size of the returned address.
+ *  @return socket address.
+ */
+struct sockaddr_in GetPeerName(int connfd, int addrSize);
+
+/** @brief Wrapper function for fcntl: makes a socket non-blocking.
+ *
+ *  @param fd socket identifier.
+ */
+void SetNonBlocking(int fd);
+
+/** @brief Section copied from the slides, regarding SIGCHLD handling.
+ */
+typedef void Sigfunc(int);
+
+Sigfunc* Signal(int signo, Sigfunc *func);
+
+void sig_chld(int signo);
+
+// POOLS
+
+/** @brief Free blocks of one size class, linked through their first bytes.
+ */
+struct poolClass {
+    void *free;
+    size_t nfree;
+    unsigned long long hits;        /* allocations served from the free list */
+    unsigned long long misses;      /* allocations that called malloc */
+    unsigned long long drops;       /* frees beyond POOL_MAXFREE, given back to malloc */
+};
+
+/** @brief Allocates a block from the size class that fits size. Larger blocks come straight
+ *         from malloc.
+ *
+ *  @param size bytes needed.
+ *  @param cap where the size of the block is written, to be passed back to poolFree.
+ *  @return the block.
+ */
+void *poolAlloc(size_t size, size_t *cap);
+
+/** @brief Returns a block to the free list of its size class.
+ *
+ *  @param data block, may be NULL.
+ *  @param cap size of the block, as returned by poolAlloc.
+ */
+void poolFree(void *data, size_t cap);
+
+/** @brief Fixed-size objects carved from SLAB_CHUNKSIZE chunks. Freed objects go to a free
+ *         list and chunks are never returned, so a steady number of objects costs no malloc.
+ */
+struct slab {
+    const char *name;
+    size_t size;
+    void *free;
+    size_t live;
+    unsigned long long allocs;
+    unsigned long long chunks;      /* malloc calls */
+    struct slab *nextSlab;          /* every slab, for poolReport */
+};
+
+/** @brief Sets up a slab. The slab must live as long as the process.
+ *
+ *  @param slab slab.
+ *  @param name shown by poolReport.
+ *  @param size object size.
+ */
+void slabInit(struct slab *slab, const char *name, size_t size);
+
+/** @brief Allocates a zeroed object.
+ */
+void *slabAlloc(struct slab *slab);
+
+void slabFree(struct slab *slab, void *object);
+
+/** @brief Prints the hit rates of the pool size classes and the use of every slab.
+ */
+void poolReport();
+
+/** @brief Makes the reactor print poolReport after a signal, such as SIGUSR1, is received.
+ */
+void poolReportOnSignal(int signo);
+
+// BUFFERS
+
+/** @brief Growable byte buffer. Bytes are appended at end and consumed from start; the
+ *         consumed space is reused by moving the remaining bytes back only when needed. The
+ *         memory comes from the pool and goes back to it as soon as the buffer is drained,
+ *         so an idle connection holds none.
+ */
+struct buffer {
+    char *data;
+    size_t start;
+    size_t end;
+    size_t cap;
+};
+
+void bufferFree(struct buffer *buf);
+
+/** @brief Number of bytes waiting in a buffer.
+ */
+static inline size_t bufferLength(const struct buffer *buf) {
+    return buf->end - buf->start;
+}
+
+/** @brief First byte waiting in a buffer.
+ */
+static inline char *bufferData(const struct buffer *buf) {
+    return buf->data + buf->start;
+}
+
+/** @brief Makes room for at least count more bytes at the end of a buffer.
+ *
+ *  @param buf buffer.
+ *  @param count number of bytes.
+ *  @return where the bytes can be written, committed afterwards with bufferCommit.
+ */
+char *bufferReserve(struct buffer *buf, size_t count);
+
+/** @brief Marks count bytes written after bufferReserve as part of the buffer.
+ */
+static inline void bufferCommit(struct buffer *buf, size_t count) {
+    buf->end += count;
+}
+
+/** @brief Appends bytes to a buffer.
+ *
+ *  @param buf buffer.
+ *  @param data bytes to append.
+ *  @param count number of bytes.
+ */
+void bufferAppend(struct buffer *buf, const void *data, size_t count);
+
+/** @brief Drops bytes from the start of a buffer, releasing its memory if nothing is left.
+ *
+ *  @param buf buffer.
+ *  @param count number of bytes, at most bufferLength.
+ */
+void bufferConsume(struct buffer *buf, size_t count);
+
+// REACTOR
+
+struct reactor;
+struct watcher;
+struct timer;
+
+typedef void watcherHandler(struct reactor *reactor, struct watcher *watcher, uint32_t events);
+typedef void timerHandler(struct reactor *reactor, struct timer *timer);
+
+/** @brief A descriptor watched by the reactor. It is usually embedded in the state of its
+ *         owner, which data points back to.
+ */
+struct watcher {
+    int fd;
+    uint32_t events;            /* epoll events being watched, 0 if not registered */
+    watcherHandler *handler;
+    void *data;
+};
+
+/** @brief A one-shot deadline. Restart it from its handler to make it periodic.
+ */
+struct timer {
+    long long deadline;         /* monotonic milliseconds */
+    int index;                  /* position in the reactor heap, -1 if not running */
+    timerHandler *handler;
+    void *data;
+};
+
+/** @brief Epoll instance plus a binary min-heap of the running timers, so the wait timeout
+ *         is always the earliest deadline.
+ */
+struct reactor {
+    int epfd;
+    struct timer **timers;
+    int ntimers;
+    int maxTimers;
+};
+
+/** @brief Monotonic clock in milliseconds.
+ */
+long long monotonicMs();
+
+void reactorInit(struct reactor *reactor);
+
+/** @brief Starts watching a descriptor.
+ *
+ *  @param reactor reactor.
+ *  @param watcher watcher with fd, handler and data set.
+ *  @param events epoll events, EPOLLET included for edge-triggered watchers.
+ */
+void reactorAdd(struct reactor *reactor, struct watcher *watcher, uint32_t events);
+
+/** @brief Changes the events of a watched descriptor. For edge-triggered watchers this also
+ *         reports the events that are already true again.
+ */
+void reactorModify(struct reactor *reactor, struct watcher *watcher, uint32_t events);
+
+void reactorRemove(struct reactor *reactor, struct watcher *watcher);
+
+/** @brief Waits for the next events or the earliest timer and dispatches them. A handler may
+ *         remove or free its own watcher, but no other.
+ *
+ *  @param reactor reactor.
+ *  @return number of descriptor events dispatched.
+ */
+int reactorRunOnce(struct reactor *reactor);
+
+/** @brief Dispatches events forever.
+ */
+void reactorRun(struct reactor *reactor);
+
+void timerInit(struct timer *timer, timerHandler *handler, void *data);
+
+/** @brief Starts a timer, or moves its deadline if it is already running.
+ *
+ *  @param reactor reactor.
+ *  @param timer timer.
+ *  @param delayMs milliseconds from now.
+ */
+void timerStart(struct reactor *reactor, struct timer *timer, long long delayMs);
+
+void timerCancel(struct reactor *reactor, struct timer *timer);
+
+static inline int timerRunning(const struct timer *timer) {
+    return timer->index >= 0;
+}
+
+// TIMER WHEELS
+
+struct timerWheel;
+struct wheelTimer;
+
+typedef void wheelHandler(struct timerWheel *wheel, struct wheelTimer *timer);
+
+/** @brief A one-shot deadline kept in a timer wheel, for the many deadlines that are moved
+ *         far more often than they expire (idle and per-request timeouts).
+ */
+struct wheelTimer {
+    long long deadline;         /* monotonic milliseconds */
+    int slot;                   /* wheel slot holding the timer, -1 if not running */
+    struct wheelTimer *prev;
+    struct wheelTimer *next;
+    wheelHandler *handler;
+    void *data;
+};
+
+/** @brief Hashed timer wheel: each slot lists the timers expiring in one tick of resolution
+ *         milliseconds, modulo WHEEL_SLOTS ticks. Starting, moving and cancelling a timer are
+ *         O(1) list operations, and the whole wheel is a single reactor timer, running only
+ *         while the wheel has timers. Timers fire up to one tick late.
+ */
+struct timerWheel {
+    struct reactor *reactor;
+    struct timer timer;         /* next tick of the wheel */
+    long long resolution;       /* milliseconds per slot */
+    long long tick;             /* last tick expired */
+    int count;                  /* running timers */
+    struct wheelTimer *slots[WHEEL_SLOTS + 1]; /* the extra slot holds the tick being expired */
+};
+
+/** @brief Initializes an empty wheel.
+ *
+ *  @param wheel wheel.
+ *  @param reactor reactor driving the wheel.
+ *  @param resolution milliseconds per slot.
+ */
+void wheelInit(struct timerWheel *wheel, struct reactor *reactor, long long resolution);
+
+void wheelTimerInit(struct wheelTimer *timer, wheelHandler *handler, void *data);
+
+/** @brief Starts a timer, or moves its deadline if it is already running. A handler may
+ *         start, cancel or free any timer, its own included.
+ *
+ *  @param wheel wheel.
+ *  @param timer timer.
+ *  @param delayMs milliseconds from now.
+ */
+void wheelStart(struct timerWheel *wheel, struct wheelTimer *timer, long long delayMs);
+
+void wheelCancel(struct timerWheel *wheel, struct wheelTimer *timer);
+
+static inline int wheelRunning(const struct wheelTimer *timer) {
+    return timer->slot >= 0;
+}
+
+// CONNECTIONS
+
+/** @brief Non-blocking socket with its input and output buffers.
+ */
+struct netConnection {
+    struct watcher watcher;
+    struct sockaddr_in addr;
+    struct buffer in;           /* bytes read and not consumed yet */
+    struct buffer out;          /* bytes the socket did not accept yet */
+    int eof;                    /* the peer closed its side */
+};
+
+/** @brief Takes over a connected socket, making it non-blocking.
+ *
+ *  @param conn connection.
+ *  @param fd socket identifier.
+ *  @param addr peer address, as returned by accept. Asking getpeername later fails once the
+ *         peer has reset the connection.
+ *  @param handler called by the reactor with the socket events.
+ *  @param data owner of the connection.
+ */
+void netInit(struct netConnection *conn, int fd, const struct sockaddr_in *addr,
+             watcherHandler *handler, void *data);
+
+/** @brief Reads once into the input buffer with readv, spilling into a stack buffer when
+ *         it is short of space, so one call drains up to NET_EXTRAREAD bytes without growing
+ *         the buffer in advance.
+ *
+ *  @param conn connection.
+ *  @return number of bytes read, 0 if the peer closed (eof is set), -1 on error or EAGAIN.
+ */
+ssize_t netFill(struct netConnection *conn);
+
+/** @brief Sends bytes, straight from the caller memory with writev when nothing is queued
+ *         before them; what the socket does not accept is copied to the output buffer.
+ *
+ *  @param conn connection.
+ *  @param iov bytes to send.
+ *  @param iovcnt number of entries of iov.
+ *  @return 0 on success, -1 on error.
+ */
+int netWritev(struct netConnection *conn, const struct iovec *iov, int iovcnt);
+
+/** @brief Writes as much of the output buffer as the socket accepts.
+ *
+ *  @param conn connection.
+ *  @return 0 if everything was sent, 1 if bytes are still queued, -1 on error.
+ */
+int netFlush(struct netConnection *conn);
+
+/** @brief Stops watching and closes the socket, releasing both buffers.
+ */
+void netClose(struct reactor *reactor, struct netConnection *conn);
+
+#endif
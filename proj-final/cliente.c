@@ -1,7 +1,13 @@
+#define _GNU_SOURCE
+
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <netdb.h>
 #include <string.h>
@@ -11,11 +17,136 @@
 #include <unistd.h>
 #include <time.h>
 #include <ctype.h>
+#include <poll.h>
 
 #define MAXLINE 4096
 #define MAXDATASIZE 100
 #define KGRN  "\x1B[32m"
 #define KNRM  "\x1B[0m"
+#define ENDCHAT "finalizar_chat"
+#define MAXCHATS 64
+#define MAXHISTORIES (MAXCHATS + 8)
+#define ROOM_NAMESIZE 32
+#define TICK 100                    /* ms between checks of chats that are ending or receiving */
+
+#define HISTORY_DIR "history"
+#define HISTORY_SEGMENTSIZE (4 << 20)   /* bytes of a log segment before the next one is started */
+#define HISTORY_BUFSIZE 8192
+#define HISTORY_BUFENTRIES 256
+#define HISTORY_PAGE 20                 /* messages shown at most per history command */
+#define HISTORY_FLUSHINTERVAL 1000      /* ms a message may stay buffered */
+#define HISTORY_SYNCINTERVAL 5000       /* ms between fdatasyncs of what was written */
+
+#define DGRAM_HEADERSIZE 12
+#define DGRAM_CHUNK 1200            /* file bytes per datagram, under a 1280 byte path MTU */
+#define DGRAM_PACKETSIZE (DGRAM_HEADERSIZE + DGRAM_CHUNK)
+#define DGRAM_GSOSEGMENTS 48        /* datagrams per GSO send, under the 64 KB UDP limit */
+#define DGRAM_BATCH 8               /* GSO sends per sendmmsg */
+#define DGRAM_MAXPACKETS (DGRAM_BATCH * DGRAM_GSOSEGMENTS)
+#define DGRAM_RECVBATCH 64          /* datagrams per recvmmsg without GRO */
+#define DGRAM_GROSIZE 65536         /* a GRO receive holds up to 64 KB of datagrams */
+#define DGRAM_GROBATCH 8            /* GRO receives per recvmmsg */
+#define DGRAM_RCVBUF (4 << 20)
+#define DGRAM_TIMEOUT 10000         /* ms of silence that ends a file transfer */
+#define DGRAM_WINDOW 1024           /* datagrams in flight, and received out of order, at most */
+#define DGRAM_MINWINDOW 16
+#define DGRAM_INITIALWINDOW 64
+#define DGRAM_SACKBITS DGRAM_WINDOW /* datagrams after the cumulative ack an ACK reports */
+#define DGRAM_INITIALRTO 200000     /* us */
+#define DGRAM_MINRTO 10000          /* us */
+#define DGRAM_MAXRTO 2000000        /* us */
+#define DGRAM_MAXTRANSMISSIONS 16   /* the peer is given up after this many sends of a datagram */
+#define DGRAM_FLUSHTIMEOUT 2000     /* ms waited for the last datagrams of a chat to be acked */
+#define DGRAM_RESERVE 16            /* ring slots a file leaves free for text messages */
+#define DGRAM_MAXTEXT DGRAM_CHUNK   /* bytes of a text message */
+
+#define DGRAM_TEXT 1
+#define DGRAM_FILESTART 2           /* payload is the file name, offset its size */
+#define DGRAM_FILE 3                /* payload is the chunk at offset */
+#define DGRAM_FILEEND 4             /* offset is the number of chunks sent */
+#define DGRAM_ACK 5                 /* not sequenced: offset is the next seq expected, payload a
+                                       bitmap of the DGRAM_SACKBITS following it, least
+                                       significant bit first */
+
+/** @brief Datagram header: type, unused byte, payload length, sequence number and file
+ *         offset, in network byte order.
+ */
+struct datagram {
+    uint8_t type;
+    uint16_t length;
+    uint32_t seq;
+    uint32_t offset;
+    char *payload;
+};
+
+/** @brief A datagram kept until the peer acknowledges it.
+ */
+struct sentDatagram {
+    size_t size;
+    long long sentAt;           /* us, of the last transmission */
+    int transmissions;
+    int sacked;                 /* the peer has it, but not everything before it */
+};
+
+/** @brief UDP socket talking to a peer, delivering in order and without loss: datagrams are
+ *         kept in a ring until acknowledged, retransmitted on timeout or when selective
+ *         acknowledgments show a hole, and received ones are held until the gap before them
+ *         is filled. Sending is limited to a window that halves on loss and grows with acks.
+ */
+struct datagramChannel {
+    int fd;                     /* UDP socket, shared by every channel */
+    struct sockaddr_in peer;
+    int gso;                    /* the kernel segments a buffer into DGRAM_PACKETSIZE datagrams */
+    int failed;                 /* the peer stopped acknowledging */
+
+    char *sendRing;             /* DGRAM_WINDOW slots of DGRAM_PACKETSIZE, seq at seq % DGRAM_WINDOW */
+    struct sentDatagram sent[DGRAM_WINDOW];
+    uint32_t unacked;           /* oldest seq not acknowledged */
+    uint32_t nextSend;          /* oldest seq never transmitted */
+    uint32_t nextSeq;
+    uint32_t cwnd;
+    uint32_t recoverySeq;       /* the window halves once per loss episode */
+    long long srtt;             /* us, 0 before the first sample */
+    long long rttvar;
+    long long rto;
+    uint32_t retransmits;
+
+    char *recvRing;
+    size_t received[DGRAM_WINDOW];  /* size of the datagram held in each slot, 0 if none */
+    uint32_t expectedSeq;
+    int ackPending;
+    long long lastReceive;      /* us */
+
+    int file;                   /* file being received, -1 if none */
+    char fileName[MAXDATASIZE];
+    uint32_t fileChunks;
+    uint64_t fileBytes;
+
+    int sendFile;               /* file being sent, -1 if none */
+    uint32_t sendOffset;
+    uint32_t sendChunks;
+    uint32_t sendEndSeq;        /* seq of the end of the file sent last */
+    int sendPending;            /* the end of that file was not acknowledged yet */
+};
+
+/** @brief A chat with a peer, named after its port.
+ */
+struct chat {
+    int used;
+    char name[16];
+    struct datagramChannel channel;
+    int ending;                 /* ENDCHAT sent, close once acknowledged */
+    long long endDeadline;      /* us */
+    long long timer;            /* us until the next retransmission, -1 if none */
+};
+
+/** @brief Bytes read from a stream and not handled yet, split in lines.
+ */
+struct lineReader {
+    char data[MAXLINE];
+    size_t start;
+    size_t end;
+};
 
 // WRAPPER FUNCTIONS
 
@@ -91,25 +222,68 @@ void Connect(int sockfd, struct sockaddr *servaddr, int addrlen) {
     }
 }
 
-/** @brief Wrapper function for read: reads information from socket.
+// HELPER FUNCTIONS
+
+/** @brief Reads once from a stream into a line reader, without blocking if the stream was
+ *         reported readable.
  *
- *  @param sockfd socket identifier.
- *  @param buf buffer where the information read from the socket will be written.
- *  @param count how many bytes will be read at most.
- *  @return size of read information.
+ *  @param fd stream identifier.
+ *  @param reader bytes read and not handled yet.
+ *  @return number of bytes read, 0 at end of file, -1 if nothing was available.
  */
-int Read(int sockfd, void *buf, size_t count) {
-    int n = read(sockfd, buf, count);
+ssize_t fillReader(int fd, struct lineReader *reader) {
+    memmove(reader->data, reader->data + reader->start, reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
 
+    ssize_t n = read(fd, reader->data + reader->end, sizeof(reader->data) - reader->end);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return -1;
+    }
     if (n < 0) {
         perror("read error");
         exit(1);
     }
-
+    reader->end += n;
     return n;
 }
 
-// HELPER FUNCTIONS
+/** @brief Takes the next whole line out of a line reader, without the newline. A line
+ *         longer than the reader is cut in pieces of MAXLINE - 1 bytes.
+ *
+ *  @param reader bytes read and not handled yet.
+ *  @param line where the line is written, MAXLINE bytes.
+ *  @return 1 if a line was taken, 0 if no whole line arrived yet.
+ */
+int nextLine(struct lineReader *reader, char *line) {
+    char *data = reader->data + reader->start;
+    size_t length = reader->end - reader->start;
+    char *end = memchr(data, '\n', length);
+
+    if (end == NULL && length < MAXLINE - 1) {
+        return 0;
+    }
+    size_t size = end != NULL ? (size_t) (end - data) : MAXLINE - 1;
+    memcpy(line, data, size);
+    line[size] = '\0';
+    reader->start += end != NULL ? size + 1 : size;
+    return 1;
+}
+
+/** @brief Waits for the next line sent by the server, without the newline.
+ *
+ *  @param sockfd socket identifier.
+ *  @param reader lines received and not handled yet.
+ *  @param line where the line is written, MAXLINE bytes.
+ */
+void readLine(int sockfd, struct lineReader *reader, char *line) {
+    while (!nextLine(reader, line)) {
+        if (fillReader(sockfd, reader) == 0) {
+            printf("Server closed the connection\n");
+            exit(0);
+        }
+    }
+}
 
 /** @brief validates the number of parameters, suggesting the correct usage in case of error.
  *
@@ -128,126 +302,1411 @@ void assertValidArgs(int argc, char **argv) {
     }
 }
 
-/** @brief writes a message in a output file
+// DATAGRAMS
+
+/** @brief Monotonic clock in microseconds.
+ */
+long long monotonicUs() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/** @brief Whether sequence number a comes before b, across wrap-around.
+ */
+int seqBefore(uint32_t a, uint32_t b) {
+    return (int32_t) (a - b) < 0;
+}
+
+/** @brief Opens the UDP socket every chat shares, on the same port number as the server
+ *         connection, which is the port the server hands to peers. UDP GSO and GRO are
+ *         enabled where the kernel has them.
+ *
+ *  @param port port to bind.
+ *  @param gso where whether GSO is enabled is written.
+ *  @param gro where whether GRO is enabled is written.
+ *  @return socket identifier.
+ */
+int openPeerSocket(int port, int *gso, int *gro) {
+    struct sockaddr_in addr;
+    int fd = Socket(AF_INET, SOCK_DGRAM, 0), size = DGRAM_RCVBUF, on = 1;
+
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (const struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    // A burst is absorbed by the receive buffer until the event loop drains it
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    size = DGRAM_PACKETSIZE;
+    *gso = setsockopt(fd, SOL_UDP, UDP_SEGMENT, &size, sizeof(size)) == 0;
+    *gro = setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+    return fd;
+}
+
+/** @brief Sets up a channel.
  *
- *  @param message message to be write in the file.
- *  @param sender the addrs port of who sent the message.
- *  @param filename the path of the output file.
+ *  @param channel channel.
+ *  @param fd UDP socket, from openPeerSocket.
+ *  @param peer address of the peer, replaced by the source of what it receives.
+ *  @param gso whether the socket has GSO enabled.
  */
-void storeMessage(char* message, char* sender, char* filename) {
-    FILE *fp;
+void channelInit(struct datagramChannel *channel, int fd, struct sockaddr_in peer, int gso) {
+    bzero(channel, sizeof(struct datagramChannel));
+    channel->fd = fd;
+    channel->peer = peer;
+    channel->gso = gso;
+    channel->file = -1;
+    channel->sendFile = -1;
+    channel->cwnd = DGRAM_INITIALWINDOW;
+    channel->rto = DGRAM_INITIALRTO;
+    channel->lastReceive = monotonicUs();
+    if ((channel->sendRing = malloc(2 * DGRAM_WINDOW * DGRAM_PACKETSIZE)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    channel->recvRing = channel->sendRing + DGRAM_WINDOW * DGRAM_PACKETSIZE;
+}
+
+/** @brief Releases a channel. The socket is shared, so it stays open.
+ */
+void channelClose(struct datagramChannel *channel) {
+    if (channel->file >= 0) {
+        close(channel->file);
+    }
+    if (channel->sendFile >= 0) {
+        close(channel->sendFile);
+    }
+    free(channel->sendRing);
+}
+
+/** @brief Writes a datagram header followed by its payload.
+ *
+ *  @param packet where the datagram is written, DGRAM_HEADERSIZE + length bytes.
+ *  @return size of the datagram.
+ */
+size_t encodeDatagram(char *packet, uint8_t type, uint32_t seq, uint32_t offset, const void *payload, uint16_t length) {
+    uint16_t length16 = htons(length);
+    uint32_t seq32 = htonl(seq), offset32 = htonl(offset);
+
+    packet[0] = type;
+    packet[1] = 0;
+    memcpy(packet + 2, &length16, 2);
+    memcpy(packet + 4, &seq32, 4);
+    memcpy(packet + 8, &offset32, 4);
+    memcpy(packet + DGRAM_HEADERSIZE, payload, length);
+    return DGRAM_HEADERSIZE + length;
+}
+
+/** @brief Reads a datagram header.
+ *
+ *  @return 0 on success, -1 if the datagram is malformed.
+ */
+int decodeDatagram(char *packet, size_t size, struct datagram *dgram) {
+    uint16_t length16;
+    uint32_t seq32, offset32;
+
+    if (size < DGRAM_HEADERSIZE) {
+        return -1;
+    }
+    memcpy(&length16, packet + 2, 2);
+    memcpy(&seq32, packet + 4, 4);
+    memcpy(&offset32, packet + 8, 4);
+    dgram->type = packet[0];
+    dgram->length = ntohs(length16);
+    dgram->seq = ntohl(seq32);
+    dgram->offset = ntohl(offset32);
+    dgram->payload = packet + DGRAM_HEADERSIZE;
+    return dgram->length <= size - DGRAM_HEADERSIZE ? 0 : -1;
+}
+
+/** @brief Adds a datagram to the send ring. The caller makes sure the ring has room.
+ */
+void channelQueue(struct datagramChannel *channel, uint8_t type, uint32_t offset, const void *payload, uint16_t length) {
+    uint32_t seq = channel->nextSeq++;
+    struct sentDatagram *slot = &channel->sent[seq % DGRAM_WINDOW];
+
+    slot->size = encodeDatagram(channel->sendRing + (seq % DGRAM_WINDOW) * DGRAM_PACKETSIZE, type, seq, offset, payload, length);
+    slot->transmissions = 0;
+    slot->sacked = 0;
+}
+
+/** @brief Sends the queued datagrams the window allows with sendmmsg. With GSO, runs of full
+ *         datagrams that are contiguous in the ring go out as one message of up to
+ *         DGRAM_GSOSEGMENTS datagrams.
+ */
+void channelTransmit(struct datagramChannel *channel) {
+    while (channel->nextSend != channel->nextSeq && channel->nextSend - channel->unacked < channel->cwnd) {
+        struct mmsghdr msgs[DGRAM_RECVBATCH];
+        struct iovec iov[DGRAM_RECVBATCH];
+        uint32_t first[DGRAM_RECVBATCH + 1];
+        uint32_t seq = channel->nextSend;
+        unsigned int vlen = 0;
+        int maxMessages = channel->gso ? DGRAM_BATCH : DGRAM_RECVBATCH;
+
+        bzero(msgs, sizeof(msgs));
+        while (vlen < maxMessages && seq != channel->nextSeq && seq - channel->unacked < channel->cwnd) {
+            size_t size = 0;
+            int segments = 0;
+
+            first[vlen] = seq;
+            iov[vlen].iov_base = channel->sendRing + (seq % DGRAM_WINDOW) * DGRAM_PACKETSIZE;
+
+            // Only the last datagram of a GSO message may be short, and a message cannot wrap
+            do {
+                size += channel->sent[seq % DGRAM_WINDOW].size;
+                segments++;
+                seq++;
+            } while (channel->gso && segments < DGRAM_GSOSEGMENTS && seq != channel->nextSeq && seq - channel->unacked < channel->cwnd
+                && seq % DGRAM_WINDOW != 0 && channel->sent[(seq - 1) % DGRAM_WINDOW].size == DGRAM_PACKETSIZE);
+
+            iov[vlen].iov_len = size;
+            msgs[vlen].msg_hdr.msg_name = &channel->peer;
+            msgs[vlen].msg_hdr.msg_namelen = sizeof(channel->peer);
+            msgs[vlen].msg_hdr.msg_iov = &iov[vlen];
+            msgs[vlen].msg_hdr.msg_iovlen = 1;
+            vlen++;
+        }
+        first[vlen] = seq;
+
+        int n = sendmmsg(channel->fd, msgs, vlen, 0);
+        if (n < 0) {
+            // Devices without segmentation offload refuse GSO sends, fall back to one per datagram
+            if (channel->gso && (errno == EIO || errno == EINVAL)) {
+                int none = 0;
+                setsockopt(channel->fd, SOL_UDP, UDP_SEGMENT, &none, sizeof(none));
+                channel->gso = 0;
+                continue;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+                perror("sendmmsg");
+            }
+            return;
+        }
+
+        long long now = monotonicUs();
+        for ( ; channel->nextSend != first[n]; channel->nextSend++) {
+            channel->sent[channel->nextSend % DGRAM_WINDOW].sentAt = now;
+            channel->sent[channel->nextSend % DGRAM_WINDOW].transmissions = 1;
+        }
+        if ((unsigned int) n < vlen) {
+            return;
+        }
+    }
+}
+
+/** @brief Records a lost datagram, halving the window once per loss episode.
+ */
+void channelLoss(struct datagramChannel *channel, uint32_t seq) {
+    if (!seqBefore(seq, channel->recoverySeq)) {
+        channel->cwnd = channel->cwnd / 2 > DGRAM_MINWINDOW ? channel->cwnd / 2 : DGRAM_MINWINDOW;
+        channel->recoverySeq = channel->nextSend;
+    }
+}
+
+void channelRetransmit(struct datagramChannel *channel, uint32_t seq) {
+    struct sentDatagram *slot = &channel->sent[seq % DGRAM_WINDOW];
+
+    sendto(channel->fd, channel->sendRing + (seq % DGRAM_WINDOW) * DGRAM_PACKETSIZE, slot->size, 0, (const struct sockaddr *) &channel->peer, sizeof(channel->peer));
+    slot->sentAt = monotonicUs();
+    slot->transmissions++;
+    channel->retransmits++;
+}
+
+/** @brief Retransmits the datagrams whose timer expired, backing off exponentially per
+ *         datagram, and gives up the peer after DGRAM_MAXTRANSMISSIONS.
+ *
+ *  @return microseconds until the next timer expires, -1 if none is running.
+ */
+long long channelTimers(struct datagramChannel *channel) {
+    long long now = monotonicUs(), next = -1;
+
+    for (uint32_t seq = channel->unacked; seq != channel->nextSend; seq++) {
+        struct sentDatagram *slot = &channel->sent[seq % DGRAM_WINDOW];
+        long long rto = channel->rto << (slot->transmissions < 6 ? slot->transmissions - 1 : 5);
+
+        if (slot->sacked) {
+            continue;
+        }
+        if (now - slot->sentAt >= (rto < DGRAM_MAXRTO ? rto : DGRAM_MAXRTO)) {
+            if (slot->transmissions >= DGRAM_MAXTRANSMISSIONS) {
+                channel->failed = 1;
+                return -1;
+            }
+            channelLoss(channel, seq);
+            channelRetransmit(channel, seq);
+            rto <<= 1;
+        }
+        long long left = slot->sentAt + (rto < DGRAM_MAXRTO ? rto : DGRAM_MAXRTO) - now;
+        if (next < 0 || left < next) {
+            next = left > 0 ? left : 0;
+        }
+    }
+    return next;
+}
+
+/** @brief Updates the smoothed RTT and the retransmission timeout as in RFC 6298.
+ */
+void channelRttSample(struct datagramChannel *channel, long long rtt) {
+    if (channel->srtt == 0) {
+        channel->srtt = rtt;
+        channel->rttvar = rtt / 2;
+    } else {
+        long long delta = rtt > channel->srtt ? rtt - channel->srtt : channel->srtt - rtt;
+        channel->rttvar = (3 * channel->rttvar + delta) / 4;
+        channel->srtt = (7 * channel->srtt + rtt) / 8;
+    }
+    channel->rto = channel->srtt + 4 * channel->rttvar;
+    channel->rto = channel->rto < DGRAM_MINRTO ? DGRAM_MINRTO : channel->rto > DGRAM_MAXRTO ? DGRAM_MAXRTO : channel->rto;
+}
+
+/** @brief Handles an acknowledgment: frees what was cumulatively acknowledged, growing the
+ *         window by as much, marks what was selectively acknowledged and retransmits the
+ *         holes below it that have been in flight for longer than a round trip.
+ *
+ *  The RTT is sampled once per ack, from the latest datagram it newly acknowledges: the
+ *  others waited for a hole to be repaired, which says nothing about the path.
+ */
+void channelAck(struct datagramChannel *channel, struct datagram *dgram) {
+    long long now = monotonicUs(), sample = -1;
+    uint32_t ack = dgram->offset, highest = ack;
+    unsigned char *bitmap = (unsigned char *) dgram->payload;
+
+    if (seqBefore(channel->nextSend, ack) || dgram->length < DGRAM_SACKBITS / 8) {
+        return;
+    }
+
+    for ( ; seqBefore(channel->unacked, ack); channel->unacked++) {
+        struct sentDatagram *slot = &channel->sent[channel->unacked % DGRAM_WINDOW];
+
+        // Karn: a retransmitted datagram does not tell which send was acknowledged
+        if (slot->transmissions == 1 && !slot->sacked && (sample < 0 || now - slot->sentAt < sample)) {
+            sample = now - slot->sentAt;
+        }
+        if (channel->cwnd < DGRAM_WINDOW) {
+            channel->cwnd++;
+        }
+    }
+
+    for (int i = 0; i < DGRAM_SACKBITS; i++) {
+        uint32_t seq = ack + 1 + i;
+
+        struct sentDatagram *slot = &channel->sent[seq % DGRAM_WINDOW];
+
+        if ((bitmap[i / 8] >> (i % 8)) & 1 && seqBefore(seq, channel->nextSend)) {
+            if (!slot->sacked && slot->transmissions == 1 && (sample < 0 || now - slot->sentAt < sample)) {
+                sample = now - slot->sentAt;
+            }
+            slot->sacked = 1;
+            highest = seq;
+        }
+    }
+    if (sample >= 0) {
+        channelRttSample(channel, sample);
+    }
+    for (uint32_t seq = channel->unacked; seqBefore(seq, highest); seq++) {
+        struct sentDatagram *slot = &channel->sent[seq % DGRAM_WINDOW];
+
+        if (!slot->sacked && now - slot->sentAt > (channel->srtt > 0 ? channel->srtt : channel->rto)) {
+            channelLoss(channel, seq);
+            channelRetransmit(channel, seq);
+        }
+    }
+}
+
+/** @brief Acknowledges everything received in order, delivered or not, and marks what was
+ *         received after it in the window.
+ */
+void channelSendAck(struct datagramChannel *channel) {
+    unsigned char bitmap[DGRAM_SACKBITS / 8] = {};
+    char packet[DGRAM_HEADERSIZE + sizeof(bitmap)];
+    uint32_t ack = channel->expectedSeq;
+
+    while (ack - channel->expectedSeq < DGRAM_WINDOW && channel->received[ack % DGRAM_WINDOW] > 0) {
+        ack++;
+    }
+    for (uint32_t seq = ack + 1; seq - channel->expectedSeq < DGRAM_WINDOW; seq++) {
+        if (channel->received[seq % DGRAM_WINDOW] > 0) {
+            bitmap[(seq - ack - 1) / 8] |= 1 << ((seq - ack - 1) % 8);
+        }
+    }
+    size_t size = encodeDatagram(packet, DGRAM_ACK, 0, ack, bitmap, sizeof(bitmap));
+    sendto(channel->fd, packet, size, 0, (const struct sockaddr *) &channel->peer, sizeof(channel->peer));
+    channel->ackPending = 0;
+}
+
+/** @brief Handles a received datagram: acknowledgments are applied, data is kept in the
+ *         receive ring until everything before it arrived.
+ */
+void channelInput(struct datagramChannel *channel, char *packet, size_t size) {
+    struct datagram dgram;
+
+    if (decodeDatagram(packet, size, &dgram) < 0) {
+        return;
+    }
+    if (dgram.type == DGRAM_ACK) {
+        channelAck(channel, &dgram);
+        return;
+    }
+
+    // Duplicates are acknowledged again, in case the ack that freed them was lost
+    channel->ackPending = 1;
+    if (seqBefore(dgram.seq, channel->expectedSeq) || dgram.seq - channel->expectedSeq >= DGRAM_WINDOW) {
+        return;
+    }
+    if (channel->received[dgram.seq % DGRAM_WINDOW] == 0) {
+        memcpy(channel->recvRing + (dgram.seq % DGRAM_WINDOW) * DGRAM_PACKETSIZE, packet, size);
+        channel->received[dgram.seq % DGRAM_WINDOW] = size;
+    }
+}
+
+/** @brief Queues a datagram and sends what the window allows.
+ *
+ *  @return 0 on success, -1 if the send ring is full.
+ */
+int channelSend(struct datagramChannel *channel, uint8_t type, uint32_t offset, const void *payload, uint16_t length) {
+    if (channel->nextSeq - channel->unacked >= DGRAM_WINDOW) {
+        return -1;
+    }
+    channelQueue(channel, type, offset, payload, length);
+    channelTransmit(channel);
+    return 0;
+}
+
+/** @brief Starts streaming a file to the peer. The chunks are queued by channelPump as the
+ *         ring frees up.
+ *
+ *  @param channel channel.
+ *  @param path file to send.
+ *  @return 0 on success, -1 if the file cannot be read or the ring is full.
+ */
+int channelStartFile(struct datagramChannel *channel, const char *path) {
+    const char *name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (channelSend(channel, DGRAM_FILESTART, lseek(fd, 0, SEEK_END), name, strnlen(name, MAXDATASIZE - 1)) < 0) {
+        close(fd);
+        return -1;
+    }
+    lseek(fd, 0, SEEK_SET);
+    channel->sendFile = fd;
+    channel->sendOffset = 0;
+    channel->sendChunks = 0;
+    return 0;
+}
+
+/** @brief Moves the file being sent into the send ring, as far as the ring allows minus
+ *         DGRAM_RESERVE slots, so text typed meanwhile is not queued behind a whole window
+ *         of chunks. The end of the file is queued after the last chunk.
+ */
+void channelPump(struct datagramChannel *channel) {
+    char chunk[DGRAM_CHUNK];
+    ssize_t n;
+
+    while (channel->sendFile >= 0 && channel->nextSeq - channel->unacked < DGRAM_WINDOW - DGRAM_RESERVE) {
+        if ((n = read(channel->sendFile, chunk, DGRAM_CHUNK)) <= 0) {
+            if (n < 0) {
+                perror("read error");
+            }
+            close(channel->sendFile);
+            channel->sendFile = -1;
+            channelQueue(channel, DGRAM_FILEEND, channel->sendChunks, NULL, 0);
+            channel->sendEndSeq = channel->nextSeq - 1;
+            channel->sendPending = 1;
+            break;
+        }
+        channelQueue(channel, DGRAM_FILE, channel->sendOffset, chunk, n);
+        channel->sendOffset += n;
+        channel->sendChunks++;
+
+        // Chunks pile up while a full window is in flight, then go out in batches
+        if (channel->nextSeq - channel->nextSend >= DGRAM_MAXPACKETS) {
+            channelTransmit(channel);
+        }
+    }
+    channelTransmit(channel);
+}
+
+/** @brief Whether datagrams the window allows are still waiting for the socket to accept them.
+ */
+int channelBlocked(struct datagramChannel *channel) {
+    return channel->nextSend != channel->nextSeq && channel->nextSend - channel->unacked < channel->cwnd;
+}
+
+/** @brief Ends the file being received, describing it in message.
+ *
+ *  @param channel channel.
+ *  @param sent number of chunks the peer sent, 0 if the transfer stalled.
+ *  @param message where the description is written, DGRAM_MAXTEXT + 1 bytes.
+ */
+void channelFinishFile(struct datagramChannel *channel, uint32_t sent, char *message) {
+    if (channel->file >= 0) {
+        close(channel->file);
+    }
+    snprintf(message, DGRAM_MAXTEXT + 1, "sent file %.40s, %u/%u chunks, %lu bytes",
+        channel->fileName, channel->fileChunks, sent, (unsigned long) channel->fileBytes);
+    channel->file = -1;
+}
+
+/** @brief Handles a datagram delivered in order.
+ *
+ *  @param channel channel.
+ *  @param dgram the datagram.
+ *  @param message where a text message or the description of a file is written.
+ *  @return 1 if message was written, 0 otherwise.
+ */
+int channelHandle(struct datagramChannel *channel, struct datagram *dgram, char *message) {
+    if (dgram->type == DGRAM_TEXT) {
+        snprintf(message, DGRAM_MAXTEXT + 1, "%.*s", dgram->length, dgram->payload);
+        return 1;
+    } else if (dgram->type == DGRAM_FILESTART) {
+        char path[MAXDATASIZE + 16];
+
+        snprintf(channel->fileName, sizeof(channel->fileName), "%.*s", dgram->length, dgram->payload);
+        snprintf(path, sizeof(path), "received-%s", channel->fileName);
+        if (strchr(channel->fileName, '/') != NULL || (channel->file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            perror(path);
+        }
+        channel->fileChunks = 0;
+        channel->fileBytes = 0;
+    } else if (dgram->type == DGRAM_FILE && channel->file >= 0) {
+        pwrite(channel->file, dgram->payload, dgram->length, dgram->offset);
+        channel->fileChunks++;
+        channel->fileBytes += dgram->length;
+    } else if (dgram->type == DGRAM_FILEEND) {
+        channelFinishFile(channel, dgram->offset, message);
+        return 1;
+    }
+    return 0;
+}
+
+/** @brief Hands over the next text message or file of the peer that arrived in order.
+ *
+ *  @param channel channel.
+ *  @param message where the message, or the description of the file, is written,
+ *         DGRAM_MAXTEXT + 1 bytes.
+ *  @return 1 if message was written, 0 if nothing else arrived in order.
+ */
+int channelDeliver(struct datagramChannel *channel, char *message) {
+    size_t size;
+
+    while ((size = channel->received[channel->expectedSeq % DGRAM_WINDOW]) > 0) {
+        struct datagram dgram;
+        char *packet = channel->recvRing + (channel->expectedSeq % DGRAM_WINDOW) * DGRAM_PACKETSIZE;
+
+        channel->received[channel->expectedSeq % DGRAM_WINDOW] = 0;
+        channel->expectedSeq++;
+        decodeDatagram(packet, size, &dgram);
+        if (channelHandle(channel, &dgram, message)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// HISTORY
+
+/** @brief Position of a message in the history of a conversation. The index file is an
+ *         array of these, so message i is at i * sizeof(struct historyEntry) and messages
+ *         can be looked up by number in one read, or by time with a binary search.
+ */
+struct historyEntry {
+    uint32_t segment;
+    uint32_t offset;            /* in the segment */
+    uint32_t length;            /* of the line, newline included */
+    uint32_t unused;
+    int64_t time;
+};
+
+/** @brief History of a conversation: lines appended to log segments of about
+ *         HISTORY_SEGMENTSIZE bytes, plus the index. Both are written through buffers that
+ *         are flushed when full, every HISTORY_FLUSHINTERVAL ms and on close.
+ */
+struct history {
+    int used;
+    char name[ROOM_NAMESIZE];
+    int log;                    /* current segment, opened for appending */
+    int index;
+    uint32_t segment;
+    uint32_t segmentSize;       /* bytes of the current segment, buffered ones included */
+    uint32_t count;             /* messages, buffered ones included */
+    uint32_t cursor;            /* first message shown by the last page, follows the end until
+                                   the user pages back */
+    int synced;                 /* nothing was written since the last fdatasync */
+    long long lastUse;          /* us, the least recently used history is closed first */
+
+    char logBuffer[HISTORY_BUFSIZE];
+    size_t logLength;
+    struct historyEntry entries[HISTORY_BUFENTRIES];
+    int pending;
+};
+
+struct history histories[MAXHISTORIES];
+long long historyFlushed;       /* us, of the last periodic flush */
+long long historySynced;        /* us, of the last periodic fdatasync */
+
+/** @brief Writes a whole buffer, retrying short writes.
+ */
+void writeAll(int fd, const void *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("history write");
+            return;
+        }
+        data = (const char *) data + n;
+        length -= n;
+    }
+}
+
+/** @brief Path of a segment of a history, or of its index if segment is negative.
+ */
+void historyPath(struct history *history, long segment, char *path, size_t size) {
+    if (segment < 0) {
+        snprintf(path, size, "%s/%s.idx", HISTORY_DIR, history->name);
+    } else {
+        snprintf(path, size, "%s/%s.%ld.log", HISTORY_DIR, history->name, segment);
+    }
+}
+
+/** @brief Writes what a history has buffered. The log goes first, so the index never points
+ *         past the end of a segment.
+ */
+void historyFlush(struct history *history) {
+    if (history->logLength > 0) {
+        writeAll(history->log, history->logBuffer, history->logLength);
+        history->logLength = 0;
+        history->synced = 0;
+    }
+    if (history->pending > 0) {
+        writeAll(history->index, history->entries, history->pending * sizeof(struct historyEntry));
+        history->pending = 0;
+        history->synced = 0;
+    }
+}
+
+void historySync(struct history *history) {
+    historyFlush(history);
+    if (!history->synced) {
+        fdatasync(history->log);
+        fdatasync(history->index);
+        history->synced = 1;
+    }
+}
+
+void historyClose(struct history *history) {
+    if (history == NULL || !history->used) {
+        return;
+    }
+    historySync(history);
+    close(history->log);
+    close(history->index);
+    history->used = 0;
+}
+
+/** @brief Opens the current segment of a history for appending.
+ */
+void historyOpenSegment(struct history *history) {
+    char path[sizeof(history->name) + 64];
+
+    historyPath(history, history->segment, path, sizeof(path));
+    if ((history->log = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+        perror(path);
+        exit(1);
+    }
+    history->segmentSize = lseek(history->log, 0, SEEK_END);
+}
+
+/** @brief Opens the history of a conversation, creating it if needed. A record cut short by a
+ *         crash at the end of the index is dropped. When MAXHISTORIES are open, the least
+ *         recently used one is closed.
+ *
+ *  @param name conversation, a peer port or a room name.
+ *  @return the history.
+ */
+struct history *historyOpen(const char *name) {
+    struct history *history = NULL;
+    struct historyEntry last;
+    char path[ROOM_NAMESIZE + 64], file[ROOM_NAMESIZE];
+
+    // Room names become file names, they must not reach outside HISTORY_DIR
+    snprintf(file, sizeof(file), "%s", name);
+    for (char *c = file; *c != '\0'; c++) {
+        *c = *c == '/' || *c == '.' ? '_' : *c;
+    }
+
+    for (int i = 0; i < MAXHISTORIES; i++) {
+        if (histories[i].used && strcmp(histories[i].name, file) == 0) {
+            histories[i].lastUse = monotonicUs();
+            return &histories[i];
+        }
+        if (history == NULL || (history->used && (!histories[i].used || histories[i].lastUse < history->lastUse))) {
+            history = &histories[i];
+        }
+    }
+    historyClose(history);
+
+    bzero(history, sizeof(struct history));
+    history->used = 1;
+    history->synced = 1;
+    history->lastUse = monotonicUs();
+    snprintf(history->name, sizeof(history->name), "%s", file);
+
+    historyPath(history, -1, path, sizeof(path));
+    if ((history->index = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0) {
+        perror(path);
+        exit(1);
+    }
+    off_t size = lseek(history->index, 0, SEEK_END);
+    history->count = size / sizeof(struct historyEntry);
+    if (size % sizeof(struct historyEntry) != 0) {
+        ftruncate(history->index, history->count * sizeof(struct historyEntry));
+    }
+    if (history->count > 0 && pread(history->index, &last, sizeof(last), (off_t) (history->count - 1) * sizeof(last)) == sizeof(last)) {
+        history->segment = last.segment;
+    }
+    history->cursor = history->count;
+    historyOpenSegment(history);
+    return history;
+}
+
+/** @brief Appends a message to a history. Nothing is written until the buffers fill up or
+ *         the next flush, and the time is formatted once per second at most.
+ *
+ *  @param history history.
+ *  @param sender who sent the message.
+ *  @param message the message.
+ */
+void historyAppend(struct history *history, const char *sender, const char *message) {
+    static time_t formatted;
+    static char stamp[32];
+    char line[MAXLINE + 64];
     time_t clock = time(NULL);
 
-    fp = fopen(filename, "a");
-    
-    fprintf(fp, "[%.24s] %s: %s\n", ctime(&clock), sender, message);
-    fclose(fp);
-    return;
+    if (clock != formatted) {
+        snprintf(stamp, sizeof(stamp), "%.24s", ctime(&clock));
+        formatted = clock;
+    }
+    int length = snprintf(line, sizeof(line), "[%s] %s: %s\n", stamp, sender, message);
+    if (length >= (int) sizeof(line)) {
+        length = sizeof(line) - 1;
+        line[length - 1] = '\n';
+    }
+
+    if (history->segmentSize >= HISTORY_SEGMENTSIZE) {
+        historyFlush(history);
+        close(history->log);
+        history->segment++;
+        historyOpenSegment(history);
+    }
+    if (history->logLength + length > sizeof(history->logBuffer) || history->pending == HISTORY_BUFENTRIES) {
+        historyFlush(history);
+    }
+
+    memcpy(history->logBuffer + history->logLength, line, length);
+    history->logLength += length;
+    history->entries[history->pending++] = (struct historyEntry) { history->segment, history->segmentSize, length, 0, clock };
+    history->segmentSize += length;
+    history->cursor += history->cursor == history->count;
+    history->count++;
+    history->lastUse = monotonicUs();
+}
+
+/** @brief Prints count messages of a history starting at message first, reading each run of
+ *         messages that share a segment with one pread.
+ */
+void historyPrint(struct history *history, uint32_t first, uint32_t count) {
+    struct historyEntry entries[HISTORY_PAGE];
+    char path[ROOM_NAMESIZE + 64];
+
+    historyFlush(history);
+    count = count < HISTORY_PAGE ? count : HISTORY_PAGE;
+    count = first + count < history->count ? count : history->count - first;
+    ssize_t n = pread(history->index, entries, count * sizeof(struct historyEntry), (off_t) first * sizeof(struct historyEntry));
+    count = n > 0 ? n / sizeof(struct historyEntry) : 0;
+
+    for (uint32_t i = 0, j; i < count; i = j) {
+        for (j = i + 1; j < count && entries[j].segment == entries[i].segment; j++) {
+        }
+        size_t size = entries[j - 1].offset + entries[j - 1].length - entries[i].offset;
+        char *data = malloc(size);
+        int fd;
+
+        historyPath(history, entries[i].segment, path, sizeof(path));
+        if (data == NULL || (fd = open(path, O_RDONLY)) < 0) {
+            perror(path);
+            free(data);
+            return;
+        }
+        n = pread(fd, data, size, entries[i].offset);
+        fwrite(data, 1, n > 0 ? n : 0, stdout);
+        close(fd);
+        free(data);
+    }
+}
+
+/** @brief Shows the page of messages before the one shown last, going back one page per call.
+ */
+void historyPageBack(struct history *history, uint32_t count) {
+    count = count < HISTORY_PAGE ? count : HISTORY_PAGE;
+    if (history->cursor == 0) {
+        printf("Start of the history of %s\n", history->name);
+        return;
+    }
+    history->cursor = history->cursor > count ? history->cursor - count : 0;
+    historyPrint(history, history->cursor, count);
+}
+
+/** @brief Shows the messages sent since a time, found with a binary search of the index.
+ */
+void historySince(struct history *history, time_t since) {
+    struct historyEntry entry;
+    uint32_t low = 0, high = history->count;
+
+    historyFlush(history);
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+
+        if (pread(history->index, &entry, sizeof(entry), (off_t) middle * sizeof(entry)) != sizeof(entry)) {
+            break;
+        }
+        if (entry.time < since) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    history->cursor = low;
+    historyPrint(history, low, HISTORY_PAGE);
+}
+
+/** @brief Flushes the histories every HISTORY_FLUSHINTERVAL ms and syncs them to disk every
+ *         HISTORY_SYNCINTERVAL ms, so a crash loses at most that much.
+ */
+void historyTick() {
+    long long now = monotonicUs();
+    int sync = now - historySynced >= HISTORY_SYNCINTERVAL * 1000LL;
+
+    if (now - historyFlushed < HISTORY_FLUSHINTERVAL * 1000LL) {
+        return;
+    }
+    for (int i = 0; i < MAXHISTORIES; i++) {
+        if (histories[i].used && sync) {
+            historySync(&histories[i]);
+        } else if (histories[i].used) {
+            historyFlush(&histories[i]);
+        }
+    }
+    historyFlushed = now;
+    historySynced = sync ? now : historySynced;
+}
+
+/** @brief Milliseconds until historyTick has something to do, -1 if nothing waits for it.
+ */
+int historyTimeout() {
+    for (int i = 0; i < MAXHISTORIES; i++) {
+        if (histories[i].used && (histories[i].logLength > 0 || !histories[i].synced)) {
+            long long left = historyFlushed + HISTORY_FLUSHINTERVAL * 1000LL - monotonicUs();
+            return left > 0 ? (int) ((left + 999) / 1000) : 0;
+        }
+    }
+    return -1;
+}
+
+void historyCloseAll() {
+    for (int i = 0; i < MAXHISTORIES; i++) {
+        historyClose(&histories[i]);
+    }
+}
+
+// CHATS
+
+struct chat chats[MAXCHATS];
+struct chat *activeChat;            /* where typed lines go, NULL for the room */
+char room[ROOM_NAMESIZE];           /* room joined, empty if none */
+int serverfd;
+int peerfd;                         /* UDP socket of every chat */
+int peerGso;
+int peerGro;
+int requestedChats;                 /* chats asked for whose port did not arrive yet */
+
+/** @brief Ids of the other connected clients, kept up to date by the notices of the server.
+ *         The ids are chained by hash into as many buckets as slots, so a leave finds its
+ *         slot without scanning, and the last id is moved into the slot it frees.
+ */
+struct {
+    uint32_t *ids;
+    int *next;                  /* next slot in the same bucket, -1 at the end */
+    int *buckets;               /* first slot of each bucket, -1 if empty */
+    int count;
+    int max;
+} directory;
+
+/** @brief Finds the link that points to a slot in its hash chain.
+ *
+ *  @param slot slot in use.
+ *  @return the bucket or next entry holding slot.
+ */
+int *directoryLink(int slot) {
+    int *link = &directory.buckets[directory.ids[slot] & (directory.max - 1)];
+
+    while (*link != slot) {
+        link = &directory.next[*link];
+    }
+    return link;
+}
+
+void directoryAdd(uint32_t id) {
+    int slot;
+
+    if (directory.count == directory.max) {
+        directory.max = directory.max > 0 ? 2 * directory.max : 64;
+        free(directory.buckets);
+        if ((directory.ids = realloc(directory.ids, directory.max * sizeof(uint32_t))) == NULL
+            || (directory.next = realloc(directory.next, directory.max * sizeof(int))) == NULL
+            || (directory.buckets = malloc(directory.max * sizeof(int))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(directory.buckets, -1, directory.max * sizeof(int));
+        for (slot = 0; slot < directory.count; slot++) {
+            directory.next[slot] = directory.buckets[directory.ids[slot] & (directory.max - 1)];
+            directory.buckets[directory.ids[slot] & (directory.max - 1)] = slot;
+        }
+    }
+
+    slot = directory.count++;
+    directory.ids[slot] = id;
+    directory.next[slot] = directory.buckets[id & (directory.max - 1)];
+    directory.buckets[id & (directory.max - 1)] = slot;
+}
+
+void directoryRemove(uint32_t id) {
+    int *link, slot, last;
+
+    if (directory.count == 0) {
+        return;
+    }
+    for (link = &directory.buckets[id & (directory.max - 1)]; *link >= 0 && directory.ids[*link] != id; link = &directory.next[*link]);
+    if ((slot = *link) < 0) {
+        return;
+    }
+    *link = directory.next[slot];
+
+    last = --directory.count;
+    if (slot != last) {
+        *directoryLink(last) = slot;
+        directory.ids[slot] = directory.ids[last];
+        directory.next[slot] = directory.next[last];
+    }
+}
+
+/** @brief Finds the chat with the peer on a port.
+ *
+ *  @return the chat, NULL if there is none.
+ */
+struct chat *chatFind(int port) {
+    for (int i = 0; i < MAXCHATS; i++) {
+        if (chats[i].used && ntohs(chats[i].channel.peer.sin_port) == port) {
+            return &chats[i];
+        }
+    }
+    return NULL;
+}
+
+/** @brief Starts a chat with the peer on a port. Both sides learn the port of the other from
+ *         the server, so either can send first.
+ *
+ *  @return the chat, NULL if MAXCHATS are open.
+ */
+struct chat *chatOpen(int port) {
+    struct sockaddr_in addr;
+    struct chat *chat = chatFind(port);
+
+    if (chat != NULL) {
+        return chat;
+    }
+    for (int i = 0; i < MAXCHATS && chat == NULL; i++) {
+        chat = chats[i].used ? NULL : &chats[i];
+    }
+    if (chat == NULL) {
+        return NULL;
+    }
+
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    bzero(chat, sizeof(struct chat));
+    chat->used = 1;
+    chat->timer = -1;
+    snprintf(chat->name, sizeof(chat->name), "%d", port);
+    channelInit(&chat->channel, peerfd, addr, peerGso);
+    historyAppend(historyOpen(chat->name), "-", "starting chat");
+    return chat;
+}
+
+void chatClose(struct chat *chat) {
+    historyAppend(historyOpen(chat->name), "-", "finishing chat");
+    channelClose(&chat->channel);
+    chat->used = 0;
+    if (activeChat == chat) {
+        activeChat = NULL;
+    }
+}
+
+/** @brief Ends a chat: the peer is sent ENDCHAT and the chat closes once it is acknowledged,
+ *         at most DGRAM_FLUSHTIMEOUT ms later.
+ */
+void chatEnd(struct chat *chat) {
+    if (chat->ending) {
+        return;
+    }
+    if (chat->channel.sendFile >= 0) {
+        close(chat->channel.sendFile);
+        chat->channel.sendFile = -1;
+    }
+    chat->ending = 1;
+    chat->endDeadline = monotonicUs() + DGRAM_FLUSHTIMEOUT * 1000LL;
+    channelSend(&chat->channel, DGRAM_TEXT, 0, ENDCHAT, strlen(ENDCHAT));
+    historyAppend(historyOpen(chat->name), "me", ENDCHAT);
+    dprintf(serverfd, "%s\n", ENDCHAT);
+    if (activeChat == chat) {
+        activeChat = NULL;
+    }
+}
+
+/** @brief Drains one recvmmsg batch from the shared UDP socket, splitting the buffers GRO
+ *         coalesced and handing each datagram to the chat of its source port. Datagrams of
+ *         unknown peers are dropped: one whose port did not arrive yet retransmits. Each
+ *         chat that received data is acknowledged once per batch.
+ */
+void receiveDatagrams() {
+    static char packetBuffers[DGRAM_RECVBATCH * DGRAM_PACKETSIZE];
+    static char groBuffers[DGRAM_GROBATCH * DGRAM_GROSIZE];
+    char *buffers = peerGro ? groBuffers : packetBuffers;
+    int bufferSize = peerGro ? DGRAM_GROSIZE : DGRAM_PACKETSIZE;
+    int vlen = peerGro ? DGRAM_GROBATCH : DGRAM_RECVBATCH;
+    struct mmsghdr msgs[DGRAM_RECVBATCH];
+    struct iovec iov[DGRAM_RECVBATCH];
+    struct sockaddr_in from[DGRAM_RECVBATCH];
+    char control[DGRAM_RECVBATCH][CMSG_SPACE(sizeof(int))];
+
+    for (int i = 0; i < vlen; i++) {
+        iov[i].iov_base = buffers + i * bufferSize;
+        iov[i].iov_len = bufferSize;
+        bzero(&msgs[i].msg_hdr, sizeof(struct msghdr));
+        msgs[i].msg_hdr.msg_name = &from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = control[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+    }
+
+    int n = recvmmsg(peerfd, msgs, vlen, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNREFUSED) {
+            perror("recvmmsg");
+            exit(1);
+        }
+        return;
+    }
+
+    long long now = monotonicUs();
+    for (int i = 0; i < n; i++) {
+        struct chat *chat = chatFind(ntohs(from[i].sin_port));
+        size_t segment = msgs[i].msg_len;
+
+        if (chat == NULL) {
+            continue;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int size;
+                memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+                segment = size;
+            }
+        }
+
+        chat->channel.peer = from[i];
+        chat->channel.lastReceive = now;
+        for (size_t offset = 0; offset < msgs[i].msg_len && segment > 0; offset += segment) {
+            size_t size = msgs[i].msg_len - offset < segment ? msgs[i].msg_len - offset : segment;
+            channelInput(&chat->channel, (char *) iov[i].iov_base + offset, size);
+        }
+    }
+
+    for (int i = 0; i < MAXCHATS; i++) {
+        if (chats[i].used && chats[i].channel.ackPending) {
+            channelSendAck(&chats[i].channel);
+        }
+    }
+}
+
+/** @brief Moves a chat forward after any event: retransmits what timed out, queues more of
+ *         the file being sent, shows what the peer sent in order and closes the chat when it
+ *         ended or the peer stopped answering.
+ */
+void chatService(struct chat *chat) {
+    struct datagramChannel *channel = &chat->channel;
+    char message[DGRAM_MAXTEXT + 1];
+
+    chat->timer = channelTimers(channel);
+    channelPump(channel);
+    channelTransmit(channel);
+
+    while (channelDeliver(channel, message)) {
+        if (strcmp(message, ENDCHAT) == 0) {
+            printf("%s%s ended the chat%s\n", KGRN, chat->name, KNRM);
+            historyAppend(historyOpen(chat->name), chat->name, message);
+            chatClose(chat);
+            return;
+        }
+        printf("%s%s: %s%s\n", KGRN, chat->name, message, KNRM);
+        historyAppend(historyOpen(chat->name), chat->name, message);
+    }
+
+    if (channel->sendPending && seqBefore(channel->sendEndSeq, channel->unacked)) {
+        snprintf(message, sizeof(message), "sent file, %u chunks, %u retransmitted", channel->sendChunks, channel->retransmits);
+        printf("%sTo %s: %s%s\n", KGRN, chat->name, message, KNRM);
+        historyAppend(historyOpen(chat->name), "me", message);
+        channel->sendPending = 0;
+    }
+    // Only a file transfer can stall, the chat itself waits as long as the peer thinks
+    if (channel->file >= 0 && monotonicUs() - channel->lastReceive > DGRAM_TIMEOUT * 1000LL) {
+        channelFinishFile(channel, 0, message);
+        printf("%s%s: %s (stalled)%s\n", KGRN, chat->name, message, KNRM);
+        historyAppend(historyOpen(chat->name), chat->name, message);
+    }
+
+    if (chat->ending && (channel->unacked == channel->nextSeq || channel->failed || monotonicUs() >= chat->endDeadline)) {
+        chatClose(chat);
+    } else if (channel->failed) {
+        printf("%s%s stopped answering%s\n", KGRN, chat->name, KNRM);
+        dprintf(serverfd, "%s\n", ENDCHAT);
+        chatClose(chat);
+    }
+}
+
+/** @brief How long the event loop may sleep before a chat needs servicing again.
+ *
+ *  @return milliseconds, -1 if no chat has a deadline.
+ */
+int chatsTimeout() {
+    long long timeout = -1;
+
+    for (int i = 0; i < MAXCHATS; i++) {
+        long long timer = chats[i].timer;
+
+        if (!chats[i].used) {
+            continue;
+        }
+        if ((chats[i].ending || chats[i].channel.file >= 0) && (timer < 0 || timer > TICK * 1000LL)) {
+            timer = TICK * 1000LL;
+        }
+        if (timer >= 0 && (timeout < 0 || timer < timeout)) {
+            timeout = timer;
+        }
+    }
+    return timeout < 0 ? -1 : (int) ((timeout + 999) / 1000);
+}
+
+/** @brief Whether typed lines must wait, because the send ring of the current chat is full.
+ */
+int inputBlocked() {
+    return activeChat != NULL && activeChat->channel.nextSeq - activeChat->channel.unacked >= DGRAM_WINDOW;
+}
+
+int chatsOpen() {
+    int count = 0;
+
+    for (int i = 0; i < MAXCHATS; i++) {
+        count += chats[i].used;
+    }
+    return count;
+}
+
+// COMMANDS
+
+void printHelp() {
+    printf("Commands:\n"
+        "  /list            clients connected\n"
+        "  /chat <id>       start a chat with a client\n"
+        "  /to <port>       type to the chat with the peer on port\n"
+        "  /chats           chats open\n"
+        "  /send <file>     send a file to the current chat\n"
+        "  /end             end the current chat (or %s)\n"
+        "  /join <room>     join a room and type to it\n"
+        "  /leave           leave the room\n"
+        "  /room            type to the room\n"
+        "  /history [n]     previous n messages of the current chat or room\n"
+        "  /since <minutes> messages of the last minutes\n"
+        "  /quit            end every chat and exit\n"
+        "Other lines are sent to the current chat or room.\n", ENDCHAT);
+}
+
+/** @brief Prints where typed lines go.
+ */
+void printTarget() {
+    if (activeChat != NULL) {
+        printf("Typing to %s\n", activeChat->name);
+    } else if (room[0] != '\0') {
+        printf("Typing to room %s\n", room);
+    } else {
+        printf("Typing to nobody, /chat <id> or /join <room>\n");
+    }
+}
+
+/** @brief Handles a line pushed by the server.
+ *
+ *  @param line line sent by the server.
+ */
+void handleServerLine(char *line) {
+    if (line[0] == '+') {
+        directoryAdd(strtoul(line + 1, NULL, 10));
+        printf("%sClient %s connected%s\n", KGRN, line + 1, KNRM);
+    } else if (line[0] == '-') {
+        directoryRemove(strtoul(line + 1, NULL, 10));
+        printf("%sClient %s disconnected%s\n", KGRN, line + 1, KNRM);
+    } else if (line[0] == 'P') {
+        struct chat *chat = chatOpen(atoi(line + 1));
+
+        if (chat == NULL) {
+            printf("Too many chats, %s ignored\n", line + 1);
+            return;
+        }
+        printf("%sChat with %s started%s\n", KGRN, chat->name, KNRM);
+        // A chat asked for here takes the keyboard, one started by the peer only if it is free
+        if (requestedChats > 0 || (activeChat == NULL && room[0] == '\0')) {
+            requestedChats -= requestedChats > 0;
+            activeChat = chat;
+            printTarget();
+        }
+    } else if (line[0] == 'R') {
+        printf("%sJoined room %s, %s members%s\n", KGRN, room, line + 1, KNRM);
+    } else if (line[0] == 'J') {
+        printf("%sClient %s joined the room%s\n", KGRN, line + 1, KNRM);
+    } else if (line[0] == 'Q') {
+        printf("%sClient %s left the room%s\n", KGRN, line + 1, KNRM);
+    } else if (line[0] == 'M') {
+        char *text = strchr(line, ' ');
+
+        text = text != NULL ? text + 1 : "";
+        line[strcspn(line, " ")] = '\0';
+        printf("%s[%s] %s: %s%s\n", KGRN, room, line + 1, text, KNRM);
+        historyAppend(historyOpen(room), line + 1, text);
+    }
+}
+
+/** @brief Handles a line typed by the user.
+ *
+ *  @param line line typed.
+ *  @return 1 if the user asked to quit, 0 otherwise.
+ */
+int handleCommand(char *line) {
+    char *arg = strchr(line, ' ');
+
+    arg = arg != NULL ? arg + strspn(arg, " ") : "";
+    if (line[0] == '\0') {
+        return 0;
+    } else if (strcmp(line, "/help") == 0) {
+        printHelp();
+    } else if (strcmp(line, "/list") == 0) {
+        printf("Clients connected: %d\n", directory.count);
+        for (int i = 0; i < directory.count; i++) {
+            printf("%u\n", directory.ids[i]);
+        }
+    } else if (strncmp(line, "/chat ", 6) == 0) {
+        requestedChats++;
+        dprintf(serverfd, "%s\n", arg);
+    } else if (strcmp(line, "/chats") == 0) {
+        for (int i = 0; i < MAXCHATS; i++) {
+            if (chats[i].used && !chats[i].ending) {
+                printf("%s%s\n", chats[i].name, &chats[i] == activeChat ? " (current)" : "");
+            }
+        }
+    } else if (strncmp(line, "/to ", 4) == 0) {
+        struct chat *chat = chatFind(atoi(arg));
+
+        if (chat == NULL || chat->ending) {
+            printf("No chat with %s\n", arg);
+        } else {
+            activeChat = chat;
+            printTarget();
+        }
+    } else if (strncmp(line, "/send ", 6) == 0) {
+        if (activeChat == NULL) {
+            printf("Files can only be sent in a chat\n");
+        } else if (activeChat->channel.sendFile >= 0) {
+            printf("A file is already being sent to %s\n", activeChat->name);
+        } else if (channelStartFile(&activeChat->channel, arg) == 0) {
+            printf("Sending %s to %s\n", arg, activeChat->name);
+        }
+    } else if (strcmp(line, "/end") == 0 || strcmp(line, ENDCHAT) == 0) {
+        if (activeChat != NULL) {
+            chatEnd(activeChat);
+        }
+        printTarget();
+    } else if (strncmp(line, "/join ", 6) == 0) {
+        snprintf(room, sizeof(room), "%s", arg);
+        dprintf(serverfd, "J%s\n", room);
+        activeChat = NULL;
+    } else if (strcmp(line, "/leave") == 0) {
+        if (room[0] != '\0') {
+            dprintf(serverfd, "Q\n");
+            historyAppend(historyOpen(room), "-", "leaving room");
+            room[0] = '\0';
+        }
+        printTarget();
+    } else if (strcmp(line, "/room") == 0) {
+        activeChat = NULL;
+        printTarget();
+    } else if (strncmp(line, "/history", 8) == 0 || strncmp(line, "/since ", 7) == 0) {
+        const char *name = activeChat != NULL ? activeChat->name : room[0] != '\0' ? room : NULL;
+
+        if (name == NULL) {
+            printf("No chat or room selected\n");
+        } else if (line[1] == 'h') {
+            historyPageBack(historyOpen(name), arg[0] != '\0' ? atoi(arg) : HISTORY_PAGE);
+        } else {
+            historySince(historyOpen(name), time(NULL) - 60 * atol(arg));
+        }
+    } else if (strcmp(line, "/quit") == 0) {
+        return 1;
+    } else if (activeChat != NULL) {
+        size_t length = strlen(line) < DGRAM_MAXTEXT ? strlen(line) : DGRAM_MAXTEXT;
+
+        channelSend(&activeChat->channel, DGRAM_TEXT, 0, line, length);
+        historyAppend(historyOpen(activeChat->name), "me", line);
+    } else if (room[0] != '\0') {
+        dprintf(serverfd, "S%s\n", line);
+        historyAppend(historyOpen(room), "me", line);
+    } else {
+        printf("Nobody to send to, /help for the commands\n");
+    }
+    return 0;
 }
 
 int main(int argc, char **argv) {
-    int    sockfd, peerfd, n;
-    char   recvline[MAXLINE + 1];
-    struct sockaddr_in servaddr, peeraddr, myaddr;
+    char   line[MAXLINE];
+    struct lineReader input = {}, reader = {};
+    struct sockaddr_in servaddr, myaddr;
+    socklen_t len = sizeof(myaddr);
+    int    quitting = 0, inputOpen = 1;
 
     assertValidArgs(argc, argv);
-    sockfd = Socket(AF_INET, SOCK_STREAM, 0);
+    serverfd = Socket(AF_INET, SOCK_STREAM, 0);
 
     bzero(&servaddr, sizeof(servaddr));
     servaddr.sin_family = AF_INET;
     servaddr.sin_port   = htons(strtod(argv[2], NULL));
     
     InetPton(AF_INET, argv[1], &servaddr.sin_addr);
-    Connect(sockfd, (struct sockaddr *) &servaddr, sizeof(servaddr));
+    Connect(serverfd, (struct sockaddr *) &servaddr, sizeof(servaddr));
     
     time_t clock = time(NULL);
     printf("%s%.24s - Connected to server \n%s", KGRN, ctime(&clock), KNRM);
 
-    n = Read(sockfd, recvline, MAXLINE);
-    recvline[n] = '\0';
-    
-    printf("Clients connected: \n");
-    printf("%s\n", recvline);
-    bzero(recvline, MAXDATASIZE);
-
-    for (;;) {
+    // Peers are told the port of the server connection, the chats listen on the same number
+    GetSockName(serverfd, (struct sockaddr *) &myaddr, &len);
+    peerfd = openPeerSocket(ntohs(myaddr.sin_port), &peerGso, &peerGro);
 
-        printf("\nDo you want to talk to someone? \n");
-        char initiate = '\0';
-        fscanf(stdin, " %c", &initiate);
+    if (mkdir(HISTORY_DIR, 0755) < 0 && errno != EEXIST) {
+        perror(HISTORY_DIR);
+        exit(1);
+    }
+    atexit(historyCloseAll);
 
-        if (initiate == 'y') {
-            printf("Which client do you want to talk to? \n");
+    // The snapshot: our id, then the ids of everyone else
+    readLine(serverfd, &reader, line);
+    printf("You are client %s\n", line + 1);
+    readLine(serverfd, &reader, line);
 
-            char client[5];
-            fscanf(stdin,"%s", client);
-            write(sockfd, client, sizeof(client));
-        } else {
-            printf("Waiting for someone else start the conversation... \n");
-        }
-
-        // Wait for server to send peer port
-        Read(sockfd, recvline, MAXLINE);
-        printf("Starting chat with %s\n", recvline);
-        
-        // Set peer address and socket
-        peerfd = Socket(AF_INET, SOCK_DGRAM, 0);    
-        peeraddr.sin_family = AF_INET;
-        peeraddr.sin_addr.s_addr = INADDR_ANY;
-        peeraddr.sin_port   = htons(atoi(recvline));
-        storeMessage("starting chat", "-", recvline);
-
-        char message[MAXDATASIZE];
-        unsigned int len = sizeof(peeraddr);
-
-   
-        if (initiate == 'y') {
-            GetSockName(sockfd, (struct sockaddr *) &myaddr, &len);
-            myaddr.sin_family = AF_INET;
-            myaddr.sin_addr.s_addr = INADDR_ANY;
-            
-            if (bind(peerfd, (const struct sockaddr *) &myaddr, len) < 0) {
-                fprintf(stdout, "Failed to bind\n");
-            }
+    int count = atoi(line + 1);
+    printf("Clients connected: \n");
+    if (count == 0) {
+        printf("No clients connected\n");
+    }
+    for (int i = 0; i < count; i++) {
+        readLine(serverfd, &reader, line);
+        directoryAdd(strtoul(line, NULL, 10));
+        printf("%s\n", line);
+    }
+    printHelp();
 
-            memset(message, 0, MAXDATASIZE);
-            recvfrom(peerfd, message, MAXDATASIZE, 0, (struct sockaddr *) &peeraddr, &len);
-            fprintf(stdout, "\n%s%s: %s %s", KGRN, recvline, message, KNRM);
-            storeMessage(message, recvline, recvline);
+    // One loop serves the keyboard, the server and every chat, none of them waits for another
+    for (;;) {
+        struct pollfd fds[3] = {
+            { STDIN_FILENO, POLLIN, 0 },
+            { serverfd, POLLIN, 0 },
+            { peerfd, POLLIN, 0 },
+        };
 
-            if (strcmp(message, "finalizar_chat") == 0) {
-                storeMessage("finishing chat", "-", recvline);
-                close(peerfd);
-                continue;
+        while (nextLine(&reader, line)) {
+            handleServerLine(line);
+        }
+        // Lines typed faster than the peer acknowledges wait in the reader, then in stdin
+        while (!quitting && !inputBlocked() && nextLine(&input, line)) {
+            quitting = handleCommand(line);
+        }
+        if (quitting || (!inputOpen && !inputBlocked())) {
+            quitting = 1;
+            for (int i = 0; i < MAXCHATS; i++) {
+                if (chats[i].used) {
+                    chatEnd(&chats[i]);
+                }
             }
         }
-
-        for (;;) {
-            fprintf(stdout, "\nMe: ");
-            // fgets(message, MAXDATASIZE, stdin); // Reads a whole line instead of a word, but reads a couple of phantom lines before... 
-            memset(message, 0, MAXDATASIZE);
-            fscanf(stdin, "%s", message);
-            sendto(peerfd, message, strlen(message), 0, (const struct sockaddr *) &peeraddr , len);
-            storeMessage(message, "me", recvline);
-
-            if (strcmp(message, "finalizar_chat") == 0) {
-                write(sockfd, message, sizeof(message));
-                break;
+        for (int i = 0; i < MAXCHATS; i++) {
+            if (chats[i].used) {
+                chatService(&chats[i]);
+                fds[2].events |= chats[i].used && channelBlocked(&chats[i].channel) ? POLLOUT : 0;
             }
+        }
+        if (quitting && chatsOpen() == 0) {
+            break;
+        }
+        fds[0].fd = quitting || !inputOpen || inputBlocked() ? -1 : STDIN_FILENO;
+        historyTick();
+        fflush(stdout);
 
-            memset(message, 0, MAXDATASIZE);
-            recvfrom(peerfd, message, MAXDATASIZE, 0, (struct sockaddr *) &peeraddr, &len);
-            storeMessage(message, recvline, recvline);
-            fprintf(stdout, "\n%s%s: %s %s", KGRN, recvline, message, KNRM);
+        int timeout = chatsTimeout(), historyWait = historyTimeout();
+        if (historyWait >= 0 && (timeout < 0 || historyWait < timeout)) {
+            timeout = historyWait;
+        }
+        if (poll(fds, 3, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
 
-            if (strcmp(message, "finalizar_chat") == 0) {
-                break;
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            inputOpen = fillReader(STDIN_FILENO, &input) != 0;
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (fillReader(serverfd, &reader) == 0) {
+                printf("Server closed the connection\n");
+                exit(0);
             }
         }
-        
-        storeMessage("finishing chat", "-", recvline);
-        close(peerfd);
-    } 
+        if (fds[2].revents & POLLIN) {
+            receiveDatagrams();
+        }
+    }
 
     exit(0);
-}
\ No newline at end of file
+}
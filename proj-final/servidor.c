@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -6,194 +8,699 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/types.h>
-#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
-#include <unistd.h>
 #include <signal.h>
 
+#include "net.h"
+
 #define MAXDATASIZE 100
 #define MAXLINE 4096
+#define LISTENQ 1024
+#define DIRECTORY_BUCKETS 1024      /* initial hash buckets, doubled as clients arrive */
+#define DIRECTORY_DELTADELAY 10     /* ms join/leave deltas are batched before being pushed */
+#define MAXQUEUED 256               /* messages a client may have waiting before it is dropped */
+#define MAXBUFFERED 65536           /* bytes of replies to a client alone that may wait, besides its snapshot */
+#define MAXIOV 64
+#define ROOM_BUCKETS 256
+#define ROOM_NAMESIZE 32
+#define ENDCHAT "finalizar_chat"
 #define KGRN  "\x1B[32m"
 #define KNRM  "\x1B[0m"
 
-// WRAPPER FUNCTIONS
+/* Protocol: both sides write text lines. The client sends
+ *   <id>       the id of the client it wants to talk to, or ENDCHAT
+ *   J<room>    join a room, leaving the current one
+ *   S<text>    say something in the current room
+ *   Q          leave the current room
+ * The server sends
+ *   I<id>      the id of the client, first line on connect
+ *   L<count>   followed by count lines with the ids of the other connected clients
+ *   +<id>      a client connected
+ *   -<id>      a client disconnected
+ *   P<port>    port of the peer of a chat that is starting
+ *   R<count>   the room was joined, count members in it
+ *   J<id>      a client joined the room
+ *   Q<id>      a client left the room
+ *   M<id> <text> a client said something in the room
+ */
 
-/** @brief Wrapper function for getpeername: gets socket information.
+/** @brief Bytes sent to many clients. Each client queue holds a reference instead of a
+ *         copy, and the last one to send it gives it back to the pool.
+ */
+struct message {
+    int refs;
+    size_t cap;                 /* size of the pool block */
+    size_t length;
+    char data[];
+};
+
+/** @brief A connected client. Its output is the connection buffer, for what the socket did
+ *         not accept while nothing was queued, followed by the queue of messages.
+ */
+struct chatClient {
+    struct netConnection net;
+    uint32_t id;
+    uint32_t peer;              /* id of the client it is chatting with, 0 if none */
+    size_t deltaOffset;         /* deltas queued before it connected, already in its snapshot */
+    struct message **queue;     /* MAXQUEUED entries from the pool, NULL while nothing is queued */
+    size_t queueCap;
+    int queueHead;
+    int queued;
+    size_t queueOffset;         /* bytes of the first queued message already sent */
+    int dropped;                /* the queue overflowed, close on the next event */
+    struct room *room;
+    struct chatClient *roomPrev;
+    struct chatClient *roomNext;
+    struct chatClient *hashNext;
+    struct chatClient *prev;
+    struct chatClient *next;
+};
+
+/** @brief A chat room, freed when its last member leaves.
+ */
+struct room {
+    char name[ROOM_NAMESIZE];
+    uint32_t count;
+    struct chatClient *members;
+    struct room *hashNext;
+};
+
+/** @brief Every connected client, chained in a hash table keyed by id and listed in
+ *         connection order. The snapshot sent to newcomers is kept encoded: joins append to
+ *         it, leaves mark it stale until the next connection rebuilds it.
+ */
+struct directory {
+    struct chatClient **buckets;
+    uint32_t nbuckets;          /* power of two */
+    uint32_t count;
+    uint32_t nextId;
+    struct chatClient *first;
+    struct chatClient *last;
+    struct buffer snapshot;
+    int snapshotStale;
+    struct buffer deltas;       /* join/leave lines not pushed yet */
+    struct timer deltaTimer;
+};
+
+struct reactor reactor;
+struct directory directory;
+struct room *rooms[ROOM_BUCKETS];
+struct slab clientSlab;
+struct slab roomSlab;
+
+// OUTPUT
+
+/** @brief Creates a message holding one reference, for its creator.
  *
- *  @param connfd socket identifier.
- *  @param addrSize size of the returned address.
- *  @return socket address.
+ *  @param data bytes of the message.
+ *  @param length number of bytes.
+ *  @return new message.
  */
-struct sockaddr_in GetPeerName(int connfd, int addrSize) {
-    struct sockaddr_in addr;
-    socklen_t len = addrSize;
-    if (getpeername(connfd, (struct sockaddr*)&addr, &len) == -1 ) {
-        perror("getpeername");
-        exit(1);
+struct message* messageCreate(const char *data, size_t length) {
+    size_t cap;
+    struct message *msg = poolAlloc(sizeof(struct message) + length, &cap);
+
+    msg->refs = 1;
+    msg->cap = cap;
+    msg->length = length;
+    memcpy(msg->data, data, length);
+    return msg;
+}
+
+void messageRelease(struct message *msg) {
+    if (--msg->refs == 0) {
+        poolFree(msg, msg->cap);
     }
-    return addr;
 }
 
-/** @brief Wrapper function for accept: accepts a client connection.
+/** @brief Marks a client that is not reading dropped and shuts its socket down, so its own
+ *         handler closes it.
  *
- *  @param listenfd socket identifier.
- *  @param servaddr server address.
- *  @param addrlen server address size.
- *  @return new socket identifier.
+ *  @param client client.
  */
-int Accept(int listenfd, struct sockaddr* addr, unsigned int* addrlen) {
-    int connfd;
-    
-    if ((connfd = accept(listenfd, addr, addrlen)) == -1) {
-        perror("accept");
-        exit(1);
+void clientDrop(struct chatClient *client) {
+    printf("\nClient %u is not reading, dropped\n", client->id);
+    client->dropped = 1;
+    // Re-arming would only report a socket that is ready right now, and one that stopped
+    // reading and sends nothing is not. The shutdown raises EPOLLHUP on it in any case
+    shutdown(client->net.watcher.fd, SHUT_RDWR);
+}
+
+/** @brief Appends a message to the queue of a client. A client whose queue is full is
+ *         dropped.
+ *
+ *  @param client client.
+ *  @param msg message, a reference is taken.
+ */
+void clientQueue(struct chatClient *client, struct message *msg) {
+    if (client->dropped) {
+        return;
     }
+    if (client->queued == MAXQUEUED) {
+        clientDrop(client);
+        return;
+    }
+    if (client->queue == NULL) {
+        client->queue = poolAlloc(MAXQUEUED * sizeof(struct message *), &client->queueCap);
+    }
+    msg->refs++;
+    client->queue[(client->queueHead + client->queued++) % MAXQUEUED] = msg;
+}
+
+/** @brief Sends a shared message to a client, straight to the socket when nothing is waiting
+ *         before it, queueing a reference to what the socket does not accept. Failed writes
+ *         are left to the client handler, which sees the error next.
+ *
+ *  @param client client.
+ *  @param msg message.
+ */
+void clientSendMessage(struct chatClient *client, struct message *msg) {
+    ssize_t n = 0;
 
-    return connfd;
+    if (client->queued == 0 && bufferLength(&client->net.out) == 0 && !client->dropped) {
+        if ((n = write(client->net.watcher.fd, msg->data, msg->length)) == (ssize_t) msg->length) {
+            return;
+        }
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return;
+            }
+            n = 0;
+        }
+    }
+    clientQueue(client, msg);
+    if (client->queued == 1) {
+        client->queueOffset = n;
+    }
 }
 
-/** @brief Wrapper function for socket: Creates a socket.
+/** @brief Sends bytes only this client gets, copying them to a message if others are queued.
+ *         What the socket does not take waits in the connection buffer, and a client that
+ *         lets more than its snapshot and MAXBUFFERED bytes pile up there is dropped, as one
+ *         with a full queue is.
  *
- *  @param family address family.
- *  @param type socket type.
- *  @param flags family flags.
- *  @return new socket identifier.
+ *  @param client client.
+ *  @param iov bytes to send.
+ *  @param iovcnt number of entries of iov.
  */
-int Socket(int family, int type, int flags) {
-    int listenfd;
+void clientSend(struct chatClient *client, const struct iovec *iov, int iovcnt) {
+    if (client->dropped) {
+        return;
+    }
+    if (client->queued == 0) {
+        netWritev(&client->net, iov, iovcnt);
+        if (bufferLength(&client->net.out) > MAXBUFFERED + bufferLength(&directory.snapshot)) {
+            clientDrop(client);
+        }
+        return;
+    }
 
-    if ((listenfd = socket(family, type, flags)) == -1) {
-        perror("socket");
-        exit(1);
+    struct buffer bytes = {};
+    for (int i = 0; i < iovcnt; i++) {
+        bufferAppend(&bytes, iov[i].iov_base, iov[i].iov_len);
     }
-    
-    return listenfd;
+    struct message *msg = messageCreate(bufferData(&bytes), bufferLength(&bytes));
+    clientQueue(client, msg);
+    messageRelease(msg);
+    bufferFree(&bytes);
 }
 
-/** @brief Wrapper function for bind: connects a socket to an address.
+/** @brief Writes as many queued messages as the socket accepts, MAXIOV per writev.
  *
- *  @param listenfd socket identifier.
- *  @param servaddr server address.
- *  @param size server address size.
+ *  @param client client.
+ *  @return 0 if the queue was sent or the socket would block, -1 on error.
  */
-void Bind(int listenfd, struct sockaddr_in servaddr, int size) {
-    if (bind(listenfd, (struct sockaddr *)&servaddr, size) == -1) {
-        perror("socket");
-        exit(1);
+int clientFlushQueue(struct chatClient *client) {
+    while (client->queued > 0) {
+        struct iovec iov[MAXIOV];
+        int iovcnt = 0;
+
+        for ( ; iovcnt < MAXIOV && iovcnt < client->queued; iovcnt++) {
+            struct message *msg = client->queue[(client->queueHead + iovcnt) % MAXQUEUED];
+            size_t offset = iovcnt == 0 ? client->queueOffset : 0;
+
+            iov[iovcnt].iov_base = msg->data + offset;
+            iov[iovcnt].iov_len = msg->length - offset;
+        }
+
+        ssize_t n = writev(client->net.watcher.fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        n += client->queueOffset;
+        while (client->queued > 0 && (size_t) n >= client->queue[client->queueHead]->length) {
+            n -= client->queue[client->queueHead]->length;
+            messageRelease(client->queue[client->queueHead]);
+            client->queueHead = (client->queueHead + 1) % MAXQUEUED;
+            client->queued--;
+        }
+        client->queueOffset = n;
     }
+
+    // Most clients keep up, their queue only exists while the socket is full
+    poolFree(client->queue, client->queueCap);
+    client->queue = NULL;
+    return 0;
 }
 
-/** @brief Wrapper function for listen: Makes a socket passive.
+// DIRECTORY
+
+/** @brief Finds a connected client.
  *
- *  @param listenfd socket identifier.
- *  @param backlog connection buffer size.
+ *  @param id client id.
+ *  @return the client, NULL if no client has that id.
  */
-void Listen(int listenfd, int backlog) {
-    if (listen(listenfd, backlog) == -1) {
-        perror("listen");
+struct chatClient* directoryFind(uint32_t id) {
+    struct chatClient *client = directory.buckets[id & (directory.nbuckets - 1)];
+
+    while (client != NULL && client->id != id) {
+        client = client->hashNext;
+    }
+    return client;
+}
+
+/** @brief Doubles the hash table once it holds as many clients as buckets.
+ */
+void directoryGrow() {
+    uint32_t nbuckets = directory.nbuckets * 2;
+    struct chatClient **buckets = calloc(nbuckets, sizeof(struct chatClient*));
+
+    if (buckets == NULL) {
+        perror("calloc");
         exit(1);
     }
+    for (struct chatClient *client = directory.first; client != NULL; client = client->next) {
+        client->hashNext = buckets[client->id & (nbuckets - 1)];
+        buckets[client->id & (nbuckets - 1)] = client;
+    }
+    free(directory.buckets);
+    directory.buckets = buckets;
+    directory.nbuckets = nbuckets;
 }
 
-/** @brief Section copied from the slides, regarding SIGCHLD handling.
+/** @brief Queues a join or leave line to be pushed to every client.
+ *
+ *  @param kind '+' or '-'.
+ *  @param id client id.
  */
-typedef void Sigfunc(int);
-
-Sigfunc* Signal (int signo, Sigfunc *func) {
-    struct sigaction act, oact;
-
-    act.sa_handler = func;
-    
-    sigemptyset (&act.sa_mask); /* Outros sinais não são bloqueados*/
-    
-    act.sa_flags = 0;
-    
-    if (signo == SIGALRM) { /* Para reiniciar chamadas interrompidas */
-        #ifdef SA_INTERRUPT
-        act.sa_flags |= SA_INTERRUPT; /* SunOS 4.x */
-        #endif
-    } else {
-        #ifdef SA_RESTART
-        act.sa_flags |= SA_RESTART; /* SVR4, 4.4BSD */
-        #endif
+void directoryPublish(char kind, uint32_t id) {
+    char line[16];
+
+    bufferAppend(&directory.deltas, line, snprintf(line, sizeof(line), "%c%u\n", kind, id));
+    if (!timerRunning(&directory.deltaTimer)) {
+        timerStart(&reactor, &directory.deltaTimer, DIRECTORY_DELTADELAY);
     }
+}
+
+/** @brief Pushes the queued deltas, one write per client for the whole batch. The batch is a
+ *         single shared message, so a client that stopped reading holds references to it and
+ *         is dropped after MAXQUEUED batches, like with any other message. Clients that joined
+ *         during the batch get a message of their own with the deltas after their snapshot.
+ *         Failed writes are left to the client handlers, which see the error next.
+ */
+void directoryDeltasExpired(struct reactor *reactor, struct timer *timer) {
+    struct message *batch = messageCreate(bufferData(&directory.deltas), bufferLength(&directory.deltas));
 
-    if (sigaction (signo, &act, &oact) < 0) {
-        return (SIG_ERR);
+    for (struct chatClient *client = directory.first; client != NULL; client = client->next) {
+        if (client->deltaOffset == 0) {
+            clientSendMessage(client, batch);
+        } else if (client->deltaOffset < bufferLength(&directory.deltas)) {
+            struct message *msg = messageCreate(bufferData(&directory.deltas) + client->deltaOffset, bufferLength(&directory.deltas) - client->deltaOffset);
+
+            clientSendMessage(client, msg);
+            messageRelease(msg);
+        }
+        client->deltaOffset = 0;
     }
-    
-    return (oact.sa_handler);
+    messageRelease(batch);
+    bufferConsume(&directory.deltas, bufferLength(&directory.deltas));
 }
 
-void sig_chld(int signo) {
-	pid_t pid;
-	int stat;
+/** @brief Sends a new client its id and the list of connected clients, in a single writev.
+ *
+ *  @param client the client that just connected, not in the directory yet.
+ */
+void directorySnapshot(struct chatClient *client) {
+    char header[32];
+
+    if (directory.snapshotStale) {
+        char line[16];
 
-	while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
-		printf("child %d terminated\n", pid);
+        bufferConsume(&directory.snapshot, bufferLength(&directory.snapshot));
+        for (struct chatClient *other = directory.first; other != NULL; other = other->next) {
+            bufferAppend(&directory.snapshot, line, snprintf(line, sizeof(line), "%u\n", other->id));
+        }
+        directory.snapshotStale = 0;
     }
 
-	return;
+    struct iovec iov[2] = {
+        { header, snprintf(header, sizeof(header), "I%u\nL%u\n", client->id, directory.count) },
+        { bufferData(&directory.snapshot), bufferLength(&directory.snapshot) },
+    };
+    clientSend(client, iov, 2);
 }
 
-/** @brief Wrapper function for read: reads information from socket.
+/** @brief Gives a client an id, sends it the snapshot and announces it to the others.
  *
- *  @param sockfd socket identifier.
- *  @param buf buffer where the information read from the socket will be written.
- *  @param count how many bytes will be read at most.
- *  @return size of read information.
+ *  @param client new client.
  */
-int Read(int sockfd, void *buf, size_t count) {
-    int n = read(sockfd, buf, count);
+void directoryAdd(struct chatClient *client) {
+    char line[16];
 
-    if (n < 0) {
-        perror("read error");
-        exit(1);
+    client->id = directory.nextId++;
+    directorySnapshot(client);
+
+    if (directory.count >= directory.nbuckets) {
+        directoryGrow();
     }
+    client->hashNext = directory.buckets[client->id & (directory.nbuckets - 1)];
+    directory.buckets[client->id & (directory.nbuckets - 1)] = client;
+    directory.count++;
+
+    client->prev = directory.last;
+    client->next = NULL;
+    if (directory.last != NULL) {
+        directory.last->next = client;
+    } else {
+        directory.first = client;
+    }
+    directory.last = client;
 
-    return n;
+    if (!directory.snapshotStale) {
+        bufferAppend(&directory.snapshot, line, snprintf(line, sizeof(line), "%u\n", client->id));
+    }
+    directoryPublish('+', client->id);
+    client->deltaOffset = bufferLength(&directory.deltas);
 }
 
+void directoryRemove(struct chatClient *client) {
+    struct chatClient **link = &directory.buckets[client->id & (directory.nbuckets - 1)];
+
+    while (*link != client) {
+        link = &(*link)->hashNext;
+    }
+    *link = client->hashNext;
+    directory.count--;
+
+    if (client->prev != NULL) {
+        client->prev->next = client->next;
+    } else {
+        directory.first = client->next;
+    }
+    if (client->next != NULL) {
+        client->next->prev = client->prev;
+    } else {
+        directory.last = client->prev;
+    }
+
+    directory.snapshotStale = 1;
+    directoryPublish('-', client->id);
+}
+
+void directoryInit() {
+    directory.nbuckets = DIRECTORY_BUCKETS;
+    if ((directory.buckets = calloc(directory.nbuckets, sizeof(struct chatClient*))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    directory.nextId = 1;
+    timerInit(&directory.deltaTimer, directoryDeltasExpired, NULL);
+}
+
+// CHAT
+
 /** @brief Sends a client addr port to another client.
  *
- *  @param sourceConn the connection that will have the addr port sent.
- *  @param destConn the connection that will receive the addr port.
- *  @param servaddr the addr of this server.
+ *  @param source the client that will have the addr port sent.
+ *  @param dest the client that will receive the addr port.
  */
-void notifyClient(int sourceConn, int destConn, struct sockaddr_in servaddr) {
+void notifyClient(struct chatClient *source, struct chatClient *dest) {
     char buf[MAXDATASIZE];
+    struct iovec iov = { buf, snprintf(buf, sizeof(buf), "P%d\n", ntohs(source->net.addr.sin_port)) };
+
+    printf("\nSending %d to %u", ntohs(source->net.addr.sin_port), dest->id);
+    clientSend(dest, &iov, 1);
+}
 
-    struct sockaddr_in addr = GetPeerName(sourceConn, sizeof(servaddr));
+// ROOMS
 
-    snprintf(buf, sizeof(buf), "%d",  ntohs(addr.sin_port));
-    printf("\nSending %d to %d", ntohs(addr.sin_port), destConn);
-    write(destConn, buf, sizeof(buf));
+uint32_t roomHash(const char *name) {
+    uint32_t hash = 2166136261u;
+
+    while (*name != '\0') {
+        hash = (hash ^ (unsigned char) *name++) * 16777619u;
+    }
+    return hash % ROOM_BUCKETS;
 }
 
-/** @brief Sends the list of connected clients to a connected client.
+/** @brief Sends one copy of a line to every member of a room.
  *
- *  @param clients the list of connected clients.
- *  @param clients_count size of conneted clients list.
- *  @param connfd socket identifier.
+ *  @param room room.
+ *  @param except member that does not get it, may be NULL.
+ *  @param data the line.
+ *  @param length size of the line.
  */
-void sendConnectedClients(int* clients, int clients_count, int connfd) {
-    char buf[MAXDATASIZE];
+void roomBroadcast(struct room *room, struct chatClient *except, const char *data, size_t length) {
+    struct message *msg = messageCreate(data, length);
+
+    for (struct chatClient *member = room->members; member != NULL; member = member->roomNext) {
+        if (member != except) {
+            clientSendMessage(member, msg);
+        }
+    }
+    messageRelease(msg);
+}
+
+void roomLeave(struct chatClient *client) {
+    struct room *room = client->room;
+    char line[32];
 
-    if (clients_count == 0) {
-        snprintf(buf, sizeof(buf), "No clients connected");
-        write(connfd, buf, strlen(buf));
+    if (room == NULL) {
+        return;
+    }
+    if (client->roomPrev != NULL) {
+        client->roomPrev->roomNext = client->roomNext;
     } else {
-        for (int i = 0; i < clients_count; i++) {
-            snprintf(buf, sizeof(buf), "%d\n",  clients[i]);
-            write(connfd, buf, strlen(buf));
+        room->members = client->roomNext;
+    }
+    if (client->roomNext != NULL) {
+        client->roomNext->roomPrev = client->roomPrev;
+    }
+    client->room = NULL;
+
+    if (--room->count > 0) {
+        roomBroadcast(room, NULL, line, snprintf(line, sizeof(line), "Q%u\n", client->id));
+        return;
+    }
+
+    struct room **link = &rooms[roomHash(room->name)];
+    while (*link != room) {
+        link = &(*link)->hashNext;
+    }
+    *link = room->hashNext;
+    slabFree(&roomSlab, room);
+}
+
+/** @brief Moves a client into a room, creating it if needed.
+ *
+ *  @param client client.
+ *  @param name room name, truncated to ROOM_NAMESIZE - 1 bytes.
+ */
+void roomJoin(struct chatClient *client, const char *name) {
+    char line[32];
+    struct room *room;
+
+    roomLeave(client);
+
+    char key[ROOM_NAMESIZE];
+    snprintf(key, sizeof(key), "%s", name);
+
+    for (room = rooms[roomHash(key)]; room != NULL && strcmp(room->name, key) != 0; room = room->hashNext);
+    if (room == NULL) {
+        room = slabAlloc(&roomSlab);
+        strcpy(room->name, key);
+        room->hashNext = rooms[roomHash(key)];
+        rooms[roomHash(key)] = room;
+    }
+
+    roomBroadcast(room, NULL, line, snprintf(line, sizeof(line), "J%u\n", client->id));
+
+    client->room = room;
+    client->roomPrev = NULL;
+    client->roomNext = room->members;
+    if (room->members != NULL) {
+        room->members->roomPrev = client;
+    }
+    room->members = client;
+    room->count++;
+
+    struct iovec iov = { line, snprintf(line, sizeof(line), "R%u\n", room->count) };
+    clientSend(client, &iov, 1);
+    printf("\nClient %u joined room '%s', %u members\n", client->id, room->name, room->count);
+}
+
+/** @brief Relays a line said by a client to the other members of its room.
+ *
+ *  @param client client.
+ *  @param text what it said.
+ */
+void roomSay(struct chatClient *client, const char *text) {
+    char line[MAXLINE + 32];
+
+    if (client->room != NULL) {
+        roomBroadcast(client->room, client, line, snprintf(line, sizeof(line), "M%u %s\n", client->id, text));
+    }
+}
+
+void closeClient(struct chatClient *client) {
+    time_t clock = time(NULL);
+    struct chatClient *peer = directoryFind(client->peer);
+
+    if (peer != NULL && peer->peer == client->id) {
+        peer->peer = 0;
+    }
+    printf("%s%.24s - Client disconnected: %u \n%s", KGRN, ctime(&clock), client->id, KNRM);
+
+    roomLeave(client);
+    for ( ; client->queued > 0; client->queued--) {
+        messageRelease(client->queue[client->queueHead]);
+        client->queueHead = (client->queueHead + 1) % MAXQUEUED;
+    }
+    poolFree(client->queue, client->queueCap);
+    directoryRemove(client);
+    netClose(&reactor, &client->net);
+    slabFree(&clientSlab, client);
+}
+
+/** @brief Pairs two clients, sending each one the port of the other.
+ *
+ *  @param client client that asked for the chat.
+ *  @param target text id of the client it wants to talk to.
+ */
+void startChat(struct chatClient *client, const char *target) {
+    struct chatClient *peer = directoryFind(strtoul(target, NULL, 10));
+
+    printf("\nClient %u wants to talk to %s\n", client->id, target);
+
+    // Unknown ids are ignored, the client stays waiting for someone to call it
+    if (peer == NULL || peer == client) {
+        printf("\nNo client %s, request of %u ignored\n", target, client->id);
+        return;
+    }
+
+    client->peer = peer->id;
+    peer->peer = client->id;
+
+    notifyClient(client, peer);
+    notifyClient(peer, client);
+}
+
+/** @brief Handles the request lines of a client that arrived whole.
+ *
+ *  @param client client.
+ *  @return 0 on success, -1 if the connection must be closed.
+ */
+int handleRequests(struct chatClient *client) {
+    for ( ; ; ) {
+        char *data = bufferData(&client->net.in);
+        char *end = memchr(data, '\n', bufferLength(&client->net.in));
+        char request[MAXLINE + 1];
+
+        if (end == NULL) {
+            return bufferLength(&client->net.in) > MAXLINE ? -1 : 0;
+        }
+        snprintf(request, sizeof(request), "%.*s", (int) (end - data), data);
+        bufferConsume(&client->net.in, end - data + 1);
+
+        if (strcmp(request, ENDCHAT) == 0) {
+            struct chatClient *peer = directoryFind(client->peer);
+
+            if (peer != NULL && peer->peer == client->id) {
+                peer->peer = 0;
+            }
+            client->peer = 0;
+            fprintf(stdout, "\n%u ended the conversation.", client->id);
+            fflush(stdout);
+        } else if (request[0] == 'J') {
+            roomJoin(client, request + 1);
+        } else if (request[0] == 'S') {
+            roomSay(client, request + 1);
+        } else if (request[0] == 'Q') {
+            roomLeave(client);
+        } else {
+            startChat(client, request);
         }
     }
 }
 
+/** @brief Reactor handler of a client: sends what is queued and handles what arrived.
+ *
+ *  @param reactor reactor.
+ *  @param watcher watcher of the client socket.
+ *  @param events epoll events.
+ */
+void handleClient(struct reactor *reactor, struct watcher *watcher, uint32_t events) {
+    struct chatClient *client = watcher->data;
+    ssize_t n;
+    int flushed;
+
+    if (client->dropped || (flushed = netFlush(&client->net)) < 0 || (flushed == 0 && clientFlushQueue(client) < 0)) {
+        closeClient(client);
+        return;
+    }
+    while ((n = netFill(&client->net)) > 0) {
+        if (handleRequests(client) < 0) {
+            closeClient(client);
+            return;
+        }
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        closeClient(client);
+    }
+}
+
+/** @brief Accepts every pending client and adds it to the directory.
+ *
+ *  @param reactor reactor.
+ *  @param watcher watcher of the listening socket.
+ *  @param events epoll events.
+ */
+void acceptClients(struct reactor *reactor, struct watcher *watcher, uint32_t events) {
+    int connfd;
+
+    for ( ; ; ) {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+
+        if ((connfd = accept4(watcher->fd, (struct sockaddr *) &addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+
+        struct chatClient *client = slabAlloc(&clientSlab);
+        netInit(&client->net, connfd, &addr, handleClient, client);
+        directoryAdd(client);
+
+        time_t clock = time(NULL);
+        printf("%s%.24s - Client connected: %u \n%s", KGRN, ctime(&clock), client->id, KNRM);
+
+        reactorAdd(reactor, &client->net.watcher, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    }
+}
+
 /** @brief Validate program arguments.
  *
  *  @param argc number of arguments.
@@ -212,12 +719,8 @@ void assertValidArgs(int argc, char **argv) {
 }
 
 int main(int argc, char **argv) {
-    int    listenfd, connfd, n;
+    int    listenfd;
     struct sockaddr_in servaddr;
-    char   recvline[MAXLINE + 1];
-    int clients[MAXDATASIZE] = {};
-    int clients_count = 0;
-    socklen_t len = sizeof(servaddr);
 
     assertValidArgs(argc, argv);
 
@@ -229,49 +732,20 @@ int main(int argc, char **argv) {
     servaddr.sin_port        = htons(strtod(argv[1], NULL));
 
     Bind(listenfd, servaddr, sizeof(servaddr));
-    void sig_chld(int);
-    Listen(listenfd, 2);
-    Signal(SIGCHLD, sig_chld);
-    
-
-    for ( ; ; ) {
-
-        if ((connfd = Accept(listenfd, (struct sockaddr *) NULL, &len)) < 0) {
-            if (errno == EINTR) {
-                continue; /* se for tratar o sinal, quando voltar dá erro em funções lentas */
-            } else {
-                perror("accept error");
-            }
-        }
-    
-        time_t clock = time(NULL);
-        printf("%s%.24s - Client connected: %d \n%s", KGRN, ctime(&clock), connfd, KNRM);
-
-        sendConnectedClients(clients, clients_count, connfd);
-
-        clients[clients_count] = connfd;
-        clients_count = clients_count + 1;
+    Listen(listenfd, LISTENQ);
 
-        if (fork() == 0) {
-            close(listenfd);
+    // Every client lives in this process, so the directory is the only copy of the client table
+    struct watcher listener = { listenfd, 0, acceptClients, NULL };
 
-            while (((n = Read(connfd, recvline, MAXLINE)) > 0)) {
-                recvline[n] = '\0';
+    reactorInit(&reactor);
+    directoryInit();
+    slabInit(&clientSlab, "client", sizeof(struct chatClient));
+    slabInit(&roomSlab, "room", sizeof(struct room));
+    poolReportOnSignal(SIGUSR1);
+    Signal(SIGPIPE, SIG_IGN);
+    SetNonBlocking(listenfd);
+    reactorAdd(&reactor, &listener, EPOLLIN | EPOLLET);
 
-                if (strcmp(recvline, "finalizar_chat") == 0) {
-                    fprintf(stdout, "\n%d ended the conversation.", connfd);
-                    fflush(stdout);
-                } else {
-                    printf("\nClient %d wants to talk to %s\n", connfd, recvline);
-                    
-                    notifyClient(connfd, atoi(recvline), servaddr);
-                    notifyClient(atoi(recvline), connfd, servaddr);
-                    
-                    bzero(recvline, MAXDATASIZE);
-                }
-
-            }
-        }
-    }
+    reactorRun(&reactor);
     return(0);
-}
\ No newline at end of file
+}